@@ -534,34 +534,13 @@ int main(){
 
 struct RemoveEndgenousFolder{
         std::shared_ptr<Operator> Fold(std::shared_ptr<Operator> root){
-                if( root->Kind() == OPKind_EndgenousSymbol ){
-                        auto as_endgenous = std::reinterpret_pointer_cast<EndgenousSymbol>(root);
-                        return this->Fold(as_endgenous->Expr());
-                }
-                
-                if( root->IsNonTerminal() ){
-                        for(size_t idx=0;idx!=root->Arity();++idx){
-                                auto folded = this->Fold(root->At(idx));
-                                root->Rebind(idx, folded);
-                        }
-                }
-
-                return root;
+                Transform::RemoveEndo pass(RewriteMode_InPlace);
+                return pass.Apply(root);
         }
 };
 
-struct RemoveEndo : OperatorTransform{
-        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                auto candidate = ptr->Clone(shared_from_this());
-                if( candidate->Kind() == OPKind_EndgenousSymbol ){
-                        if( auto typed = std::dynamic_pointer_cast<EndgenousSymbol>(candidate)){
-                                return typed->Expr();
-                        }
-                }
-                return candidate;
-        }
-};
-struct RemapUnique : OperatorTransform{
+using Transform::RemoveEndo;
+struct RemapUnique : Rewriter{
         explicit RemapUnique(std::string const& prefix = "__symbol_")
                 : prefix_{prefix}
         {
@@ -573,14 +552,14 @@ struct RemapUnique : OperatorTransform{
         void mutate_prefix(std::string const& prefix){
                 prefix_ = prefix;
         }
-        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
 
-                auto candidate = ptr->Clone(shared_from_this());
+                auto candidate = Rebuild(ptr);
 
-                auto key = std::make_tuple(
-                        candidate->NameInvariantOfChildren(),
-                        candidate->Children()
-                        );
+                // the children have already been remapped, so they're
+                // unique and comparing them by pointer is enough
+                auto const& key = candidate;
 
                 auto iter = ops_.find(key);
                 if( iter != ops_.end() )
@@ -607,12 +586,11 @@ struct RemapUnique : OperatorTransform{
         }
 private:
         std::string prefix_;
-        std::map<
-                std::tuple<
-                        std::string,
-                        std::vector<std::shared_ptr<Operator> > 
-                >,
-                std::shared_ptr<Operator>
+        std::unordered_map<
+                std::shared_ptr<Operator>,
+                std::shared_ptr<Operator>,
+                OperatorHash,
+                OperatorShallowEqual
         > ops_;
 };
 
@@ -650,16 +628,22 @@ void black_scholes_template_opt(){
         //black_expr->Display();
         std::cout << "black_expr->Eval(ST) => " << black_expr->Eval(ST) << "\n"; // __CandyPrint__(cxx-print-scalar,black_expr->Eval(ST))
 
-        auto removed_endo = remove_endogous.Fold(black_expr);
-
         auto params = std::vector<std::string>{ "t", "T", "r", "S", "K", "vol" };
 
+        // differentiate through the statements rather than inlining
+        // them, so the derivatives keep the statement structure
         std::vector<std::shared_ptr<Operator> > ticker;
         for(auto const& s : params){
-                auto raw_diff = removed_endo->Diff(s);
+                auto raw_diff = black_expr->TotalDiff(s);
                 ticker.push_back(raw_diff);
         }
 
+        auto removed_endo = remove_endogous.Fold(black_expr);
+
+        // RemapUnique only matches nodes with the very same operands in
+        // the same order, so number the values first
+        Transform::GlobalValueNumbering gvn;
+        Transform::StrengthReduce reduce;
         auto unique_mapper = std::make_shared<RemapUnique>();
 
         std::ofstream out("black_better.h");
@@ -676,7 +660,7 @@ void black_scholes_template_opt(){
         std::unordered_set<std::shared_ptr<Operator> > seen;
         std::shared_ptr<EndgenousSymbol> return_;
         for(size_t idx=0;idx!=ticker.size();++idx){
-                auto constant_folded = constant_fold.Fold(ticker[idx]);
+                auto constant_folded = gvn.Apply(reduce.Apply(constant_fold.Fold(ticker[idx])));
                 
                 auto unique          = constant_folded->Clone(unique_mapper);
 
@@ -702,7 +686,7 @@ void black_scholes_template_opt(){
                 //unique->Display();
         }
 
-        auto constant_folded = constant_fold.Fold(removed_endo);
+        auto constant_folded = gvn.Apply(reduce.Apply(constant_fold.Fold(removed_endo)));
         
         auto unique          = constant_folded->Clone(unique_mapper);
 
@@ -801,6 +785,31 @@ struct DataFlow{
                 }
         }
         #endif
+        /*
+                sum of the adjoint contributions of the children,
+                d child / d this * adjoint of child. Only children which
+                refer to this statement contribute to its adjoint
+         */
+        std::shared_ptr<Operator> Adjoint()const{
+                static Transform::FoldZero constant_fold;
+                std::shared_ptr<Operator> head;
+                for(auto child : children_){
+                        if( ! child->Expr()->Expr()->Dependencies()->Contains(sym_->Id()) )
+                                continue;
+                        auto term = constant_fold.Fold(
+                                BinaryOperator::Mul(
+                                        child->Expr()->Expr()->Diff(sym_->Name()),
+                                        ExogenousSymbol::Make("__rev_ad_" + child->Name())
+                                )
+                        );
+                        if( DiffContext::IsZero(term) )
+                                continue;
+                        head = ( head ? BinaryOperator::Add(head, term) : term );
+                }
+                if( ! head )
+                        head = Constant::Make(0.0);
+                return head;
+        }
         void EmitInstructionsImpl(InstructionBlock& B)const{
                 B.Add(std::make_shared<InstructionDeclareVariable>(
                                 sym_->Name(),
@@ -828,23 +837,7 @@ struct DataFlow{
                         ));
                 } else {
                         static auto removed_end = std::make_shared<RemoveEndo>();
-                        static Transform::FoldZero constant_fold;
-                        // forward
-                        auto make_node_back = [&](auto child){
-                                return constant_fold.Fold(
-                                        BinaryOperator::Mul(
-                                                child->Expr()->Expr()->Diff(sym_->Name()),
-                                                ExogenousSymbol::Make(make_ad_sym(child->Name()))
-                                        )
-                                );
-                        };
-                        std::shared_ptr<Operator> head = make_node_back(children_[0]);
-                        for(size_t idx=1;idx<children_.size();++idx){
-                                head = BinaryOperator::Add(
-                                        head,
-                                        make_node_back(children_[idx])
-                                );
-                        }
+                        auto head = Adjoint();
                 
                         #if 0
                         auto remapped = head;
@@ -934,23 +927,7 @@ struct DataFlow{
                         return "__rev_ad_" + name;
                 };
                 if( children_.size() > 0 ){
-                        static Transform::FoldZero constant_fold;
-                        // forward
-                        auto make_node_back = [&](auto child){
-                                return constant_fold.Fold(
-                                        BinaryOperator::Mul(
-                                                child->Expr()->Expr()->Diff(sym_->Name()),
-                                                ExogenousSymbol::Make(make_ad_sym(child->Name()))
-                                        )
-                                );
-                        };
-                        std::shared_ptr<Operator> head = make_node_back(children_[0]);
-                        for(size_t idx=1;idx<children_.size();++idx){
-                                head = BinaryOperator::Add(
-                                        head,
-                                        make_node_back(children_[idx])
-                                );
-                        }
+                        auto head = Adjoint();
 
 
                         computation.push_back(EndgenousSymbol::Make( make_ad_sym(sym_->Name()), head));
@@ -963,23 +940,7 @@ struct DataFlow{
                 };
                 out << "double " << make_ad_sym(sym_->Name()) << " = ";
                 if( children_.size() > 0 ){
-                        static Transform::FoldZero constant_fold;
-                        // forward
-                        auto make_node_back = [&](auto child){
-                                return constant_fold.Fold(
-                                        BinaryOperator::Mul(
-                                                child->Expr()->Expr()->Diff(sym_->Name()),
-                                                ExogenousSymbol::Make(make_ad_sym(child->Name()))
-                                        )
-                                );
-                        };
-                        std::shared_ptr<Operator> head = make_node_back(children_[0]);
-                        for(size_t idx=1;idx<children_.size();++idx){
-                                head = BinaryOperator::Add(
-                                        head,
-                                        make_node_back(children_[idx])
-                                );
-                        }
+                        auto head = Adjoint();
                                 
                         head->EmitCode(out);
                 } else {
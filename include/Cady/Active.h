@@ -0,0 +1,206 @@
+#ifndef INCLUDE_CADY_ACTIVE_H
+#define INCLUDE_CADY_ACTIVE_H
+
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "Normal.h"
+
+namespace Cady{
+namespace Reverse{
+
+        struct Active;
+
+        /*
+                Each operation on an Active appends one entry holding the
+                tape positions of its operands and the local partial
+                derivatives with respect to them. Values aren't stored,
+                they're only needed while recording. Constants never
+                reach the tape.
+         */
+        struct ActiveTapeEntry{
+                std::uint32_t Left;
+                std::uint32_t Right;
+                double        DLeft;
+                double        DRight;
+        };
+
+        struct ActiveAdjoints;
+
+        /*
+                Recording tape for Active numbers. There is one tape per
+                thread, so models can be recorded concurrently, and
+                Position()/Rewind() allow a tape to be reused across
+                many evaluations without reallocating.
+         */
+        struct ActiveTape{
+                enum : std::uint32_t{ Inactive = 0xFFFFFFFFu };
+
+                static ActiveTape& Current(){
+                        static thread_local ActiveTape tape;
+                        return tape;
+                }
+
+                std::uint32_t Push(std::uint32_t left, double dleft, std::uint32_t right = Inactive, double dright = 0.0){
+                        if( entries_.size() >= Inactive )
+                                throw std::domain_error("active tape is full");
+                        auto index = static_cast<std::uint32_t>(entries_.size());
+                        entries_.push_back(ActiveTapeEntry{left, right, dleft, dright});
+                        return index;
+                }
+
+                size_t Size()const{ return entries_.size(); }
+                size_t Position()const{ return entries_.size(); }
+                void Rewind(size_t position){ entries_.resize(position); }
+                void Clear(){ entries_.clear(); }
+                void Reserve(size_t n){ entries_.reserve(n); }
+
+                inline ActiveAdjoints Gradient(Active const& output)const;
+
+        private:
+                std::vector<ActiveTapeEntry> entries_;
+        };
+
+        /*
+                Reverse mode number type for Build<Double> style models,
+
+                        auto S = Active::Variable(50);
+                        auto v = Build<Active>{}.Evaluate(..., S, ...);
+                        auto g = v.Gradient();
+                        g.D(S); // delta
+         */
+        struct Active{
+                // non-explicit so constants mix with actives
+                Active(double value = 0.0)
+                        : value_{value}
+                        , index_{ActiveTape::Inactive}
+                {}
+
+                static Active Variable(double value){
+                        return Active(value, ActiveTape::Current().Push(ActiveTape::Inactive, 0.0));
+                }
+
+                double Value()const{ return value_; }
+                std::uint32_t Index()const{ return index_; }
+                bool IsActive()const{ return index_ != ActiveTape::Inactive; }
+
+                /*
+                        reverse sweep over the current thread's tape
+                 */
+                inline ActiveAdjoints Gradient()const;
+
+                static Active Record(double value, Active const& l, double dl){
+                        if( ! l.IsActive() )
+                                return Active(value);
+                        return Active(value, ActiveTape::Current().Push(l.index_, dl));
+                }
+                static Active Record(double value, Active const& l, double dl, Active const& r, double dr){
+                        if( ! r.IsActive() )
+                                return Record(value, l, dl);
+                        if( ! l.IsActive() )
+                                return Record(value, r, dr);
+                        return Active(value, ActiveTape::Current().Push(l.index_, dl, r.index_, dr));
+                }
+
+        private:
+                Active(double value, std::uint32_t index)
+                        : value_{value}
+                        , index_{index}
+                {}
+
+                double value_;
+                std::uint32_t index_;
+        };
+
+        struct ActiveAdjoints{
+                explicit ActiveAdjoints(std::vector<double> adjoints)
+                        : adjoints_(std::move(adjoints))
+                {}
+                // derivative of the output with respect to x
+                double D(Active const& x)const{
+                        if( ! x.IsActive() || x.Index() >= adjoints_.size() )
+                                return 0.0;
+                        return adjoints_[x.Index()];
+                }
+        private:
+                std::vector<double> adjoints_;
+        };
+
+        inline ActiveAdjoints ActiveTape::Gradient(Active const& output)const{
+                if( ! output.IsActive() )
+                        return ActiveAdjoints({});
+                // recorded before a Rewind() which dropped it
+                if( output.Index() >= entries_.size() )
+                        throw std::domain_error("active output is no longer on the tape");
+                std::vector<double> adj(output.Index() + 1);
+                adj[output.Index()] = 1.0;
+                for(size_t idx=adj.size();idx!=0;){
+                        --idx;
+                        double const bar = adj[idx];
+                        if( bar == 0.0 )
+                                continue;
+                        auto const& e = entries_[idx];
+                        if( e.Left != Inactive )
+                                adj[e.Left] += bar * e.DLeft;
+                        if( e.Right != Inactive )
+                                adj[e.Right] += bar * e.DRight;
+                }
+                return ActiveAdjoints(std::move(adj));
+        }
+        inline ActiveAdjoints Active::Gradient()const{
+                return ActiveTape::Current().Gradient(*this);
+        }
+
+        inline Active operator+(Active const& l, Active const& r){
+                return Active::Record(l.Value() + r.Value(), l, 1.0, r, 1.0);
+        }
+        inline Active operator-(Active const& l, Active const& r){
+                return Active::Record(l.Value() - r.Value(), l, 1.0, r, -1.0);
+        }
+        inline Active operator*(Active const& l, Active const& r){
+                return Active::Record(l.Value() * r.Value(), l, r.Value(), r, l.Value());
+        }
+        inline Active operator/(Active const& l, Active const& r){
+                double inv = 1.0 / r.Value();
+                double value = l.Value() * inv;
+                return Active::Record(value, l, inv, r, -value * inv);
+        }
+        inline Active operator-(Active const& arg){
+                return Active::Record(-arg.Value(), arg, -1.0);
+        }
+
+        inline Active Exp(Active const& arg){
+                double value = std::exp(arg.Value());
+                return Active::Record(value, arg, value);
+        }
+        inline Active Log(Active const& arg){
+                return Active::Record(std::log(arg.Value()), arg, 1.0 / arg.Value());
+        }
+        inline Active Sin(Active const& arg){
+                return Active::Record(std::sin(arg.Value()), arg, std::cos(arg.Value()));
+        }
+        inline Active Cos(Active const& arg){
+                return Active::Record(std::cos(arg.Value()), arg, -std::sin(arg.Value()));
+        }
+        inline Active Phi(Active const& arg){
+                double density;
+                double value = Normal::Cdf(arg.Value(), density);
+                return Active::Record(value, arg, density);
+        }
+        inline Active Pow(Active const& l, Active const& r){
+                double value = std::pow(l.Value(), r.Value());
+                // x^y is only differentiable in y for positive x
+                double dr = l.Value() > 0 ? value * std::log(l.Value()) : 0.0;
+                return Active::Record(value, l, r.Value() * std::pow(l.Value(), r.Value() - 1), r, dr);
+        }
+
+} // end namespace Reverse
+
+using Reverse::Active;
+using Reverse::ActiveTape;
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_ACTIVE_H
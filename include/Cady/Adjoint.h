@@ -0,0 +1,131 @@
+#ifndef INCLUDE_CADY_ADJOINT_H
+#define INCLUDE_CADY_ADJOINT_H
+
+#include "Compiled.h"
+
+namespace Cady{
+
+/*
+        Reverse mode differentiation of a CompiledExpression. A forward
+        pass records the value of every slot, and a reverse pass over the
+        tape accumulates the adjoint of each slot into its operands, so
+        the gradient with respect to every input costs a small constant
+        multiple of one evaluation regardless of the number of inputs.
+
+        Each tape instruction writes its own slot, so the forward values
+        needed by the reverse pass are still in the workspace.
+ */
+struct AdjointEvaluator{
+        explicit AdjointEvaluator(CompiledExpression const& expr)
+                : expr_(expr)
+                , workspace_(expr.WorkspaceSize())
+                , adjoint_(expr.WorkspaceSize())
+        {}
+
+        /*
+                gradient receives d output / d input for each of
+                CompiledExpression::Inputs(), returns the value of the
+                output
+         */
+        double Gradient(double const* inputs, double* gradient, size_t output = 0){
+                if( output >= expr_.NumOutputs() )
+                        throw std::domain_error("no such output");
+                expr_.Execute(inputs, workspace_.data());
+                std::fill(adjoint_.begin(), adjoint_.end(), 0.0);
+                auto root = expr_.Outputs()[output];
+                adjoint_[root] = 1.0;
+                Sweep();
+                std::copy(adjoint_.begin(), adjoint_.begin() + expr_.NumInputs(), gradient);
+                return workspace_[root];
+        }
+        double Gradient(SymbolTable const& ST, std::vector<double>& gradient, size_t output = 0){
+                std::vector<double> inputs(expr_.NumInputs());
+                for(size_t idx=0;idx!=inputs.size();++idx){
+                        inputs[idx] = ST.At(expr_.InputIds()[idx]);
+                }
+                gradient.resize(expr_.NumInputs());
+                return Gradient(inputs.data(), gradient.data(), output);
+        }
+
+private:
+        void Sweep(){
+                double* w   = workspace_.data();
+                double* adj = adjoint_.data();
+                auto const& tape = expr_.Tape();
+                for(auto iter = tape.rbegin(), end = tape.rend();iter!=end;++iter){
+                        auto const& instr = *iter;
+                        double const bar = adj[instr.Result];
+                        // the fused normal has a second result
+                        if( bar == 0.0 && instr.Op != TOP_PHI_NPDF )
+                                continue;
+                        double const x = w[instr.Left];
+                        switch(instr.Op){
+                        case TOP_ADD:
+                                adj[instr.Left]  += bar;
+                                adj[instr.Right] += bar;
+                                break;
+                        case TOP_SUB:
+                                adj[instr.Left]  += bar;
+                                adj[instr.Right] -= bar;
+                                break;
+                        case TOP_MUL:
+                                adj[instr.Left]  += bar * w[instr.Right];
+                                adj[instr.Right] += bar * x;
+                                break;
+                        case TOP_DIV:
+                        {
+                                double const inv = 1.0 / w[instr.Right];
+                                adj[instr.Left]  += bar * inv;
+                                adj[instr.Right] -= bar * w[instr.Result] * inv;
+                                break;
+                        }
+                        case TOP_POW:
+                        {
+                                double const y = w[instr.Right];
+                                adj[instr.Left] += bar * y * std::pow(x, y - 1);
+                                // x^y is only differentiable in y for positive x
+                                if( x > 0 )
+                                        adj[instr.Right] += bar * w[instr.Result] * std::log(x);
+                                break;
+                        }
+                        case TOP_USUB:
+                                adj[instr.Left] -= bar;
+                                break;
+                        case TOP_EXP:
+                                adj[instr.Left] += bar * w[instr.Result];
+                                break;
+                        case TOP_LOG:
+                                adj[instr.Left] += bar / x;
+                                break;
+                        case TOP_SIN:
+                                adj[instr.Left] += bar * std::cos(x);
+                                break;
+                        case TOP_COS:
+                                adj[instr.Left] -= bar * std::sin(x);
+                                break;
+                        case TOP_PHI:
+                                // Phi'(x) is the standard normal density
+                                adj[instr.Left] += bar * Normal::Density(x);
+                                break;
+                        case TOP_SQRT:
+                                adj[instr.Left] += bar * 0.5 / w[instr.Result];
+                                break;
+                        case TOP_NPDF:
+                                adj[instr.Left] -= bar * x * w[instr.Result];
+                                break;
+                        case TOP_PHI_NPDF:
+                                // the density is already in Right
+                                adj[instr.Left] += ( bar - adj[instr.Right] * x ) * w[instr.Right];
+                                break;
+                        }
+                }
+        }
+
+        CompiledExpression const& expr_;
+        std::vector<double> workspace_;
+        std::vector<double> adjoint_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_ADJOINT_H
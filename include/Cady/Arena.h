@@ -0,0 +1,150 @@
+#ifndef INCLUDE_CADY_ARENA_H
+#define INCLUDE_CADY_ARENA_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <vector>
+
+namespace Cady{
+
+/*
+        Bump allocator backing a GraphContext. Allocation is a pointer
+        increment within a block, and deallocation only counts down, the
+        blocks being freed together once every node and the owning
+        context are gone. Allocation isn't thread safe, nodes are built by
+        the thread which made the context current, but they may be
+        released from anywhere.
+ */
+struct GraphArena{
+        enum : size_t{ BlockSize = 64 * 1024 };
+
+        /*
+                align must be at most alignof(std::max_align_t), which
+                new char[] guarantees for the start of each block
+         */
+        void* Allocate(size_t bytes, size_t align){
+                size_t offset = ( used_ + align - 1 ) & ~( align - 1 );
+                if( blocks_.empty() || offset + bytes > block_size_ ){
+                        // oversized requests get a block of their own
+                        block_size_ = std::max<size_t>(BlockSize, bytes);
+                        blocks_.emplace_back(new char[block_size_]);
+                        reserved_ += block_size_;
+                        offset = 0;
+                }
+                used_ = offset + bytes;
+                refs_.fetch_add(1, std::memory_order_relaxed);
+                return blocks_.back().get() + offset;
+        }
+        void Deallocate(){
+                Release();
+        }
+
+        // one reference is held by the context, one by each live node
+        void Release(){
+                if( refs_.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+                        delete this;
+        }
+        size_t LiveNodes()const{ return refs_.load(std::memory_order_relaxed) - 1; }
+        size_t BytesReserved()const{ return reserved_; }
+
+        static GraphArena*& Current(){
+                static thread_local GraphArena* current = nullptr;
+                return current;
+        }
+
+private:
+        std::vector<std::unique_ptr<char[]> > blocks_;
+        size_t block_size_{0};
+        size_t used_{0};
+        size_t reserved_{0};
+        std::atomic<size_t> refs_{1};
+};
+
+template<class T>
+struct ArenaAllocator{
+        using value_type = T;
+
+        explicit ArenaAllocator(GraphArena* arena):arena_{arena}{}
+        template<class U>
+        ArenaAllocator(ArenaAllocator<U> const& that):arena_{that.Arena()}{}
+
+        T* allocate(size_t n){
+                static_assert( alignof(T) <= alignof(std::max_align_t), "over aligned node" );
+                return static_cast<T*>(arena_->Allocate(n * sizeof(T), alignof(T)));
+        }
+        void deallocate(T*, size_t){
+                arena_->Deallocate();
+        }
+        GraphArena* Arena()const{ return arena_; }
+
+        template<class U>
+        bool operator==(ArenaAllocator<U> const& that)const{ return arena_ == that.Arena(); }
+        template<class U>
+        bool operator!=(ArenaAllocator<U> const& that)const{ return arena_ != that.Arena(); }
+private:
+        GraphArena* arena_;
+};
+
+/*
+        Owns an arena for building graphs. While a Scope is active every
+        node made through the Operator factories on this thread comes
+        from the arena, so building or differentiating a large graph
+        costs a pointer bump per node rather than a malloc,
+
+                GraphContext ctx;
+                {
+                        GraphContext::Scope scope(ctx);
+                        auto expr = ...;
+                        auto d = expr->Diff("x");
+                }
+
+        Nodes may outlive the context, the memory is released in bulk
+        once both the context and the last node are gone.
+ */
+struct GraphContext{
+        GraphContext():arena_{new GraphArena}{}
+        ~GraphContext(){
+                arena_->Release();
+        }
+        GraphContext(GraphContext const&)=delete;
+        GraphContext& operator=(GraphContext const&)=delete;
+
+        size_t LiveNodes()const{ return arena_->LiveNodes(); }
+        size_t BytesReserved()const{ return arena_->BytesReserved(); }
+
+        struct Scope{
+                explicit Scope(GraphContext& ctx)
+                        : prev_{GraphArena::Current()}
+                {
+                        GraphArena::Current() = ctx.arena_;
+                }
+                ~Scope(){
+                        GraphArena::Current() = prev_;
+                }
+                Scope(Scope const&)=delete;
+                Scope& operator=(Scope const&)=delete;
+        private:
+                GraphArena* prev_;
+        };
+
+private:
+        GraphArena* arena_;
+};
+
+/*
+        every node factory goes through here, so that nodes come from the
+        current GraphContext when there is one
+ */
+template<class T, class... Args>
+std::shared_ptr<T> MakeNode(Args&&... args){
+        if( auto arena = GraphArena::Current() )
+                return std::allocate_shared<T>(ArenaAllocator<T>(arena), std::forward<Args>(args)...);
+        return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_ARENA_H
@@ -0,0 +1,149 @@
+#ifndef INCLUDE_CADY_BATCH_H
+#define INCLUDE_CADY_BATCH_H
+
+#include "Compiled.h"
+
+namespace Cady{
+
+/*
+        A column of values for one input of a CompiledExpression. A
+        broadcast column has a single value shared by every lane,
+        for example a flat rate r across a whole book of options.
+ */
+struct BatchColumn{
+        static BatchColumn Vector(double const* data){ return BatchColumn{data, false}; }
+        static BatchColumn Broadcast(double const* value){ return BatchColumn{value, true}; }
+        double const* Data;
+        bool IsBroadcast;
+};
+
+/*
+        Evaluates a CompiledExpression over many scenarios at once. The
+        lanes are processed in tiles, and the workspace is one row of
+        TileSize doubles per slot, so that for moderate tape lengths
+        the whole tile stays in L1 and each instruction is a simple
+        loop the compiler can vectorize.
+ */
+struct BatchEvaluator{
+        enum{ DefaultTileSize = 128 };
+
+        explicit BatchEvaluator(CompiledExpression const& expr, size_t tile_size = DefaultTileSize)
+                : expr_(expr)
+                , tile_size_{tile_size}
+                , workspace_(expr.WorkspaceSize() * tile_size)
+        {
+                if( tile_size_ == 0 )
+                        throw std::domain_error("tile size must be positive");
+                auto const& constants = expr_.Constants();
+                for(size_t idx=0;idx!=constants.size();++idx){
+                        auto row = Row(expr_.NumInputs() + idx);
+                        std::fill(row, row + tile_size_, constants[idx]);
+                }
+        }
+
+        size_t TileSize()const{ return tile_size_; }
+
+        /*
+                inputs has one column per CompiledExpression::Inputs(),
+                outputs one column per CompiledExpression::Outputs()
+         */
+        void Eval(BatchColumn const* inputs, double* const* outputs, size_t n){
+                size_t num_inputs = expr_.NumInputs();
+                for(size_t idx=0;idx!=num_inputs;++idx){
+                        if( inputs[idx].IsBroadcast ){
+                                auto row = Row(idx);
+                                std::fill(row, row + tile_size_, *inputs[idx].Data);
+                        }
+                }
+                for(size_t offset=0;offset<n;offset+=tile_size_){
+                        size_t lanes = std::min(tile_size_, n - offset);
+                        for(size_t idx=0;idx!=num_inputs;++idx){
+                                if( ! inputs[idx].IsBroadcast ){
+                                        auto first = inputs[idx].Data + offset;
+                                        std::copy(first, first + lanes, Row(idx));
+                                }
+                        }
+                        ExecuteTile(lanes);
+                        for(size_t idx=0;idx!=expr_.NumOutputs();++idx){
+                                auto row = Row(expr_.Outputs()[idx]);
+                                std::copy(row, row + lanes, outputs[idx] + offset);
+                        }
+                }
+        }
+        void Eval(std::vector<BatchColumn> const& inputs, double* output, size_t n){
+                if( inputs.size() != expr_.NumInputs() )
+                        throw std::domain_error("wrong number of input columns");
+                if( expr_.NumOutputs() != 1 )
+                        throw std::domain_error("expected single output");
+                Eval(inputs.data(), &output, n);
+        }
+
+private:
+        double* Row(size_t slot){
+                return workspace_.data() + slot * tile_size_;
+        }
+
+        void ExecuteTile(size_t lanes){
+                for(auto const& instr : expr_.Tape() ){
+                        double* __restrict result      = Row(instr.Result);
+                        double const* __restrict x     = Row(instr.Left);
+                        double const* __restrict y     = Row(instr.Right);
+                        switch(instr.Op){
+                        case TOP_ADD:
+                                for(size_t j=0;j!=lanes;++j) result[j] = x[j] + y[j];
+                                break;
+                        case TOP_SUB:
+                                for(size_t j=0;j!=lanes;++j) result[j] = x[j] - y[j];
+                                break;
+                        case TOP_MUL:
+                                for(size_t j=0;j!=lanes;++j) result[j] = x[j] * y[j];
+                                break;
+                        case TOP_DIV:
+                                for(size_t j=0;j!=lanes;++j) result[j] = x[j] / y[j];
+                                break;
+                        case TOP_POW:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::pow(x[j], y[j]);
+                                break;
+                        case TOP_USUB:
+                                for(size_t j=0;j!=lanes;++j) result[j] = -x[j];
+                                break;
+                        case TOP_EXP:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::exp(x[j]);
+                                break;
+                        case TOP_LOG:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::log(x[j]);
+                                break;
+                        case TOP_SIN:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::sin(x[j]);
+                                break;
+                        case TOP_COS:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::cos(x[j]);
+                                break;
+                        case TOP_PHI:
+                                for(size_t j=0;j!=lanes;++j) result[j] = Normal::Cdf(x[j]);
+                                break;
+                        case TOP_SQRT:
+                                for(size_t j=0;j!=lanes;++j) result[j] = std::sqrt(x[j]);
+                                break;
+                        case TOP_NPDF:
+                                for(size_t j=0;j!=lanes;++j) result[j] = Normal::Density(x[j]);
+                                break;
+                        case TOP_PHI_NPDF:
+                        {
+                                // the density goes to the Right row
+                                double* __restrict density = Row(instr.Right);
+                                for(size_t j=0;j!=lanes;++j) result[j] = Normal::Cdf(x[j], density[j]);
+                                break;
+                        }
+                        }
+                }
+        }
+
+        CompiledExpression const& expr_;
+        size_t tile_size_;
+        std::vector<double> workspace_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_BATCH_H
@@ -13,10 +13,23 @@
 #include <utility>
 #include <cmath>
 #include <iomanip>
+#include <limits>
+#include <cstdlib>
 #include <functional>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <cstring>
+#include <set>
+#include <typeinfo>
+#include <algorithm>
 
 #include <boost/optional.hpp>
 
+#include "Arena.h"
+#include "Normal.h"
+
 namespace std{
         template< class T, class U > 
         std::shared_ptr<T> reinterpret_pointer_cast( const std::shared_ptr<U>& r ) noexcept
@@ -45,6 +58,7 @@ namespace std{
                                         break
                                 and replace all instanace
                         }
+           This is Transform::CommonSubtreeExtraction.
 */
 
 namespace Cady{
@@ -68,107 +82,497 @@ struct Symbol;
 
 using OperatorVector = std::vector<std::shared_ptr<Operator> >;
 
+/*
+        Every symbol name is interned to a dense integer, so that
+        evaluation and differentiation compare and index integers
+        rather than hashing strings at every node
+ */
+using SymbolId = std::uint32_t;
+
+struct SymbolRegistry{
+        static SymbolId Intern(std::string const& name){
+                auto& self = Get();
+                std::lock_guard<std::mutex> lock(self.mtx_);
+                auto iter = self.ids_.find(name);
+                if( iter != self.ids_.end() )
+                        return iter->second;
+                auto id = static_cast<SymbolId>(self.names_.size());
+                self.names_.push_back(name);
+                self.ids_[name] = id;
+                return id;
+        }
+        static boost::optional<SymbolId> Find(std::string const& name){
+                auto& self = Get();
+                std::lock_guard<std::mutex> lock(self.mtx_);
+                auto iter = self.ids_.find(name);
+                if( iter == self.ids_.end() )
+                        return {};
+                return iter->second;
+        }
+        static std::string const& NameOf(SymbolId id){
+                auto& self = Get();
+                std::lock_guard<std::mutex> lock(self.mtx_);
+                return self.names_.at(id);
+        }
+        static size_t Size(){
+                auto& self = Get();
+                std::lock_guard<std::mutex> lock(self.mtx_);
+                return self.names_.size();
+        }
+private:
+        static SymbolRegistry& Get(){
+                static SymbolRegistry mem;
+                return mem;
+        }
+        std::mutex mtx_;
+        std::unordered_map<std::string, SymbolId> ids_;
+        // deque so references returned by NameOf() stay valid
+        std::deque<std::string> names_;
+};
+
+/*
+        Immutable sorted set of SymbolIds, the symbols a node depends on.
+        Sets are shared between nodes, a node whose children all depend
+        on the same symbols holds its child's set rather than a copy, so
+        for the usual graph over a handful of inputs there are only a
+        few distinct sets however large the graph is.
+ */
+struct SymbolSet{
+        using Ptr = std::shared_ptr<SymbolSet const>;
+
+        SymbolSet() = default;
+        explicit SymbolSet(std::vector<SymbolId> ids)
+                : ids_(std::move(ids))
+        {
+                std::sort(ids_.begin(), ids_.end());
+                ids_.erase(std::unique(ids_.begin(), ids_.end()), ids_.end());
+        }
+
+        bool Contains(SymbolId id)const{
+                return std::binary_search(ids_.begin(), ids_.end(), id);
+        }
+        bool Includes(SymbolSet const& that)const{
+                return std::includes(ids_.begin(), ids_.end(), that.ids_.begin(), that.ids_.end());
+        }
+        bool Empty()const{ return ids_.empty(); }
+        size_t Size()const{ return ids_.size(); }
+        auto begin()const{ return ids_.begin(); }
+        auto end()const{ return ids_.end(); }
+
+        static Ptr None(){
+                static Ptr mem = std::make_shared<SymbolSet const>();
+                return mem;
+        }
+        static Ptr Of(SymbolId id){
+                return std::make_shared<SymbolSet const>(std::vector<SymbolId>{id});
+        }
+        // returns one of the arguments when it already covers the other
+        static Ptr Union(Ptr const& l, Ptr const& r){
+                if( l->Includes(*r) )
+                        return l;
+                if( r->Includes(*l) )
+                        return r;
+                std::vector<SymbolId> ids;
+                ids.reserve(l->Size() + r->Size());
+                std::set_union(l->begin(), l->end(), r->begin(), r->end(), std::back_inserter(ids));
+                return std::make_shared<SymbolSet const>(std::move(ids));
+        }
+private:
+        std::vector<SymbolId> ids_;
+};
+
 struct SymbolTable{
         SymbolTable& operator()(std::string const& sym, double value){
-                m_[sym] = value;
+                return (*this)(SymbolRegistry::Intern(sym), value);
+        }
+        SymbolTable& operator()(SymbolId id, double value){
+                if( id >= values_.size() ){
+                        values_.resize(id+1, 0.0);
+                        present_.resize(id+1, false);
+                }
+                values_[id] = value;
+                present_[id] = true;
                 return *this;
         }
         double operator[](std::string const& sym)const{
-                auto iter = m_.find(sym);
-                if( iter == m_.end()){
+                auto id = SymbolRegistry::Find(sym);
+                if( ! id || ! Contains(*id) ){
                         std::stringstream ss;
                         ss << "symbol " << sym << " does not exist";
                         throw std::domain_error(ss.str());
                 }
-                return iter->second;
+                return values_[*id];
+        }
+        double At(SymbolId id)const{
+                if( ! Contains(id) ){
+                        std::stringstream ss;
+                        ss << "symbol " << SymbolRegistry::NameOf(id) << " does not exist";
+                        throw std::domain_error(ss.str());
+                }
+                return values_[id];
+        }
+        bool Contains(SymbolId id)const{
+                return id < present_.size() && present_[id];
+        }
+private:
+        std::vector<double> values_;
+        std::vector<bool> present_;
+};
+
+/*
+        The order of the arguments of a plain input array, as for
+        CompiledExpression::Compile(expr, args), so that inputs[i] is
+        the value of the i'th name. Each SymbolId is mapped to its
+        position once here, and a symbol which isn't an argument throws
+        rather than being read from past the end of the array.
+ */
+struct ArgumentList{
+        ArgumentList(std::initializer_list<std::string> names)
+                : ArgumentList(std::vector<std::string>(names))
+        {}
+        ArgumentList(std::vector<std::string> const& names){
+                for(auto const& name : names){
+                        auto id = SymbolRegistry::Intern(name);
+                        if( id >= position_.size() )
+                                position_.resize(id+1, NoPosition);
+                        if( position_[id] != NoPosition ){
+                                std::stringstream ss;
+                                ss << "symbol " << name << " is repeated";
+                                throw std::domain_error(ss.str());
+                        }
+                        position_[id] = static_cast<std::uint32_t>(names_.size());
+                        names_.push_back(name);
+                }
+        }
+        size_t Size()const{ return names_.size(); }
+        std::vector<std::string> const& Names()const{ return names_; }
+        size_t Position(SymbolId id)const{
+                if( id >= position_.size() || position_[id] == NoPosition ){
+                        std::stringstream ss;
+                        ss << "symbol " << SymbolRegistry::NameOf(id) << " is not an argument";
+                        throw std::domain_error(ss.str());
+                }
+                return position_[id];
+        }
+private:
+        enum : std::uint32_t{ NoPosition = 0xFFFFFFFFu };
+        std::vector<std::string> names_;
+        std::vector<std::uint32_t> position_;
+};
+
+struct Operator;
+
+/*
+        Per evaluation cache of EndgenousSymbol values. Every statement
+        has a dense index, fixed when it's made, and constructing an
+        EvalMemo finds the range of indices reachable from the root, so
+        the value of a statement is kept in a slot array indexed by
+        its index for the duration of one Eval, and a statement
+        referenced from several parents is only evaluated once.
+
+        Nothing is written to the graph, so any number of memos may
+        share statements, and each thread can evaluate the same graph
+        with its own memo.
+ */
+struct EvalMemo{
+        enum : std::uint32_t{ NoSlot = 0xFFFFFFFFu };
+
+        inline explicit EvalMemo(Operator const& root);
+
+        // number of statements reachable from the root
+        size_t Size()const{ return size_; }
+        void NextGeneration(){
+                ++generation_;
+        }
+        // NoSlot for a statement outside the range this memo covers
+        std::uint32_t Slot(std::uint32_t statement_index)const{
+                std::uint32_t slot = statement_index - base_;
+                return slot < values_.size() ? slot : NoSlot;
+        }
+        bool IsCached(std::uint32_t slot)const{
+                return stamp_[slot] == generation_;
+        }
+        double Get(std::uint32_t slot)const{
+                return values_[slot];
+        }
+        void Set(std::uint32_t slot, double value){
+                values_[slot] = value;
+                stamp_[slot] = generation_;
         }
 private:
-        std::unordered_map<std::string, double> m_;
+        std::uint32_t base_{0};
+        size_t size_{0};
+        std::vector<double> values_;
+        std::vector<std::uint64_t> stamp_;
+        std::uint64_t generation_{0};
+};
+
+/*
+        Where exogenous symbols get their values from during evaluation,
+        either a SymbolTable or a plain array ordered by an ArgumentList
+ */
+struct EvalChecker;
+
+struct EvalContext{
+        explicit EvalContext(SymbolTable const& ST, EvalMemo* memo = nullptr, EvalChecker* checker = nullptr)
+                : symbols_{&ST}
+                , args_{nullptr}
+                , inputs_{nullptr}
+                , memo_{memo}
+                , checker_{checker}
+        {}
+        EvalContext(ArgumentList const& args, double const* inputs, EvalMemo* memo = nullptr, EvalChecker* checker = nullptr)
+                : symbols_{nullptr}
+                , args_{&args}
+                , inputs_{inputs}
+                , memo_{memo}
+                , checker_{checker}
+        {}
+        double Value(SymbolId id)const{
+                if( inputs_ )
+                        return inputs_[args_->Position(id)];
+                return symbols_->At(id);
+        }
+        EvalMemo* Memo()const{ return memo_; }
+        // null unless evaluating with EvalChecked()
+        EvalChecker* Checker()const{ return checker_; }
+private:
+        SymbolTable const* symbols_;
+        ArgumentList const* args_;
+        double const* inputs_;
+        EvalMemo* memo_;
+        EvalChecker* checker_;
+};
+
+/*
+        64 bit FNV-1a, deterministic across processes so hashes built
+        with it can key on-disk caches
+ */
+struct Fnv1a{
+        enum : std::uint64_t{
+                OffsetBasis = 14695981039346656037ull,
+                Prime       = 1099511628211ull
+        };
+        void Bytes(void const* data, size_t n){
+                auto first = static_cast<unsigned char const*>(data);
+                for(size_t idx=0;idx!=n;++idx){
+                        hash_ ^= first[idx];
+                        hash_ *= Prime;
+                }
+        }
+        void String(std::string const& s){
+                Word(s.size());
+                Bytes(s.data(), s.size());
+        }
+        void Word(std::uint64_t value){
+                Bytes(&value, sizeof(value));
+        }
+        std::uint64_t Value()const{ return hash_; }
+private:
+        std::uint64_t hash_{OffsetBasis};
 };
 
 struct Operator;
+struct DiffContext;
+
+/*
+        Partial differentiation treats every EndgenousSymbol as an
+        independent variable, so the derivative of a statement only
+        sees the statements it refers to directly. Total differentiation
+        applies the chain rule through them.
+ */
+enum DiffMode{
+        DiffMode_Partial,
+        DiffMode_Total,
+};
+
 struct OperatorTransform : std::enable_shared_from_this<OperatorTransform>{
         virtual ~OperatorTransform()=default;
         virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr)=0;
 };
 
+/*
+        Base for passes over a graph. Apply() walks the graph bottom up,
+        each node is rewritten once, after its children, and the result
+        is reused for every parent. A DAG stays a DAG, and a pass is
+        linear in the number of distinct nodes rather than the number
+        of paths through them.
+
+        Rewrite() is given the original node, Mapped() gives the result
+        for each of its children and Rebuild() the node over those
+        results. In RewriteMode_Pure the source graph is never touched,
+        a node whose children are unchanged is returned as is and
+        otherwise copied. In RewriteMode_InPlace the changed children
+        are rebound on the node itself.
+
+        Results are kept for the lifetime of the rewriter, or until
+        Reset(), so several roots rewritten by the same object share
+        their common parts. Each is kept against the Version() of its
+        node, so it's recomputed if anything below that node is mutated
+        in place by anything else.
+ */
+enum RewriteMode{
+        RewriteMode_Pure,
+        RewriteMode_InPlace,
+};
+struct Rewriter : OperatorTransform{
+        explicit Rewriter(RewriteMode mode = RewriteMode_Pure):mode_{mode}{}
+
+        RewriteMode Mode()const{ return mode_; }
+        inline std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr)override;
+        void Reset(){ memo_.clear(); }
+        // number of nodes rewritten
+        size_t Size()const{ return memo_.size(); }
+
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)=0;
+
+        std::shared_ptr<Operator> Mapped(std::shared_ptr<Operator> const& child)const{
+                return memo_.at(child.get()).Result;
+        }
+        inline std::shared_ptr<Operator> Rebuild(std::shared_ptr<Operator> const& ptr);
+        /*
+                handle to this for Operator::Clone(), non owning so that
+                a rewriter can live on the stack
+         */
+        std::shared_ptr<OperatorTransform> Self(){
+                return std::shared_ptr<OperatorTransform>(std::shared_ptr<OperatorTransform>{}, this);
+        }
+
+private:
+        struct Entry{
+                // holding the source means its address can't be reused
+                // for another node while the entry exists
+                std::shared_ptr<Operator> Source;
+                std::shared_ptr<Operator> Result;
+                // Source->Version()+1 when the entry was made
+                std::uint64_t Stamp;
+        };
+        inline bool IsCurrent(Operator const* node)const;
+
+        RewriteMode mode_;
+        std::unordered_map<Operator const*, Entry> memo_;
+};
+
 struct Operator : std::enable_shared_from_this<Operator>{
 
         explicit Operator(std::string const& name, OperatorKind kind = OPKind_Other)
                 : name_{name}
                 , kind_{kind}
         {}
-        virtual ~Operator(){}
+        virtual ~Operator(){
+                if( links_ ){
+                        for(size_t idx=0;idx!=children_.size();++idx){
+                                Detach(links_[idx]);
+                        }
+                }
+                Release(children_);
+        }
+        Operator(Operator const&)=delete;
+        Operator& operator=(Operator const&)=delete;
 
         OperatorKind Kind()const{ return kind_; }
 
         inline void MutateToEndgenous(std::string const& name);
 
 
-        struct DeepCopy : OperatorTransform{
-                virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                        return ptr->Clone(shared_from_this());
+        struct DeepCopy : Rewriter{
+        protected:
+                virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                        return ptr->Clone(Self());
                 }
         };
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans = std::make_shared<DeepCopy>())const=0;
 
         
 
-        struct EvalChecker{
-                struct StackFrame{
-                        std::shared_ptr<Operator const> Op;
-                        const char* file;
-                        size_t line;
-                };
-                void Push(std::shared_ptr<Operator const> const& ptr, const char* file, size_t line){
-                        seq_.push_back(StackFrame{ptr, file, line});
-                        if( depth_.count(ptr) > 0 ){
-                                for(size_t idx=0;idx!=seq_.size();++idx){
-                                        std::string token = ( ptr == seq_[idx].Op ? "->" : "  " );
-                                        std::stringstream source;
-                                        source << seq_[idx].file << ":" << seq_[idx].line;
-                                        std::cout << token << "[" << std::setw(2) << idx << "] : " << std::setw(20) << source.str() << seq_[idx].Op->NameInvariantOfChildren() << "\n";
-                                }
-                                seq_.pop_back();
-                                seq_[0].Op->Display();
-                                throw std::domain_error("recursive eval");
-                        }
-                        depth_.insert(ptr);
-                }
-                void Pop(){
-                        depth_.erase(seq_.back().Op);
-                        seq_.pop_back();
-                }
+        using EvalChecker = Cady::EvalChecker;
 
-        private:
-                std::unordered_set<std::shared_ptr<Operator const> > depth_;
-                std::vector<StackFrame> seq_;
-        };
-
-        struct EvalCheckerDevice{
-                EvalCheckerDevice(EvalChecker& checker, std::shared_ptr<Operator const> ptr,
-                                  const char* file, size_t line)
-                        : checker_{nullptr}
-                {
-                        checker.Push(ptr, file, line);
-                        checker_ = &checker;
-                }
-                ~EvalCheckerDevice(){
-                        if( checker_ )
-                                checker_->Pop();
-                }
-        private:
-                EvalChecker* checker_;
-        };
+        virtual double EvalImpl(EvalContext const& ctx)const=0;
 
+        /*
+                Cycles can only be introduced by mutating a graph in place,
+                so rather than checking for recursion at every Eval, we walk
+                the graph once and remember that it's acyclic.
 
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const=0;
-        double Eval(SymbolTable const& ST)const{
-                EvalChecker eval_checker;
-                return EvalImpl(ST, eval_checker);
+                That, and the other facts cached on a node, are kept against
+                its Version(), which is bumped when the node or anything
+                below it is mutated in place. A node registers with its
+                children the first time a fact is cached on it, so building
+                a graph costs nothing extra, and a mutation only reaches
+                the ancestors which have cached something, while other
+                graphs keep their caches.
+         */
+        std::uint64_t Version()const{
+                return version_.load(std::memory_order_acquire);
         }
+        bool IsValidated()const{
+                return validated_stamp_.load(std::memory_order_relaxed) == Version() + 1;
+        }
+        inline void Validate()const;
 
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const=0;
+        double Eval(SymbolTable const& ST)const{
+                Validate();
+                return EvalImpl(EvalContext{ST});
+        }
+        /*
+                inputs[i] is the value of args.Names()[i], every
+                exogenous symbol under this node must be an argument
+         */
+        double Eval(ArgumentList const& args, double const* inputs)const{
+                Validate();
+                return EvalImpl(EvalContext{args, inputs});
+        }
+
+        /*
+                memoized evaluation, each EndgenousSymbol under this
+                node is computed once per call
+         */
+        double Eval(SymbolTable const& ST, EvalMemo& memo)const{
+                Validate();
+                memo.NextGeneration();
+                return EvalImpl(EvalContext{ST, &memo});
+        }
+        double Eval(ArgumentList const& args, double const* inputs, EvalMemo& memo)const{
+                Validate();
+                memo.NextGeneration();
+                return EvalImpl(EvalContext{args, inputs, &memo});
+        }
+        double EvalMemoized(SymbolTable const& ST)const{
+                EvalMemo memo(*this);
+                return Eval(ST, memo);
+        }
+
+        /*
+                debug evaluation, tracks the stack of statements being
+                evaluated and dumps it on recursion
+         */
+        inline double EvalChecked(SymbolTable const& ST)const;
+
+        std::shared_ptr<Operator> Diff(std::string const& symbol)const{
+                return Diff(SymbolRegistry::Intern(symbol));
+        }
+        /*
+                each call is one DiffContext, so within it the derivative
+                of a shared subexpression is computed once and shared
+         */
+        inline std::shared_ptr<Operator> Diff(SymbolId symbol)const;
+        /*
+                derivative through the statements. Each statement the
+                result depends on becomes one derivative statement, so
+                the result has the same statement structure as this
+                graph rather than every statement being inlined
+         */
+        std::shared_ptr<Operator> TotalDiff(std::string const& symbol)const{
+                return TotalDiff(SymbolRegistry::Intern(symbol));
+        }
+        inline std::shared_ptr<Operator> TotalDiff(SymbolId symbol)const;
+        /*
+                derivative of this node, the derivatives of the children
+                are to be taken through ctx.Diff(). Only called when this
+                node depends on ctx.Symbol()
+         */
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const=0;
         virtual void EmitCode(std::ostream& ss)const=0;
         
         struct DependentsProfile{
@@ -236,12 +640,17 @@ struct Operator : std::enable_shared_from_this<Operator>{
                 return children_.at(idx);
         }
         void Rebind(size_t idx, std::shared_ptr<Operator> const& ptr){
-                if( Arity() < idx ){
+                if( idx >= Arity() ){
                         throw std::domain_error("getting child that doesn't exist");
                 }
+                if( links_ )
+                        Detach(links_[idx]);
                 children_.at(idx) = ptr;
+                if( links_ )
+                        Attach(links_[idx], this, ptr.get());
+                Invalidate();
         }
-        auto&       Children()     { return children_; }
+        // in place changes go through Rebind(), which tracks the parents
         auto const& Children()const{ return children_; }
 
         bool IsTerminal()const{ return Arity() == 0; }
@@ -275,6 +684,32 @@ struct Operator : std::enable_shared_from_this<Operator>{
 
         virtual std::vector<std::string> HiddenArguments()const{ return {}; }
 
+        /*
+                64 bit hash of the operation, payload and children,
+                computed once and kept until the graph is next mutated
+                in place. Structurally equal graphs hash the same, even
+                in different processes.
+         */
+        inline std::uint64_t StructuralHash()const;
+        // same operation and payload, and the very same children
+        bool ShallowEquals(Operator const& that)const{
+                if( this == &that )
+                        return true;
+                return LocalMatch(that) && children_ == that.children_;
+        }
+        // same operation and payload, and structurally equal children
+        inline bool StructurallyEquals(Operator const& that)const;
+
+        /*
+                the symbols this node depends on, computed once and kept
+                until the graph is next mutated in place. A symbol outside
+                this set has a zero derivative in the given mode. For
+                DiffMode_Partial an EndgenousSymbol contributes its own
+                id and not those of its expression, for DiffMode_Total it
+                contributes both.
+         */
+        inline SymbolSet::Ptr Dependencies(DiffMode mode = DiffMode_Partial)const;
+
         inline void Display(std::ostream& ostr = std::cout)const;
 
         EndgenousSymbolSet EndgenousDependencies(){
@@ -306,11 +741,153 @@ protected:
                 return slot;
         }
 
+        /*
+                hash and equality of everything but the children, the
+                defaults go through HiddenArguments(), nodes with a
+                payload override them to avoid building strings
+         */
+        virtual std::uint64_t LocalHash()const{
+                Fnv1a h;
+                h.String(name_);
+                for(auto const& arg : HiddenArguments() ){
+                        h.String(arg);
+                }
+                return h.Value();
+        }
+        virtual bool LocalEquals(Operator const& that)const{
+                return HiddenArguments() == that.HiddenArguments();
+        }
+
 private:
+        bool LocalMatch(Operator const& that)const{
+                return kind_ == that.kind_ &&
+                       typeid(*this) == typeid(that) &&
+                       name_ == that.name_ &&
+                       children_.size() == that.children_.size() &&
+                       LocalEquals(that);
+        }
+
+        /*
+                One per child, threading the parent into a doubly linked
+                list of the nodes which have that child, so that a node
+                can be unlinked from its children in constant time however
+                many parents they have. They're only made once something
+                is cached on the parent, nodes which are built and thrown
+                away never lock anything.
+         */
+        struct ParentLink{
+                Operator* Parent{nullptr};
+                Operator* Child{nullptr};
+                ParentLink* Prev{nullptr};
+                ParentLink* Next{nullptr};
+        };
+        // the lists of a node are guarded by one of a fixed set of mutexes
+        static std::mutex& LinkMutex(Operator const* child){
+                static std::mutex mem[64];
+                return mem[( reinterpret_cast<std::uintptr_t>(child) >> 4 ) % 64];
+        }
+        static void Attach(ParentLink& link, Operator* parent, Operator* child){
+                std::lock_guard<std::mutex> lock(LinkMutex(child));
+                link.Parent = parent;
+                link.Child  = child;
+                link.Prev   = nullptr;
+                link.Next   = child->parents_;
+                if( child->parents_ )
+                        child->parents_->Prev = &link;
+                child->parents_ = &link;
+        }
+        static void Detach(ParentLink& link){
+                if( ! link.Child )
+                        return;
+                std::lock_guard<std::mutex> lock(LinkMutex(link.Child));
+                if( link.Prev )
+                        link.Prev->Next = link.Next;
+                else
+                        link.Child->parents_ = link.Next;
+                if( link.Next )
+                        link.Next->Prev = link.Prev;
+                link = ParentLink{};
+        }
+        /*
+                dropping the last reference to a deep graph would otherwise
+                free it with one destructor frame per level, so the children
+                of a node being destroyed inside another destructor are
+                handed to the outermost one, which frees them one at a time
+         */
+        static void Release(std::vector<std::shared_ptr<Operator> >& children){
+                static thread_local std::vector<std::shared_ptr<Operator> >* pending = nullptr;
+                if( pending ){
+                        for(auto& child : children )
+                                pending->push_back(std::move(child));
+                        return;
+                }
+                std::vector<std::shared_ptr<Operator> > released(std::make_move_iterator(children.begin()),
+                                                                 std::make_move_iterator(children.end()));
+                pending = &released;
+                for(;released.size();){
+                        auto last = std::move(released.back());
+                        released.pop_back();
+                }
+                pending = nullptr;
+        }
+
+        /*
+                the value cached facts are stored against. Storing one marks
+                the node as observed, which a mutation clears as it bumps the
+                version, and as a fact is only cached once it's cached for
+                every child, a mutation can stop at a parent which hasn't
+                been observed since
+         */
+        std::uint64_t Stamp()const{
+                if( ! linked_.load(std::memory_order_acquire) )
+                        LinkChildren();
+                observed_.store(true, std::memory_order_relaxed);
+                return Version() + 1;
+        }
+        /*
+                mutating in place isn't safe against concurrent readers, so
+                the only race here is between threads caching facts on the
+                same graph, and whichever gets here first links the node
+         */
+        void LinkChildren()const{
+                bool expected = false;
+                if( ! linked_.compare_exchange_strong(expected, true, std::memory_order_acq_rel) )
+                        return;
+                if( children_.empty() )
+                        return;
+                auto self = const_cast<Operator*>(this);
+                links_.reset(new ParentLink[children_.size()]);
+                for(size_t idx=0;idx!=children_.size();++idx){
+                        Attach(links_[idx], self, children_[idx].get());
+                }
+        }
+        inline void Invalidate();
+        friend struct Rewriter;
+
         std::string name_;
         std::vector<std::shared_ptr<Operator> > children_;
+        // one per child once linked, null before
+        mutable std::unique_ptr<ParentLink[]> links_;
+        ParentLink* parents_{nullptr};
 
         OperatorKind kind_;
+        mutable std::atomic<bool> linked_{false};
+        mutable std::atomic<bool> observed_{false};
+
+        mutable std::atomic<std::uint64_t> version_{0};
+
+        // Version()+1 when validated, so zero is never valid
+        mutable std::atomic<std::uint64_t> validated_stamp_{0};
+
+        mutable std::atomic<std::uint64_t> hash_{0};
+        // Version()+1 when hash_ is current
+        mutable std::atomic<std::uint64_t> hash_stamp_{0};
+
+        // one per DiffMode, read and written through
+        // std::atomic_load/atomic_store
+        mutable SymbolSet::Ptr deps_[2];
+        // Version()+1 when deps_ is current
+        mutable std::atomic<std::uint64_t> deps_stamp_[2]{};
 
 };
 
@@ -329,27 +906,461 @@ private:
 
 
 
+struct EvalChecker{
+        struct StackFrame{
+                std::shared_ptr<Operator const> Op;
+                const char* file;
+                size_t line;
+        };
+        void Push(std::shared_ptr<Operator const> const& ptr, const char* file, size_t line){
+                seq_.push_back(StackFrame{ptr, file, line});
+                if( depth_.count(ptr) > 0 ){
+                        for(size_t idx=0;idx!=seq_.size();++idx){
+                                std::string token = ( ptr == seq_[idx].Op ? "->" : "  " );
+                                std::stringstream source;
+                                source << seq_[idx].file << ":" << seq_[idx].line;
+                                std::cout << token << "[" << std::setw(2) << idx << "] : " << std::setw(20) << source.str() << seq_[idx].Op->NameInvariantOfChildren() << "\n";
+                        }
+                        seq_.pop_back();
+                        seq_[0].Op->Display();
+                        throw std::domain_error("recursive eval");
+                }
+                depth_.insert(ptr);
+        }
+        void Pop(){
+                depth_.erase(seq_.back().Op);
+                seq_.pop_back();
+        }
+
+private:
+        std::unordered_set<std::shared_ptr<Operator const> > depth_;
+        std::vector<StackFrame> seq_;
+};
+
+struct EvalCheckerDevice{
+        EvalCheckerDevice(EvalChecker* checker, Operator const* op,
+                          const char* file, size_t line)
+                : checker_{nullptr}
+        {
+                if( checker ){
+                        checker->Push(op->shared_from_this(), file, line);
+                        checker_ = checker;
+                }
+        }
+        ~EvalCheckerDevice(){
+                if( checker_ )
+                        checker_->Pop();
+        }
+private:
+        EvalChecker* checker_;
+};
+
+inline double Operator::EvalChecked(SymbolTable const& ST)const{
+        EvalChecker eval_checker;
+        return EvalImpl(EvalContext{ST, nullptr, &eval_checker});
+}
+
+inline void Operator::Validate()const{
+        if( IsValidated() )
+                return;
+        enum{ Color_Grey = 1, Color_Black = 2 };
+        std::unordered_map<Operator const*, int> color;
+        std::vector<std::pair<Operator const*, size_t> > stack{{this, 0}};
+        color[this] = Color_Grey;
+        for(;stack.size();){
+                auto& frame = stack.back();
+                auto head = frame.first;
+                if( frame.second == head->Arity() ){
+                        color[head] = Color_Black;
+                        head->validated_stamp_.store(head->Stamp(), std::memory_order_relaxed);
+                        stack.pop_back();
+                        continue;
+                }
+                auto child = head->children_[frame.second].get();
+                ++frame.second;
+                if( child->IsValidated() )
+                        continue;
+                auto& child_color = color[child];
+                if( child_color == Color_Black )
+                        continue;
+                if( child_color == Color_Grey ){
+                        std::stringstream ss;
+                        ss << "recursive eval :";
+                        for(auto const& p : stack ){
+                                ss << " " << p.first->NameInvariantOfChildren() << (p.first == child ? "*" : "");
+                        }
+                        throw std::domain_error(ss.str());
+                }
+                child_color = Color_Grey;
+                stack.emplace_back(child, 0);
+        }
+}
+
+inline std::uint64_t Operator::StructuralHash()const{
+        auto is_current = [](Operator const* op){
+                return op->hash_stamp_.load(std::memory_order_acquire) == op->Version() + 1;
+        };
+        if( is_current(this) )
+                return hash_.load(std::memory_order_relaxed);
+        // a cycle would never finish the post order below
+        Validate();
+        std::vector<std::pair<Operator const*, size_t> > stack{std::make_pair(this, size_t{0})};
+        for(;stack.size();){
+                auto head = stack.back().first;
+                auto idx  = stack.back().second;
+                if( idx < head->children_.size() ){
+                        ++stack.back().second;
+                        auto child = head->children_[idx].get();
+                        if( ! is_current(child) )
+                                stack.emplace_back(child, 0);
+                        continue;
+                }
+                stack.pop_back();
+                if( is_current(head) )
+                        continue;
+                Fnv1a h;
+                h.Word(head->LocalHash());
+                h.Word(head->children_.size());
+                for(auto const& child : head->children_ ){
+                        h.Word(child->hash_.load(std::memory_order_relaxed));
+                }
+                head->hash_.store(h.Value(), std::memory_order_relaxed);
+                head->hash_stamp_.store(head->Stamp(), std::memory_order_release);
+        }
+        return hash_.load(std::memory_order_relaxed);
+}
+
+inline bool Operator::StructurallyEquals(Operator const& that)const{
+        std::vector<std::pair<Operator const*, Operator const*> > stack{std::make_pair(this, &that)};
+        std::set<std::pair<Operator const*, Operator const*> > seen;
+        for(;stack.size();){
+                auto p = stack.back();
+                stack.pop_back();
+                if( p.first == p.second )
+                        continue;
+                if( ! seen.insert(p).second )
+                        continue;
+                if( p.first->StructuralHash() != p.second->StructuralHash() )
+                        return false;
+                if( ! p.first->LocalMatch(*p.second) )
+                        return false;
+                for(size_t idx=0;idx!=p.first->children_.size();++idx){
+                        stack.emplace_back(p.first->children_[idx].get(), p.second->children_[idx].get());
+                }
+        }
+        return true;
+}
+
+inline bool Rewriter::IsCurrent(Operator const* node)const{
+        auto iter = memo_.find(node);
+        return iter != memo_.end() && iter->second.Stamp == node->Version() + 1;
+}
+inline std::shared_ptr<Operator> Rewriter::Apply(std::shared_ptr<Operator> const& ptr){
+        if( IsCurrent(ptr.get()) )
+                return memo_.at(ptr.get()).Result;
+
+        // a cycle would never finish the post order below
+        ptr->Validate();
+        std::vector<std::pair<std::shared_ptr<Operator>, size_t> > stack{std::make_pair(ptr, size_t{0})};
+        for(;stack.size();){
+                auto& frame = stack.back();
+                if( frame.second < frame.first->Arity() ){
+                        auto child = frame.first->At(frame.second);
+                        ++frame.second;
+                        if( ! IsCurrent(child.get()) )
+                                stack.emplace_back(std::move(child), 0);
+                        continue;
+                }
+                auto node = std::move(frame.first);
+                stack.pop_back();
+                // in place, Rewrite() may bump the version of the node
+                auto result = Rewrite(node);
+                auto stamp = node->Stamp();
+                memo_[node.get()] = Entry{node, result, stamp};
+        }
+        return memo_.at(ptr.get()).Result;
+}
+inline std::shared_ptr<Operator> Rewriter::Rebuild(std::shared_ptr<Operator> const& ptr){
+        bool changed = false;
+        for(size_t idx=0;idx!=ptr->Arity();++idx){
+                if( Mapped(ptr->At(idx)) != ptr->At(idx) ){
+                        changed = true;
+                        break;
+                }
+        }
+        if( ! changed )
+                return ptr;
+        if( mode_ == RewriteMode_InPlace ){
+                for(size_t idx=0;idx!=ptr->Arity();++idx){
+                        auto mapped = Mapped(ptr->At(idx));
+                        if( mapped != ptr->At(idx) )
+                                ptr->Rebind(idx, mapped);
+                }
+                return ptr;
+        }
+        // Clone() takes each child through Apply(), which finds the
+        // result in the memo
+        return ptr->Clone(Self());
+}
+
+/*
+        functors for keying containers on nodes, shallow equality
+        suits passes which have already made the children unique
+ */
+struct OperatorHash{
+        size_t operator()(std::shared_ptr<Operator> const& ptr)const{
+                return static_cast<size_t>(ptr->StructuralHash());
+        }
+};
+struct OperatorShallowEqual{
+        bool operator()(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r)const{
+                return l->ShallowEquals(*r);
+        }
+};
+struct OperatorStructuralEqual{
+        bool operator()(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r)const{
+                return l->StructurallyEquals(*r);
+        }
+};
+
+/*
+        State of one differentiation request. The derivative of each node
+        is memoized, so a subexpression shared in the primal has a shared
+        derivative rather than one copy per reference, and a node which
+        doesn't depend on the symbol is a constant zero without looking
+        at it any further. The arithmetic helpers drop zero terms and
+        unit factors, so zeros don't propagate into the result.
+ */
+struct DiffContext{
+        explicit DiffContext(SymbolId symbol, DiffMode mode = DiffMode_Partial)
+                : symbol_{symbol}
+                , mode_{mode}
+        {}
+
+        SymbolId Symbol()const{ return symbol_; }
+        DiffMode Mode()const{ return mode_; }
+
+        inline std::shared_ptr<Operator> Diff(Operator const* node);
+        std::shared_ptr<Operator> Diff(std::shared_ptr<Operator> const& node){
+                return Diff(node.get());
+        }
+        inline bool DependsOn(Operator const* node);
+
+        inline std::shared_ptr<Operator> Zero();
+        inline std::shared_ptr<Operator> One();
+        static inline bool IsZero(std::shared_ptr<Operator> const& ptr);
+        static inline bool IsOne(std::shared_ptr<Operator> const& ptr);
+
+        inline std::shared_ptr<Operator> Add(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r);
+        inline std::shared_ptr<Operator> Sub(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r);
+        inline std::shared_ptr<Operator> Mul(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r);
+        inline std::shared_ptr<Operator> Div(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r);
+        inline std::shared_ptr<Operator> Neg(std::shared_ptr<Operator> const& arg);
+
+        // number of nodes differentiated so far
+        size_t Size()const{ return memo_.size(); }
+private:
+        SymbolId symbol_;
+        DiffMode mode_;
+        std::unordered_map<Operator const*, std::shared_ptr<Operator> > memo_;
+        std::shared_ptr<Operator> zero_;
+        std::shared_ptr<Operator> one_;
+};
+
+/*
+        Hash consing for the node factories. While a HashConsContext is
+        current on the thread, BinaryOperator::Add, Exp::Make,
+        Constant::Make and the other factories return the existing node
+        when one with the same operation, payload and children has
+        already been made, so common subexpressions are shared as the
+        graph is built rather than found afterwards by RemapUnique.
+
+        As the children are themselves consed, structurally identical
+        children are the same pointer, and the key is just the tag,
+        payload and child pointers, hashed in constant time. The table
+        holds weak references, so it never keeps a graph alive. A node
+        mutated in place no longer matches its key, so each hit checks
+        the children are still the ones it was made with.
+ */
+enum HashConsTag : std::uint32_t{
+        HC_Constant,
+        HC_Exogenous,
+        HC_Unary,
+        HC_Binary,
+        HC_Exp,
+        HC_Log,
+        HC_Sin,
+        HC_Cos,
+        HC_Phi,
+        HC_Sqrt,
+        HC_NormalDensity,
+};
+struct HashConsKey{
+        HashConsKey(HashConsTag tag, std::uint64_t payload, Operator const* left = nullptr, Operator const* right = nullptr)
+                : Tag{tag}
+                , Payload{payload}
+                , Left{left}
+                , Right{right}
+        {}
+        HashConsTag     Tag;
+        std::uint64_t   Payload;
+        Operator const* Left;
+        Operator const* Right;
+
+        bool operator==(HashConsKey const& that)const{
+                return Tag == that.Tag && Payload == that.Payload && Left == that.Left && Right == that.Right;
+        }
+        struct Hash{
+                size_t operator()(HashConsKey const& key)const{
+                        std::uint64_t h = key.Tag;
+                        auto mix = [&h](std::uint64_t value){
+                                h ^= value + 0x9e3779b97f4a7c15ull + ( h << 6 ) + ( h >> 2 );
+                        };
+                        mix(key.Payload);
+                        mix(reinterpret_cast<std::uintptr_t>(key.Left));
+                        mix(reinterpret_cast<std::uintptr_t>(key.Right));
+                        return static_cast<size_t>(h);
+                }
+        };
+};
+
+struct HashConsContext{
+        HashConsContext() = default;
+        HashConsContext(HashConsContext const&)=delete;
+        HashConsContext& operator=(HashConsContext const&)=delete;
+
+        std::shared_ptr<Operator> Find(HashConsKey const& key){
+                auto iter = table_.find(key);
+                if( iter == table_.end() )
+                        return nullptr;
+                auto ptr = iter->second.lock();
+                if( ! ptr || ! Matches(*ptr, key) ){
+                        table_.erase(iter);
+                        return nullptr;
+                }
+                ++hits_;
+                return ptr;
+        }
+        void Insert(HashConsKey const& key, std::shared_ptr<Operator> const& ptr){
+                table_[key] = ptr;
+                // expired entries are dropped lazily, sweep them once the
+                // table has doubled so it tracks the live graph
+                if( table_.size() > 2 * sweep_size_ ){
+                        for(auto iter = table_.begin();iter!=table_.end();){
+                                if( iter->second.expired() )
+                                        iter = table_.erase(iter);
+                                else
+                                        ++iter;
+                        }
+                        sweep_size_ = std::max<size_t>(table_.size(), 1024);
+                }
+        }
+
+        size_t Size()const{ return table_.size(); }
+        size_t Hits()const{ return hits_; }
+        void Clear(){ table_.clear(); }
+
+        static HashConsContext*& Current(){
+                static thread_local HashConsContext* current = nullptr;
+                return current;
+        }
+
+        struct Scope{
+                explicit Scope(HashConsContext& ctx)
+                        : prev_{Current()}
+                {
+                        Current() = &ctx;
+                }
+                ~Scope(){
+                        Current() = prev_;
+                }
+                Scope(Scope const&)=delete;
+                Scope& operator=(Scope const&)=delete;
+        private:
+                HashConsContext* prev_;
+        };
+
+private:
+        static bool Matches(Operator const& node, HashConsKey const& key){
+                Operator const* children[] = { key.Left, key.Right };
+                size_t arity = ( key.Right ? 2 : key.Left ? 1 : 0 );
+                if( node.Arity() != arity )
+                        return false;
+                for(size_t idx=0;idx!=arity;++idx){
+                        if( node.Children()[idx].get() != children[idx] )
+                                return false;
+                }
+                return true;
+        }
+
+        std::unordered_map<HashConsKey, std::weak_ptr<Operator>, HashConsKey::Hash> table_;
+        size_t sweep_size_{1024};
+        size_t hits_{0};
+};
+
+/*
+        factory hook used by the node factories, which are consed when a
+        HashConsContext is current
+ */
+template<class T, class... Args>
+std::shared_ptr<T> MakeConsedNode(HashConsKey const& key, Args&&... args){
+        auto ctx = HashConsContext::Current();
+        if( ! ctx )
+                return MakeNode<T>(std::forward<Args>(args)...);
+        if( auto existing = ctx->Find(key) )
+                return std::static_pointer_cast<T>(existing);
+        auto ptr = MakeNode<T>(std::forward<Args>(args)...);
+        ctx->Insert(key, ptr);
+        return ptr;
+}
+
 struct Constant : Operator{
         Constant(double value)
                 :Operator{"Constant", OPKind_Constant}
                 ,value_(value)
         {}
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
+        virtual double EvalImpl(EvalContext const& ctx)const override{
                 return value_;
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                return Constant::Make(0.0);
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                return ctx.Zero();
         }
         virtual void EmitCode(std::ostream& ss)const override{
-                ss << value_;
+                EmitLiteral(ss, value_);
+        }
+        // enough digits to round trip, the default six would
+        // turn 1/sqrt(2 pi) into 0.398942, but 0.3 stays 0.3
+        static void EmitLiteral(std::ostream& ss, double value){
+                std::stringstream literal;
+                literal.precision(std::numeric_limits<double>::digits10);
+                literal << value;
+                if( std::strtod(literal.str().c_str(), nullptr) != value ){
+                        literal.str("");
+                        literal.precision(std::numeric_limits<double>::max_digits10);
+                        literal << value;
+                }
+                ss << literal.str();
         }
 
         static std::shared_ptr<Operator> Make(double value){
-                return std::make_shared<Constant>(value);
+                std::uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                return MakeConsedNode<Constant>(HashConsKey{HC_Constant, bits}, value);
         }
         virtual std::vector<std::string> HiddenArguments()const override{ return { std::to_string(value_) }; }
         double Value()const{ return value_; }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{ return Make(value_); }
+protected:
+        // by bit pattern, HiddenArguments() is rounded
+        virtual std::uint64_t LocalHash()const override{
+                Fnv1a h;
+                h.String(Operator::Name());
+                h.Bytes(&value_, sizeof(value_));
+                return h.Value();
+        }
+        virtual bool LocalEquals(Operator const& that)const override{
+                return std::memcmp(&value_, &static_cast<Constant const&>(that).value_, sizeof(value_)) == 0;
+        }
 private:
         double value_;
 };
@@ -363,14 +1374,28 @@ struct Symbol : Operator{
         Symbol(std::string const& name, SymbolKind sk, T&&... args)
                 : Operator{std::forward<T>(args)...}
                 , name_{name}
+                , id_{SymbolRegistry::Intern(name)}
                 , sk_{sk}
         {}
         std::string const& Name()const{ return name_; }
+        SymbolId Id()const{ return id_; }
         bool IsExo()const{ return sk_ == SymbolKind_Exo; }
         bool IsEndo()const{ return sk_ == SymbolKind_Endo; }
         SymbolKind SymKind()const{ return sk_; }
+protected:
+        // by name rather than SymbolId, which differs between processes
+        virtual std::uint64_t LocalHash()const override{
+                Fnv1a h;
+                h.String(Operator::Name());
+                h.String(name_);
+                return h.Value();
+        }
+        virtual bool LocalEquals(Operator const& that)const override{
+                return id_ == static_cast<Symbol const&>(that).id_;
+        }
 private:
         std::string name_;
+        SymbolId id_;
         SymbolKind sk_;
 };
 
@@ -379,21 +1404,21 @@ struct ExogenousSymbol : Symbol{
                 :Symbol{name, SymbolKind_Exo, "ExogenousSymbol", OPKind_ExogenousSymbol}
         {}
         virtual std::vector<std::string> HiddenArguments()const override{ return {Name()}; }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return ST[Name()];
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return ctx.Value(Id());
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                if( symbol == Name() ){
-                        return Constant::Make(1.0);
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                if( ctx.Symbol() == Id() ){
+                        return ctx.One();
                 }
-                return Constant::Make(0.0);
+                return ctx.Zero();
         }
         virtual void EmitCode(std::ostream& ss)const override{
                 ss << Name();
         }
         
         static std::shared_ptr<ExogenousSymbol> Make(std::string const& symbol){
-                return std::make_shared<ExogenousSymbol>(symbol);
+                return MakeConsedNode<ExogenousSymbol>(HashConsKey{HC_Exogenous, SymbolRegistry::Intern(symbol)}, symbol);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{ return Make(Name()); }
 };
@@ -408,29 +1433,42 @@ struct EndgenousSymbol : Symbol{
         EndgenousSymbol(std::string const& name,
                         std::shared_ptr<Operator> const& expr)
                 :Symbol{name, SymbolKind_Endo, "EndgenousSymbol", OPKind_EndgenousSymbol}
+                , statement_index_{NextStatementIndex()}
         {
                 Push(expr);
         }
+        // dense and never reused, EvalMemo indexes its slots by it
+        std::uint32_t StatementIndex()const{ return statement_index_; }
         virtual std::vector<std::string> HiddenArguments()const override{ return {Name(), "<expr>"}; }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                if( symbol == Name() ){
-                        return Constant::Make(1.0);
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                if( ctx.Symbol() == Id() ){
+                        return ctx.One();
+                }
+                if( ctx.Mode() == DiffMode_Total ){
+                        // the context memoizes this, so the derivative
+                        // statement is made once however many times the
+                        // statement is referenced
+                        auto d = ctx.Diff(At(0));
+                        // no point naming a symbol, constant or statement
+                        if( d->IsTerminal() || d->Kind() == OPKind_EndgenousSymbol )
+                                return d;
+                        return EndgenousSymbol::Make("__total_diff_" + Name() + "_" + SymbolRegistry::NameOf(ctx.Symbol()), d);
                 }
                 #if 0
                 else {
                         std::stringstream text;
-                        text << "Diff(" << Name() << ", " << symbol << ")";
+                        text << "Diff(" << Name() << ", " << ctx.Symbol() << ")";
                         return ExogenousSymbol::Make(text.str());
                 }
                 #endif
-                return Constant::Make(0.0);
+                return ctx.Zero();
         }
         virtual void EmitCode(std::ostream& ss)const override{
                 ss << Name();
         }
         
         static std::shared_ptr<EndgenousSymbol> Make(std::string const& symbol, std::shared_ptr<Operator> const& expr){
-                auto ptr =  std::make_shared<EndgenousSymbol>(symbol, expr);
+                auto ptr =  MakeNode<EndgenousSymbol>(symbol, expr);
                 //std::cout << "Making EndgenousSymbol{" << symbol << ", " << expr << "} => " << ptr << "\n";
                 return ptr;
         }
@@ -438,15 +1476,59 @@ struct EndgenousSymbol : Symbol{
         std::shared_ptr<Operator> Expr()const{ return At(0); }
         std::shared_ptr<Operator> as_operator_()const{ return At(0); }
         
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                EvalCheckerDevice device(checker, shared_from_this(), __FILE__, __LINE__);
-                return At(0)->EvalImpl(ST, checker);
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                auto memo = ctx.Memo();
+                auto slot = ( memo ? memo->Slot(statement_index_) : EvalMemo::NoSlot );
+                if( slot != EvalMemo::NoSlot ){
+                        if( memo->IsCached(slot) )
+                                return memo->Get(slot);
+                        EvalCheckerDevice device(ctx.Checker(), this, __FILE__, __LINE__);
+                        double value = At(0)->EvalImpl(ctx);
+                        memo->Set(slot, value);
+                        return value;
+                }
+                EvalCheckerDevice device(ctx.Checker(), this, __FILE__, __LINE__);
+                return At(0)->EvalImpl(ctx);
         }
         
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(Name(), opt_trans->Apply(At(0)));
         }
+private:
+        static std::uint32_t NextStatementIndex(){
+                static std::atomic<std::uint32_t> next{0};
+                return next.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::uint32_t statement_index_;
 };
+
+EvalMemo::EvalMemo(Operator const& root){
+        std::vector<Operator const*> stack{&root};
+        std::unordered_set<Operator const*> seen{&root};
+        std::uint32_t lo = NoSlot, hi = 0;
+        for(;stack.size();){
+                auto head = stack.back();
+                stack.pop_back();
+                if( head->Kind() == OPKind_EndgenousSymbol ){
+                        auto index = static_cast<EndgenousSymbol const*>(head)->StatementIndex();
+                        lo = std::min(lo, index);
+                        hi = std::max(hi, index);
+                        ++size_;
+                }
+                for(auto const& ptr : head->Children()){
+                        if( seen.insert(ptr.get()).second )
+                                stack.push_back(ptr.get());
+                }
+        }
+        // statements in one graph are mostly made together, so the
+        // range is about as long as the number of them
+        if( size_ ){
+                base_ = lo;
+                values_.resize(hi - lo + 1);
+                stamp_.resize(hi - lo + 1, generation_);
+        }
+        // nothing is cached until the first NextGeneration()
+}
         
 void Operator::Display(std::ostream& ostr)const{
 
@@ -540,13 +1622,13 @@ struct UnaryOperator : Operator{
         }
 
         UnaryOperatorKind OpKind()const{ return op_; }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override
         {
-                return UnaryMinus(At(0)->Diff(symbol));
+                return ctx.Neg(ctx.Diff(At(0)));
         }
 
         static std::shared_ptr<Operator> UnaryMinus(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<UnaryOperator>(UOP_USUB, arg);
+                return MakeConsedNode<UnaryOperator>(HashConsKey{HC_Unary, UOP_USUB, arg.get()}, UOP_USUB, arg);
         }
 
         virtual void EmitCode(std::ostream& ss)const override{
@@ -555,17 +1637,27 @@ struct UnaryOperator : Operator{
                 ss << "))";
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
-                return std::make_shared<UnaryOperator>(
+                return MakeNode<UnaryOperator>(
                         op_,
                         opt_trans->Apply(At(0))
                 );
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return -At(0)->EvalImpl(ST, checker);
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return -At(0)->EvalImpl(ctx);
         }
 
 
 
+protected:
+        virtual std::uint64_t LocalHash()const override{
+                Fnv1a h;
+                h.String(Operator::Name());
+                h.Word(op_);
+                return h.Value();
+        }
+        virtual bool LocalEquals(Operator const& that)const override{
+                return op_ == static_cast<UnaryOperator const&>(that).op_;
+        }
 private:
         UnaryOperatorKind op_;
 };
@@ -613,100 +1705,32 @@ struct BinaryOperator : Operator{
         }
         std::shared_ptr<Operator> LParam()const{ return At(0); }
         std::shared_ptr<Operator> RParam()const{ return At(1); }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
+        virtual double EvalImpl(EvalContext const& ctx)const override{
                 switch(op_)
                 {
                 case OP_ADD:
                         {
-                                return At(0)->EvalImpl(ST, checker) + At(1)->EvalImpl(ST, checker);
+                                return At(0)->EvalImpl(ctx) + At(1)->EvalImpl(ctx);
                         }
                 case OP_SUB:
                         {
-                                return At(0)->EvalImpl(ST, checker) - At(1)->EvalImpl(ST, checker);
+                                return At(0)->EvalImpl(ctx) - At(1)->EvalImpl(ctx);
                         }
                 case OP_MUL:
                         {
-                                return At(0)->EvalImpl(ST, checker) * At(1)->EvalImpl(ST, checker);
+                                return At(0)->EvalImpl(ctx) * At(1)->EvalImpl(ctx);
                         }
                 case OP_DIV:
                         {
-                                return At(0)->EvalImpl(ST, checker) / At(1)->EvalImpl(ST, checker);
+                                return At(0)->EvalImpl(ctx) / At(1)->EvalImpl(ctx);
                         }
                 case OP_POW:
                         {
-                                return std::pow(At(0)->EvalImpl(ST, checker),At(1)->EvalImpl(ST, checker));
-                        }
-                }
-        }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override
-        {
-                switch(op_)
-                {
-                        case OP_ADD:
-                        {
-                                return Add(
-                                        LParam()->Diff(symbol),
-                                        RParam()->Diff(symbol)
-                                );
-                        }
-                        case OP_SUB:
-                        {
-                                return Sub(
-                                        LParam()->Diff(symbol),
-                                        RParam()->Diff(symbol)
-                                );
-                        }
-                        case OP_MUL:
-                        {
-                                return Add(
-                                        Mul( LParam()->Diff(symbol), RParam()),
-                                        Mul( LParam(), RParam()->Diff(symbol))
-                                );
-                        }
-                        case OP_DIV:
-                        {
-                                return Div(
-                                        Sub(
-                                                Mul(
-                                                        LParam()->Diff(symbol),
-                                                        RParam()
-                                                ),
-                                                Mul(
-                                                        LParam(),
-                                                        RParam()->Diff(symbol)
-                                                )
-                                        ),
-                                        Pow(
-                                                RParam(),
-                                                Constant::Make(2.0)
-                                        )
-                                );
-
-                        }
-                        case OP_POW:
-                        {
-                                // lets assume that the exponent is indpedent
-                                // of the deriviative for now
-                                //
-                                // f(x)^C = C * f(x)*(C-1) * f'(x)
-                                // ~ left ^ right
-                                //
-                                return Mul(
-                                        RParam(),
-                                        Mul(
-                                                Pow(
-                                                        LParam(),
-                                                        Sub(
-                                                                RParam(),
-                                                                Constant::Make(1.0)
-                                                        )
-                                                ),
-                                                LParam()->Diff(symbol)
-                                        )
-                                );
+                                return std::pow(At(0)->EvalImpl(ctx),At(1)->EvalImpl(ctx));
                         }
                 }
         }
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override;
 
 
         virtual void EmitCode(std::ostream& ss)const override{
@@ -738,36 +1762,46 @@ struct BinaryOperator : Operator{
         static std::shared_ptr<Operator> Add(std::shared_ptr<Operator> const& left,
                                              std::shared_ptr<Operator> const& right)
         {
-                return std::make_shared<BinaryOperator>(OP_ADD, left, right);
+                return MakeConsedNode<BinaryOperator>(HashConsKey{HC_Binary, OP_ADD, left.get(), right.get()}, OP_ADD, left, right);
         }
         static std::shared_ptr<Operator> Sub(std::shared_ptr<Operator> const& left,
                                              std::shared_ptr<Operator> const& right)
         {
-                return std::make_shared<BinaryOperator>(OP_SUB, left, right);
+                return MakeConsedNode<BinaryOperator>(HashConsKey{HC_Binary, OP_SUB, left.get(), right.get()}, OP_SUB, left, right);
         }
         static std::shared_ptr<Operator> Mul(std::shared_ptr<Operator> const& left,
                                              std::shared_ptr<Operator> const& right)
         {
-                return std::make_shared<BinaryOperator>(OP_MUL, left, right);
+                return MakeConsedNode<BinaryOperator>(HashConsKey{HC_Binary, OP_MUL, left.get(), right.get()}, OP_MUL, left, right);
         }
         static std::shared_ptr<Operator> Div(std::shared_ptr<Operator> const& left,
                                              std::shared_ptr<Operator> const& right)
         {
-                return std::make_shared<BinaryOperator>(OP_DIV, left, right);
+                return MakeConsedNode<BinaryOperator>(HashConsKey{HC_Binary, OP_DIV, left.get(), right.get()}, OP_DIV, left, right);
         }
         static std::shared_ptr<Operator> Pow(std::shared_ptr<Operator> const& left,
                                              std::shared_ptr<Operator> const& right)
         {
-                return std::make_shared<BinaryOperator>(OP_POW, left, right);
+                return MakeConsedNode<BinaryOperator>(HashConsKey{HC_Binary, OP_POW, left.get(), right.get()}, OP_POW, left, right);
         }
 
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
-                return std::make_shared<BinaryOperator>(
+                return MakeNode<BinaryOperator>(
                         op_,
                         opt_trans->Apply(At(0)),
                         opt_trans->Apply(At(1))
                 );
         }
+protected:
+        virtual std::uint64_t LocalHash()const override{
+                Fnv1a h;
+                h.String(Operator::Name());
+                h.Word(op_);
+                return h.Value();
+        }
+        virtual bool LocalEquals(Operator const& that)const override{
+                return op_ == static_cast<BinaryOperator const&>(that).op_;
+        }
 private:
         BinaryOperatorKind op_;
 };
@@ -778,10 +1812,10 @@ struct Exp : Operator{
         {
                 Push(arg);
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                return BinaryOperator::Mul(
-                        std::make_shared<Exp>(At(0)),
-                        At(0)->Diff(symbol));
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                return ctx.Mul(
+                        Exp::Make(At(0)),
+                        ctx.Diff(At(0)));
         }
         virtual void EmitCode(std::ostream& ss)const override{
                 ss << "std::exp(";
@@ -789,13 +1823,13 @@ struct Exp : Operator{
                 ss << ")";
         }
         static std::shared_ptr<Exp> Make(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<Exp>(arg);
+                return MakeConsedNode<Exp>(HashConsKey{HC_Exp, 0, arg.get()}, arg);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(opt_trans->Apply(At(0)));
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return std::exp(At(0)->EvalImpl(ST, checker));
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::exp(At(0)->EvalImpl(ctx));
         }
 };
 
@@ -805,9 +1839,9 @@ struct Log : Operator{
         {
                 Push(arg);
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                return BinaryOperator::Div(
-                        At(0)->Diff(symbol),
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                return ctx.Div(
+                        ctx.Diff(At(0)),
                         At(0));
         }
         virtual void EmitCode(std::ostream& ss)const override{
@@ -816,13 +1850,42 @@ struct Log : Operator{
                 ss << ")";
         }
         static std::shared_ptr<Log> Make(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<Log>(arg);
+                return MakeConsedNode<Log>(HashConsKey{HC_Log, 0, arg.get()}, arg);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(opt_trans->Apply(At(0)));
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return std::log(At(0)->EvalImpl(ST, checker));
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::log(At(0)->EvalImpl(ctx));
+        }
+};
+
+struct Sqrt : Operator{
+        Sqrt(std::shared_ptr<Operator> arg)
+                :Operator{"Sqrt"}
+        {
+                Push(arg);
+        }
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                return ctx.Div(
+                        ctx.Diff(At(0)),
+                        BinaryOperator::Mul(
+                                Constant::Make(2.0),
+                                Sqrt::Make(At(0))));
+        }
+        virtual void EmitCode(std::ostream& ss)const override{
+                ss << "std::sqrt(";
+                At(0)->EmitCode(ss);
+                ss << ")";
+        }
+        static std::shared_ptr<Sqrt> Make(std::shared_ptr<Operator> const& arg){
+                return MakeConsedNode<Sqrt>(HashConsKey{HC_Sqrt, 0, arg.get()}, arg);
+        }
+        virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
+                return Make(opt_trans->Apply(At(0)));
+        }
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::sqrt(At(0)->EvalImpl(ctx));
         }
 };
 
@@ -832,20 +1895,20 @@ struct Sin : Operator{
         {
                 Push(arg);
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override;
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override;
         virtual void EmitCode(std::ostream& ss)const override{
                 ss << "std::sin(";
                 At(0)->EmitCode(ss);
                 ss << ")";
         }
         static std::shared_ptr<Sin> Make(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<Sin>(arg);
+                return MakeConsedNode<Sin>(HashConsKey{HC_Sin, 0, arg.get()}, arg);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(opt_trans->Apply(At(0)));
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return std::sin(At(0)->EvalImpl(ST, checker));
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::sin(At(0)->EvalImpl(ctx));
         }
 };
 struct Cos : Operator{
@@ -854,11 +1917,11 @@ struct Cos : Operator{
         {
                 Push(arg);
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
-                return UnaryOperator::UnaryMinus(
-                        BinaryOperator::Mul(
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                return ctx.Neg(
+                        ctx.Mul(
                         Sin::Make(At(0)),
-                        At(0)->Diff(symbol)));
+                        ctx.Diff(At(0))));
         }
         virtual void EmitCode(std::ostream& ss)const override{
                 ss << "std::cos(";
@@ -866,23 +1929,60 @@ struct Cos : Operator{
                 ss << ")";
         }
         static std::shared_ptr<Cos> Make(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<Cos>(arg);
+                return MakeConsedNode<Cos>(HashConsKey{HC_Cos, 0, arg.get()}, arg);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(opt_trans->Apply(At(0)));
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return std::cos(At(0)->EvalImpl(ST, checker));
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::cos(At(0)->EvalImpl(ctx));
         }
 };
 
-std::shared_ptr<Operator> Sin::Diff(std::string const& symbol)const{
-        return BinaryOperator::Mul(
+inline std::shared_ptr<Operator> Sin::DiffImpl(DiffContext& ctx)const{
+        return ctx.Mul(
                 Cos::Make(At(0)),
-                At(0)->Diff(symbol));
+                ctx.Diff(At(0)));
 }
 
 
+// standard normal density
+struct NormalDensity : Operator{
+        NormalDensity(std::shared_ptr<Operator> arg)
+                :Operator{"NormalDensity"}
+        {
+                Push(arg);
+        }
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                // f'(x) = -x f(x)
+                return ctx.Neg(
+                        ctx.Mul(
+                                ctx.Mul(
+                                        At(0),
+                                        NormalDensity::Make(At(0))),
+                                ctx.Diff(At(0))));
+        }
+        virtual void EmitCode(std::ostream& ss)const override{
+                // as Normal::Density, the argument is emitted once and
+                // scaled as Phi scales it, pow(z, 2.0) is exactly z*z
+                ss << "(";
+                Constant::EmitLiteral(ss, Normal::InvSqrt2Pi);
+                ss << "*std::exp(-std::pow((";
+                At(0)->EmitCode(ss);
+                ss << ")/std::sqrt(2.0), 2.0)))";
+        }
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return Normal::Density(At(0)->EvalImpl(ctx));
+        }
+
+        static std::shared_ptr<Operator> Make(std::shared_ptr<Operator> const& arg){
+                return MakeConsedNode<NormalDensity>(HashConsKey{HC_NormalDensity, 0, arg.get()}, arg);
+        }
+        virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
+                return Make(opt_trans->Apply(At(0)));
+        }
+};
+
 // normal distribution CFS
 struct Phi : Operator{
         Phi(std::shared_ptr<Operator> arg)
@@ -890,42 +1990,24 @@ struct Phi : Operator{
         {
                 Push(arg);
         }
-        virtual std::shared_ptr<Operator> Diff(std::string const& symbol)const override{
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
                 // f(x) = 1/\sqrt{2 \pi} \exp{-\frac{1}{2}x^2}
-
-                return 
-                        BinaryOperator::Mul(
-                                BinaryOperator::Div(
-                                        Exp::Make(
-                                                BinaryOperator::Sub(
-                                                        Constant::Make(0.0),
-                                                        BinaryOperator::Mul(
-                                                                Constant::Make(0.5),
-                                                                BinaryOperator::Pow(
-                                                                        At(0),
-                                                                        Constant::Make(2.0)
-                                                                )
-                                                        )
-                                                )
-                                        ),
-                                        Constant::Make(2.506628274631000502415765284811045253006986740609938316629)
-                                ),
-                                At(0)->Diff(symbol)
-                        );
-
+                return ctx.Mul(
+                        NormalDensity::Make(At(0)),
+                        ctx.Diff(At(0)));
         }
         virtual void EmitCode(std::ostream& ss)const override{
                 // std::erfc(-x/std::sqrt(2))/2
-                ss << "std::erfc(-(";
+                ss << "std::erfc(-((";
                 At(0)->EmitCode(ss);
-                ss << ")/std::sqrt(2))/2";
+                ss << ")/std::sqrt(2.0)))/2";
         }
-        virtual double EvalImpl(SymbolTable const& ST, EvalChecker& checker)const override{
-                return std::erfc(-At(0)->EvalImpl(ST, checker)/std::sqrt(2))/2;
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return Normal::Cdf(At(0)->EvalImpl(ctx));
         }
 
         static std::shared_ptr<Operator> Make(std::shared_ptr<Operator> const& arg){
-                return std::make_shared<Phi>(arg);
+                return MakeConsedNode<Phi>(HashConsKey{HC_Phi, 0, arg.get()}, arg);
         }
         virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
                 return Make(opt_trans->Apply(At(0)));
@@ -997,10 +2079,270 @@ private:
 };
 
 
+inline std::shared_ptr<Operator> BinaryOperator::DiffImpl(DiffContext& ctx)const{
+        auto dl = ctx.Diff(LParam());
+        auto dr = ctx.Diff(RParam());
+        switch(op_)
+        {
+                case OP_ADD:
+                {
+                        return ctx.Add(dl, dr);
+                }
+                case OP_SUB:
+                {
+                        return ctx.Sub(dl, dr);
+                }
+                case OP_MUL:
+                {
+                        return ctx.Add(
+                                ctx.Mul( dl, RParam()),
+                                ctx.Mul( LParam(), dr)
+                        );
+                }
+                case OP_DIV:
+                {
+                        return ctx.Div(
+                                ctx.Sub(
+                                        ctx.Mul(dl, RParam()),
+                                        ctx.Mul(LParam(), dr)
+                                ),
+                                Pow(
+                                        RParam(),
+                                        Constant::Make(2.0)
+                                )
+                        );
+                }
+                case OP_POW:
+                {
+                        // f(x)^g(x) = g(x) * f(x)^(g(x)-1) * f'(x)
+                        //           + f(x)^g(x) * log(f(x)) * g'(x)
+                        //
+                        // the second term is usually absent as the
+                        // exponent is constant
+                        auto result = ctx.Zero();
+                        if( ! DiffContext::IsZero(dl) ){
+                                result = ctx.Mul(
+                                        RParam(),
+                                        ctx.Mul(
+                                                Pow(
+                                                        LParam(),
+                                                        Sub(
+                                                                RParam(),
+                                                                Constant::Make(1.0)
+                                                        )
+                                                ),
+                                                dl
+                                        )
+                                );
+                        }
+                        if( ! DiffContext::IsZero(dr) ){
+                                result = ctx.Add(
+                                        result,
+                                        ctx.Mul(
+                                                Mul(
+                                                        Pow(LParam(), RParam()),
+                                                        Log::Make(LParam())
+                                                ),
+                                                dr
+                                        )
+                                );
+                        }
+                        return result;
+                }
+        }
+        throw std::domain_error("unknown binary operator");
+}
+
+inline SymbolSet::Ptr Operator::Dependencies(DiffMode mode)const{
+        auto is_current = [mode](Operator const* op){
+                return op->deps_stamp_[mode].load(std::memory_order_acquire) == op->Version() + 1;
+        };
+        if( is_current(this) )
+                return std::atomic_load(&deps_[mode]);
+        Validate();
+        auto is_leaf = [mode](Operator const* op){
+                return op->kind_ == OPKind_Constant ||
+                       op->kind_ == OPKind_ExogenousSymbol ||
+                       ( op->kind_ == OPKind_EndgenousSymbol && mode == DiffMode_Partial );
+        };
+        std::vector<std::pair<Operator const*, size_t> > stack{std::make_pair(this, size_t{0})};
+        for(;stack.size();){
+                auto head = stack.back().first;
+                auto idx  = stack.back().second;
+                if( ! is_leaf(head) && idx < head->children_.size() ){
+                        ++stack.back().second;
+                        auto child = head->children_[idx].get();
+                        if( ! is_current(child) )
+                                stack.emplace_back(child, 0);
+                        continue;
+                }
+                stack.pop_back();
+                if( is_current(head) )
+                        continue;
+                SymbolSet::Ptr result = SymbolSet::None();
+                switch(head->kind_){
+                case OPKind_Constant:
+                        break;
+                case OPKind_ExogenousSymbol:
+                        result = SymbolSet::Of(static_cast<Symbol const*>(head)->Id());
+                        break;
+                case OPKind_EndgenousSymbol:
+                        result = SymbolSet::Of(static_cast<Symbol const*>(head)->Id());
+                        if( mode == DiffMode_Total )
+                                result = SymbolSet::Union(result, std::atomic_load(&head->children_[0]->deps_[mode]));
+                        break;
+                default:
+                        for(auto const& child : head->children_ ){
+                                result = SymbolSet::Union(result, std::atomic_load(&child->deps_[mode]));
+                        }
+                        break;
+                }
+                std::atomic_store(&head->deps_[mode], result);
+                head->deps_stamp_[mode].store(head->Stamp(), std::memory_order_release);
+        }
+        return std::atomic_load(&deps_[mode]);
+}
+
+/*
+        DiffImpl() takes the derivatives of the children through Diff(),
+        so the children which depend on the symbol are differentiated
+        first, in an explicit post order. Each DiffImpl() then only finds
+        its children in the memo, and the stack depth doesn't grow with
+        the depth of the graph.
+ */
+inline std::shared_ptr<Operator> DiffContext::Diff(Operator const* node){
+        auto iter = memo_.find(node);
+        if( iter != memo_.end() )
+                return iter->second;
+        // the nodes DiffImpl() doesn't take the derivative of the children of
+        auto is_leaf = [this](Operator const* op){
+                return op->IsTerminal() ||
+                       ( op->Kind() == OPKind_EndgenousSymbol && mode_ == DiffMode_Partial );
+        };
+        std::vector<std::pair<Operator const*, size_t> > stack{std::make_pair(node, size_t{0})};
+        for(;stack.size();){
+                auto head = stack.back().first;
+                auto idx  = stack.back().second;
+                if( idx == 0 && ! DependsOn(head) ){
+                        memo_.emplace(head, Zero());
+                        stack.pop_back();
+                        continue;
+                }
+                if( ! is_leaf(head) && idx < head->Arity() ){
+                        ++stack.back().second;
+                        auto child = head->Children()[idx].get();
+                        if( memo_.count(child) == 0 )
+                                stack.emplace_back(child, 0);
+                        continue;
+                }
+                stack.pop_back();
+                if( memo_.count(head) == 0 )
+                        memo_.emplace(head, head->DiffImpl(*this));
+        }
+        return memo_.at(node);
+}
+inline bool DiffContext::DependsOn(Operator const* node){
+        return node->Dependencies(mode_)->Contains(symbol_);
+}
+inline std::shared_ptr<Operator> DiffContext::Zero(){
+        if( ! zero_ )
+                zero_ = Constant::Make(0.0);
+        return zero_;
+}
+inline std::shared_ptr<Operator> DiffContext::One(){
+        if( ! one_ )
+                one_ = Constant::Make(1.0);
+        return one_;
+}
+inline bool DiffContext::IsZero(std::shared_ptr<Operator> const& ptr){
+        return ConstantDescription(ptr).IsZero();
+}
+inline bool DiffContext::IsOne(std::shared_ptr<Operator> const& ptr){
+        return ConstantDescription(ptr).IsOne();
+}
+inline std::shared_ptr<Operator> DiffContext::Add(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+        if( IsZero(l) )
+                return r;
+        if( IsZero(r) )
+                return l;
+        return BinaryOperator::Add(l, r);
+}
+inline std::shared_ptr<Operator> DiffContext::Sub(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+        if( IsZero(r) )
+                return l;
+        if( IsZero(l) )
+                return Neg(r);
+        return BinaryOperator::Sub(l, r);
+}
+inline std::shared_ptr<Operator> DiffContext::Mul(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+        if( IsZero(l) || IsZero(r) )
+                return Zero();
+        if( IsOne(l) )
+                return r;
+        if( IsOne(r) )
+                return l;
+        return BinaryOperator::Mul(l, r);
+}
+inline std::shared_ptr<Operator> DiffContext::Div(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+        if( IsZero(l) )
+                return Zero();
+        if( IsOne(r) )
+                return l;
+        return BinaryOperator::Div(l, r);
+}
+inline std::shared_ptr<Operator> DiffContext::Neg(std::shared_ptr<Operator> const& arg){
+        if( IsZero(arg) )
+                return Zero();
+        return UnaryOperator::UnaryMinus(arg);
+}
+
+inline std::shared_ptr<Operator> Operator::Diff(SymbolId symbol)const{
+        DiffContext ctx(symbol);
+        return ctx.Diff(this);
+}
+inline std::shared_ptr<Operator> Operator::TotalDiff(SymbolId symbol)const{
+        DiffContext ctx(symbol, DiffMode_Total);
+        return ctx.Diff(this);
+}
+
 inline void Operator::MutateToEndgenous(std::string const& name){
         auto clone = this->Clone();
+        // the parents still refer to this node, and the version must
+        // keep increasing for what was cached against it
+        auto parents = parents_;
+        auto version = Version();
         this->~Operator();
         new(this)EndgenousSymbol(name, clone);
+        parents_ = parents;
+        version_.store(version, std::memory_order_release);
+        Invalidate();
+}
+
+inline void Operator::Invalidate(){
+        version_.fetch_add(1, std::memory_order_acq_rel);
+        observed_.store(false, std::memory_order_relaxed);
+        std::vector<Operator*> stack{this};
+        std::vector<Operator*> parents;
+        for(;stack.size();){
+                auto head = stack.back();
+                stack.pop_back();
+                {
+                        std::lock_guard<std::mutex> lock(LinkMutex(head));
+                        for(auto link = head->parents_;link;link = link->Next){
+                                parents.push_back(link->Parent);
+                        }
+                }
+                // a parent which cached nothing since it was last bumped
+                // has no ancestor which did either, and clearing the flag
+                // first means a cycle ends
+                for(auto parent : parents){
+                        if( parent->observed_.exchange(false, std::memory_order_relaxed) ){
+                                parent->version_.fetch_add(1, std::memory_order_acq_rel);
+                                stack.push_back(parent);
+                        }
+                }
+                parents.clear();
+        }
 }
 
 
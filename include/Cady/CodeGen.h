@@ -2,11 +2,86 @@
 #define INCLUDE_CADY_CODEGEN_H
 
 #include "Cady.h"
+#include "Lowering.h"
 #include "Transform.h"
 
 namespace Cady{
 namespace CodeGen{
 
+/*
+        Phi(x) in a statement and NormalDensity(x) in its partials, as
+        Phi and its derivative give, are emitted as one scaling of x
+        which both are taken from, as Normal::Cdf(x, density) does for
+        the evaluators. Emit() writes the shared temporaries, and
+        Apply() then maps each such Phi and NormalDensity to its own.
+ */
+struct NormalPairs : Rewriter{
+        NormalPairs(std::shared_ptr<Operator> const& value, OperatorVector const& partials){
+                auto phis = Collect(OperatorVector{value}, LK_PHI);
+                std::unordered_set<std::shared_ptr<Operator>, OperatorHash, OperatorStructuralEqual> with_phi(phis.begin(), phis.end());
+                for(auto const& arg : Collect(partials, LK_NPDF) ){
+                        if( with_phi.count(arg) && pairs_.count(arg) == 0 ){
+                                pairs_.emplace(arg, Pair{});
+                                order_.push_back(arg);
+                        }
+                }
+        }
+        void Emit(std::ostream& ss, std::string const& indent, size_t& counter){
+                for(auto const& arg : order_ ){
+                        std::stringstream suffix;
+                        suffix << counter++;
+                        auto z = "__normal_z_" + suffix.str();
+                        auto& pair = pairs_.at(arg);
+                        pair.Cdf = ExogenousSymbol::Make("__normal_cdf_" + suffix.str());
+                        pair.Density = ExogenousSymbol::Make("__normal_pdf_" + suffix.str());
+                        ss << indent << "double " << z << " = (";
+                        arg->EmitCode(ss);
+                        ss << ")/std::sqrt(2.0);\n";
+                        ss << indent << "double " << pair.Cdf->Name() << " = std::erfc(-" << z << ")/2;\n";
+                        ss << indent << "double " << pair.Density->Name() << " = ";
+                        Constant::EmitLiteral(ss, Normal::InvSqrt2Pi);
+                        ss << "*std::exp(-" << z << "*" << z << ");\n";
+                }
+        }
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                auto kind = Classify(ptr.get());
+                if( kind == LK_PHI || kind == LK_NPDF ){
+                        auto iter = pairs_.find(ptr->At(0));
+                        if( iter != pairs_.end() && iter->second.Cdf )
+                                return kind == LK_PHI ? iter->second.Cdf : iter->second.Density;
+                }
+                return Rebuild(ptr);
+        }
+private:
+        struct Pair{
+                std::shared_ptr<Symbol> Cdf;
+                std::shared_ptr<Symbol> Density;
+        };
+        // the arguments of the nodes of the given kind under roots
+        static OperatorVector Collect(OperatorVector const& roots, LoweredKind kind){
+                OperatorVector result;
+                std::unordered_set<Operator const*> seen;
+                std::vector<Operator const*> stack;
+                for(auto const& root : roots )
+                        stack.push_back(root.get());
+                for(;stack.size();){
+                        auto head = stack.back();
+                        stack.pop_back();
+                        if( ! seen.insert(head).second )
+                                continue;
+                        if( Classify(head) == kind )
+                                result.push_back(head->At(0));
+                        for(auto const& child : head->Children() )
+                                stack.push_back(child.get());
+                }
+                return result;
+        }
+
+        std::unordered_map<std::shared_ptr<Operator>, Pair, OperatorHash, OperatorStructuralEqual> pairs_;
+        OperatorVector order_;
+};
+
 struct StringCodeGenerator{
         void Emit(std::ostream& ss, Function const& f)const{
 
@@ -18,8 +93,10 @@ struct StringCodeGenerator{
                 struct VariableInfo{
                         VariableInfo(std::string const& name)
                                 : name_{name}
+                                , id_{SymbolRegistry::Intern(name)}
                         {}
                         std::string const& Name()const{ return name_; }
+                        SymbolId Id()const{ return id_; }
                         boost::optional<std::shared_ptr<Operator> > GetDiffLexical(std::string const& symbol)const{
                                 auto iter = diff_map_.find(symbol);
                                 if( iter == diff_map_.end() )
@@ -32,6 +109,7 @@ struct StringCodeGenerator{
                         }
                 private:
                         std::string name_;
+                        SymbolId id_;
                         std::unordered_map<std::string, std::shared_ptr<Operator> > diff_map_;
                 };
 
@@ -68,6 +146,7 @@ struct StringCodeGenerator{
                 std::string indent = "    ";
 
                 TemporaryAllocator temp_alloc;
+                size_t normal_index = 0;
 
                 for(size_t idx=0;idx!=f.Statements().size();++idx){
                         // for each statement we need to add two calculations to the
@@ -85,47 +164,64 @@ struct StringCodeGenerator{
                         
                         auto stmt_dep = std::make_shared<VariableInfo>(stmt->Name());
                         
+                        // only the variables the statement refers to have
+                        // a non zero partial, and each partial is taken
+                        // once rather than once per direction
+                        auto stmt_deps = expr->Dependencies();
+                        std::vector<std::pair<std::shared_ptr<VariableInfo>, std::shared_ptr<Operator> > > partials;
+                        for( auto const& info : deps ){
+                                if( ! stmt_deps->Contains(info->Id()) )
+                                        continue;
+                                // \partial stmt / \partial symbol
+                                auto partial = folder.Fold(expr->Diff(info->Id()));
+                                if( DiffContext::IsZero(partial) )
+                                        continue;
+                                partials.emplace_back(info, partial);
+                        }
+
+                        OperatorVector partial_exprs;
+                        for( auto const& p : partials )
+                                partial_exprs.push_back(p.second);
+                        NormalPairs normal_pairs(expr, partial_exprs);
+                        normal_pairs.Emit(ss, indent, normal_index);
+                        for( auto& p : partials )
+                                p.second = normal_pairs.Apply(p.second);
+
                         #if 0
                         ss << indent << "/* expr\n";
                         expr->Display(ss);
                         ss << indent << "*/\n";
                         #endif
                         ss << indent << "double " << stmt_dep->Name() << " = ";
-                        expr->EmitCode(ss);
+                        normal_pairs.Apply(expr)->EmitCode(ss);
                         ss << ";\n";
 
-
                         for( auto const& d_symbol : to_diff ){
                                 std::vector<std::string> subs;
 
-                                for( auto const& info : deps ){
+                                for( auto const& p : partials ){
 
-                                        auto temp_name = temp_alloc.Allocate();
-
-                                         ;
+                                        // a variable with no tangent in this
+                                        // direction contributes nothing
+                                        auto tangent = *p.first->GetDiffLexical(d_symbol);
+                                        if( DiffContext::IsZero(tangent) )
+                                                continue;
 
                                         // \partial stmt / \partial symbol d symbol
-                                        auto sub_diff = BinaryOperator::Mul(
-                                                expr->Diff( info->Name() ),
-                                                *info->GetDiffLexical(d_symbol));
-
-                                        sub_diff = folder.Fold(sub_diff);
-
-                                        if( sub_diff->Kind() == OPKind_Constant  ){
-                                                auto constant = reinterpret_cast<Constant*>(sub_diff.get());
-                                                if( constant->Value() == 0.0 )
-                                                        continue;
-                                        }
+                                        auto sub_diff = folder.Fold(BinaryOperator::Mul(p.second, tangent));
 
+                                        if( DiffContext::IsZero(sub_diff) )
+                                                continue;
 
                                         #if 0
-                                        ss << indent << "// \\partial " << stmt->Name() << " / \\partial " << info->Name() << " d " << info->Name() << "\n";
+                                        ss << indent << "// \\partial " << stmt->Name() << " / \\partial " << p.first->Name() << " d " << p.first->Name() << "\n";
                                         #endif
                                         #if 0
                                         ss << indent << "/* expr\n";
                                         sub_diff->Display(ss);
                                         ss << indent << "*/\n";
                                         #endif
+                                        auto temp_name = temp_alloc.Allocate();
                                         ss << indent << "double " << temp_name << " = ";
                                         sub_diff->EmitCode(ss);
                                         ss << ";\n";
@@ -133,20 +229,22 @@ struct StringCodeGenerator{
                                         subs.push_back(temp_name);
                                 }
 
+                                // structurally zero tangents are never
+                                // emitted, later statements see the
+                                // constant and skip the term entirely
+                                if( subs.empty() ){
+                                        stmt_dep->MapDiff( d_symbol, Constant::Make(0.0));
+                                        continue;
+                                }
 
                                 std::string token = "__diff_" + stmt->Name() + "_" + d_symbol;
                                 stmt_dep->MapDiff( d_symbol, ExogenousSymbol::Make(token));
 
-
                                 ss << indent << "double " << token << " = ";
-                                if( subs.size() ){
-                                        for(size_t idx=0;idx!=subs.size();++idx){
-                                                if( idx != 0 )
-                                                        ss << " + ";
-                                                ss << subs[idx];
-                                        }
-                                } else {
-                                        ss << "0.0";
+                                for(size_t idx=0;idx!=subs.size();++idx){
+                                        if( idx != 0 )
+                                                ss << " + ";
+                                        ss << subs[idx];
                                 }
                                 ss << ";\n";
                         }
@@ -156,7 +254,9 @@ struct StringCodeGenerator{
                 }
                         
                 for( auto const& d_symbol : to_diff ){
-                        ss << indent << "*d_" + d_symbol << " = " << reinterpret_cast<ExogenousSymbol*>(deps.back()->GetDiffLexical(d_symbol).get().get())->Name() << ";\n";
+                        ss << indent << "*d_" + d_symbol << " = ";
+                        deps.back()->GetDiffLexical(d_symbol).get()->EmitCode(ss);
+                        ss << ";\n";
                 }
 
                 ss << indent << "return " << deps.back()->Name() << ";\n";
@@ -0,0 +1,215 @@
+#ifndef INCLUDE_CADY_COMPACTIR_H
+#define INCLUDE_CADY_COMPACTIR_H
+
+#include "Cady.h"
+#include "Lowering.h"
+
+namespace Cady{
+
+/*
+        A compact representation of an Operator DAG. Nodes live in one
+        contiguous array in topological order, each holding an opcode,
+        up to two operands as indices of earlier nodes, and a constant
+        or symbol payload, 24 bytes in all against well over a hundred
+        for an Operator with its name, children vector and control
+        block. Every pass over the graph is then a linear scan, and a
+        graph of millions of nodes is a single allocation.
+
+        EndgenousSymbol nodes are kept, with their name as the payload,
+        so that converting back gives the same statements.
+ */
+enum CompactOpCode : std::uint8_t{
+        COP_CONSTANT,
+        COP_EXO,
+        COP_ENDO,
+        COP_ADD,
+        COP_SUB,
+        COP_MUL,
+        COP_DIV,
+        COP_POW,
+        COP_USUB,
+        COP_EXP,
+        COP_LOG,
+        COP_SIN,
+        COP_COS,
+        COP_PHI,
+        COP_SQRT,
+        COP_NPDF,
+};
+
+struct CompactNode{
+        CompactOpCode Op;
+        std::uint32_t Left;
+        std::uint32_t Right;
+        union{
+                double   Value;
+                SymbolId Symbol;
+        };
+};
+
+struct CompactGraph{
+        enum : std::uint32_t{ NoOperand = 0xFFFFFFFFu };
+
+        static CompactGraph FromOperator(std::shared_ptr<Operator> const& root){
+                return FromOperators(std::vector<std::shared_ptr<Operator> >{root});
+        }
+        static CompactGraph FromOperators(std::vector<std::shared_ptr<Operator> > const& roots){
+                CompactGraph result;
+                Builder builder{result};
+                for(auto const& root : roots ){
+                        result.roots_.push_back(builder.Visit(root.get()));
+                }
+                return result;
+        }
+
+        std::vector<CompactNode> const& Nodes()const{ return nodes_; }
+        std::vector<std::uint32_t> const& Roots()const{ return roots_; }
+        size_t Size()const{ return nodes_.size(); }
+
+        /*
+                rebuilds the Operator graph, sharing is preserved so each
+                compact node becomes exactly one Operator
+         */
+        std::vector<std::shared_ptr<Operator> > ToOperators()const{
+                std::vector<std::shared_ptr<Operator> > ops(nodes_.size());
+                for(size_t idx=0;idx!=nodes_.size();++idx){
+                        auto const& node = nodes_[idx];
+                        ops[idx] = MakeOperator(node,
+                                                node.Left  != NoOperand ? ops[node.Left]  : nullptr,
+                                                node.Right != NoOperand ? ops[node.Right] : nullptr);
+                }
+                std::vector<std::shared_ptr<Operator> > result;
+                for(auto root : roots_ ){
+                        result.push_back(ops[root]);
+                }
+                return result;
+        }
+        std::shared_ptr<Operator> ToOperator()const{
+                return ToOperators().at(0);
+        }
+        // the Operator for node over the given operands
+        static std::shared_ptr<Operator> MakeOperator(CompactNode const& node,
+                                                      std::shared_ptr<Operator> const& left,
+                                                      std::shared_ptr<Operator> const& right)
+        {
+                switch(node.Op){
+                case COP_CONSTANT: return Constant::Make(node.Value);
+                case COP_EXO:      return ExogenousSymbol::Make(SymbolRegistry::NameOf(node.Symbol));
+                case COP_ENDO:     return EndgenousSymbol::Make(SymbolRegistry::NameOf(node.Symbol), left);
+                case COP_ADD:      return BinaryOperator::Add(left, right);
+                case COP_SUB:      return BinaryOperator::Sub(left, right);
+                case COP_MUL:      return BinaryOperator::Mul(left, right);
+                case COP_DIV:      return BinaryOperator::Div(left, right);
+                case COP_POW:      return BinaryOperator::Pow(left, right);
+                case COP_USUB:     return UnaryOperator::UnaryMinus(left);
+                case COP_EXP:      return Exp::Make(left);
+                case COP_LOG:      return Log::Make(left);
+                case COP_SIN:      return Sin::Make(left);
+                case COP_COS:      return Cos::Make(left);
+                case COP_PHI:      return Phi::Make(left);
+                case COP_SQRT:     return Sqrt::Make(left);
+                case COP_NPDF:     return NormalDensity::Make(left);
+                }
+                throw std::domain_error("unknown compact opcode");
+        }
+
+        /*
+                values receives one entry per node, returns the value of
+                the first root
+         */
+        double Eval(SymbolTable const& ST, std::vector<double>& values)const{
+                values.resize(nodes_.size());
+                for(size_t idx=0;idx!=nodes_.size();++idx){
+                        auto const& node = nodes_[idx];
+                        double& result = values[idx];
+                        switch(node.Op){
+                        case COP_CONSTANT: result = node.Value; break;
+                        case COP_EXO:      result = ST.At(node.Symbol); break;
+                        case COP_ENDO:     result = values[node.Left]; break;
+                        case COP_ADD:      result = values[node.Left] + values[node.Right]; break;
+                        case COP_SUB:      result = values[node.Left] - values[node.Right]; break;
+                        case COP_MUL:      result = values[node.Left] * values[node.Right]; break;
+                        case COP_DIV:      result = values[node.Left] / values[node.Right]; break;
+                        case COP_POW:      result = std::pow(values[node.Left], values[node.Right]); break;
+                        case COP_USUB:     result = -values[node.Left]; break;
+                        case COP_EXP:      result = std::exp(values[node.Left]); break;
+                        case COP_LOG:      result = std::log(values[node.Left]); break;
+                        case COP_SIN:      result = std::sin(values[node.Left]); break;
+                        case COP_COS:      result = std::cos(values[node.Left]); break;
+                        case COP_PHI:      result = Normal::Cdf(values[node.Left]); break;
+                        case COP_SQRT:     result = std::sqrt(values[node.Left]); break;
+                        case COP_NPDF:     result = Normal::Density(values[node.Left]); break;
+                        }
+                }
+                return values[roots_.at(0)];
+        }
+        double Eval(SymbolTable const& ST)const{
+                std::vector<double> values;
+                return Eval(ST, values);
+        }
+
+private:
+        struct Builder : PostOrderLowering<Builder, std::uint32_t>{
+                explicit Builder(CompactGraph& graph):graph_(graph){}
+        private:
+                friend struct PostOrderLowering<Builder, std::uint32_t>;
+                std::uint32_t Emit(Operator const* op){
+                        switch(Classify(op)){
+                        case LK_CONSTANT:
+                        {
+                                auto index = Push(COP_CONSTANT);
+                                graph_.nodes_[index].Value = static_cast<Constant const*>(op)->Value();
+                                return index;
+                        }
+                        case LK_EXO:
+                        {
+                                auto index = Push(COP_EXO);
+                                graph_.nodes_[index].Symbol = static_cast<Symbol const*>(op)->Id();
+                                return index;
+                        }
+                        case LK_ENDO:
+                        {
+                                auto index = Push(COP_ENDO, Arg(op, 0));
+                                graph_.nodes_[index].Symbol = static_cast<Symbol const*>(op)->Id();
+                                return index;
+                        }
+                        case LK_USUB: return Push(COP_USUB, Arg(op, 0));
+                        case LK_ADD:  return Push(COP_ADD, Arg(op, 0), Arg(op, 1));
+                        case LK_SUB:  return Push(COP_SUB, Arg(op, 0), Arg(op, 1));
+                        case LK_MUL:  return Push(COP_MUL, Arg(op, 0), Arg(op, 1));
+                        case LK_DIV:  return Push(COP_DIV, Arg(op, 0), Arg(op, 1));
+                        case LK_POW:  return Push(COP_POW, Arg(op, 0), Arg(op, 1));
+                        case LK_EXP:  return Push(COP_EXP, Arg(op, 0));
+                        case LK_LOG:  return Push(COP_LOG, Arg(op, 0));
+                        case LK_SIN:  return Push(COP_SIN, Arg(op, 0));
+                        case LK_COS:  return Push(COP_COS, Arg(op, 0));
+                        case LK_PHI:  return Push(COP_PHI, Arg(op, 0));
+                        case LK_SQRT: return Push(COP_SQRT, Arg(op, 0));
+                        case LK_NPDF: return Push(COP_NPDF, Arg(op, 0));
+                        case LK_UNKNOWN: break;
+                        }
+                        std::stringstream ss;
+                        ss << "no compact representation for " << op->NameInvariantOfChildren();
+                        throw std::domain_error(ss.str());
+                }
+                std::uint32_t Push(CompactOpCode op, std::uint32_t left = NoOperand, std::uint32_t right = NoOperand){
+                        CompactNode node;
+                        node.Op    = op;
+                        node.Left  = left;
+                        node.Right = right;
+                        node.Value = 0.0;
+                        auto index = static_cast<std::uint32_t>(graph_.nodes_.size());
+                        graph_.nodes_.push_back(node);
+                        return index;
+                }
+
+                CompactGraph& graph_;
+        };
+
+        std::vector<CompactNode> nodes_;
+        std::vector<std::uint32_t> roots_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_COMPACTIR_H
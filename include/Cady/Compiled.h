@@ -0,0 +1,348 @@
+#ifndef INCLUDE_CADY_COMPILED_H
+#define INCLUDE_CADY_COMPILED_H
+
+#include "Cady.h"
+#include "Lowering.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace Cady{
+
+/*
+        A CompiledExpression is a linearization of an Operator DAG into
+        a flat instruction tape. Each instruction reads one or two slots
+        of a workspace and writes one slot, so evaluation is a single
+        loop over a contiguous vector with no virtual calls, no shared_ptr
+        traffic and no allocation.
+
+        The workspace is laid out as
+
+                [ inputs | constants | temporaries ]
+
+        Every node of the DAG is visited exactly once during compilation,
+        so an EndgenousSymbol (or any other shared subexpression) referenced
+        from several parents is computed once per evaluation.
+
+        TOP_PHI_NPDF is the one instruction with two results, Phi of its
+        argument in Result and the normal density in Right. It replaces
+        a TOP_PHI and TOP_NPDF of the same argument, as Phi and its
+        derivative give, so both come from one scaling of the argument.
+ */
+enum TapeOpCode{
+        TOP_ADD,
+        TOP_SUB,
+        TOP_MUL,
+        TOP_DIV,
+        TOP_POW,
+        TOP_USUB,
+        TOP_EXP,
+        TOP_LOG,
+        TOP_SIN,
+        TOP_COS,
+        TOP_PHI,
+        TOP_SQRT,
+        TOP_NPDF,
+        TOP_PHI_NPDF,
+};
+
+struct TapeInstruction{
+        TapeOpCode    Op;
+        std::uint32_t Result;
+        std::uint32_t Left;
+        std::uint32_t Right;
+};
+
+struct CompiledExpression{
+
+        static CompiledExpression Compile(std::shared_ptr<Operator> const& root,
+                                          std::vector<std::string> const& args = {})
+        {
+                return Compile(std::vector<std::shared_ptr<Operator> >{root}, args);
+        }
+        /*
+                args fixes the order of the leading input slots, any other
+                exogenous symbol found in the graph is appended after them
+         */
+        static CompiledExpression Compile(std::vector<std::shared_ptr<Operator> > const& roots,
+                                          std::vector<std::string> const& args = {})
+        {
+                CompiledExpression result;
+                Compiler compiler{result};
+                for(auto const& arg : args ){
+                        compiler.InputSlot(arg);
+                }
+                for(auto const& root : roots ){
+                        compiler.Visit(root);
+                }
+                compiler.Finalize(roots);
+                return result;
+        }
+        static CompiledExpression Compile(Function const& f){
+                if( f.Statements().empty() )
+                        throw std::domain_error("can't compile function without statements");
+                return Compile(f.Statements().back(), f.Arguments());
+        }
+        /*
+                one output per statement of the function
+         */
+        static CompiledExpression CompileStatements(Function const& f){
+                std::vector<std::shared_ptr<Operator> > roots(f.Statements().begin(), f.Statements().end());
+                return Compile(roots, f.Arguments());
+        }
+
+        size_t NumInputs()const{ return inputs_.size(); }
+        size_t NumOutputs()const{ return outputs_.size(); }
+        size_t WorkspaceSize()const{ return workspace_size_; }
+        std::vector<std::string> const& Inputs()const{ return inputs_; }
+        std::vector<SymbolId> const& InputIds()const{ return input_ids_; }
+        std::vector<std::uint32_t> const& Outputs()const{ return outputs_; }
+        std::vector<TapeInstruction> const& Tape()const{ return tape_; }
+        std::vector<double> const& Constants()const{ return constants_; }
+
+        size_t InputIndex(std::string const& name)const{
+                for(size_t idx=0;idx!=inputs_.size();++idx){
+                        if( inputs_[idx] == name )
+                                return idx;
+                }
+                std::stringstream ss;
+                ss << "symbol " << name << " is not an input";
+                throw std::domain_error(ss.str());
+        }
+
+        /*
+                workspace must hold WorkspaceSize() doubles, the outputs
+                can then be read from workspace[Outputs()[i]]
+         */
+        void Execute(double const* inputs, double* workspace)const{
+                if( inputs != workspace )
+                        std::copy(inputs, inputs + inputs_.size(), workspace);
+                std::copy(constants_.begin(), constants_.end(), workspace + inputs_.size());
+                for(auto const& instr : tape_ ){
+                        double const x = workspace[instr.Left];
+                        double& result = workspace[instr.Result];
+                        switch(instr.Op){
+                        case TOP_ADD:  result = x + workspace[instr.Right]; break;
+                        case TOP_SUB:  result = x - workspace[instr.Right]; break;
+                        case TOP_MUL:  result = x * workspace[instr.Right]; break;
+                        case TOP_DIV:  result = x / workspace[instr.Right]; break;
+                        case TOP_POW:  result = std::pow(x, workspace[instr.Right]); break;
+                        case TOP_USUB: result = -x; break;
+                        case TOP_EXP:  result = std::exp(x); break;
+                        case TOP_LOG:  result = std::log(x); break;
+                        case TOP_SIN:  result = std::sin(x); break;
+                        case TOP_COS:  result = std::cos(x); break;
+                        case TOP_PHI:  result = Normal::Cdf(x); break;
+                        case TOP_SQRT: result = std::sqrt(x); break;
+                        case TOP_NPDF: result = Normal::Density(x); break;
+                        case TOP_PHI_NPDF: result = Normal::Cdf(x, workspace[instr.Right]); break;
+                        }
+                }
+        }
+
+        /*
+                evaluates against the internal workspace, so isn't
+                reentrant, use Execute() with a workspace per thread
+         */
+        double Eval(double const* inputs)const{
+                Execute(inputs, workspace_.data());
+                return workspace_[outputs_[0]];
+        }
+        void Eval(double const* inputs, double* outputs)const{
+                Execute(inputs, workspace_.data());
+                for(size_t idx=0;idx!=outputs_.size();++idx){
+                        outputs[idx] = workspace_[outputs_[idx]];
+                }
+        }
+        double Eval(SymbolTable const& ST)const{
+                for(size_t idx=0;idx!=inputs_.size();++idx){
+                        workspace_[idx] = ST.At(input_ids_[idx]);
+                }
+                return Eval(workspace_.data());
+        }
+
+        void Display(std::ostream& ostr = std::cout)const{
+                auto slot_name = [&](std::uint32_t slot){
+                        std::stringstream ss;
+                        if( slot < inputs_.size() ){
+                                ss << inputs_[slot];
+                        } else if( slot < inputs_.size() + constants_.size() ){
+                                ss << constants_[slot - inputs_.size()];
+                        } else {
+                                ss << "w" << slot;
+                        }
+                        return ss.str();
+                };
+                static const char* mnemonic[] = {
+                        "add", "sub", "mul", "div", "pow",
+                        "usub", "exp", "log", "sin", "cos", "phi",
+                        "sqrt", "npdf", "phi_npdf"
+                };
+                for(auto const& instr : tape_ ){
+                        ostr << std::setw(6) << slot_name(instr.Result);
+                        if( instr.Op == TOP_PHI_NPDF )
+                                ostr << ", " << slot_name(instr.Right);
+                        ostr << " = " << mnemonic[instr.Op] << " " << slot_name(instr.Left);
+                        if( IsBinary(instr.Op) )
+                                ostr << ", " << slot_name(instr.Right);
+                        ostr << "\n";
+                }
+                for(auto slot : outputs_ ){
+                        ostr << "   ret " << slot_name(slot) << "\n";
+                }
+        }
+
+        static bool IsBinary(TapeOpCode op){
+                return op <= TOP_POW;
+        }
+
+private:
+        struct Compiler : PostOrderLowering<Compiler, std::uint32_t>{
+                explicit Compiler(CompiledExpression& expr):expr_(expr){}
+
+                std::uint32_t InputSlot(std::string const& name){
+                        return InputSlot(SymbolRegistry::Intern(name));
+                }
+                std::uint32_t InputSlot(SymbolId id){
+                        auto iter = input_map_.find(id);
+                        if( iter != input_map_.end() )
+                                return iter->second;
+                        auto slot = static_cast<std::uint32_t>(expr_.inputs_.size());
+                        expr_.inputs_.push_back(SymbolRegistry::NameOf(id));
+                        expr_.input_ids_.push_back(id);
+                        input_map_[id] = slot;
+                        return slot;
+                }
+
+                void Visit(std::shared_ptr<Operator> const& root){
+                        PostOrderLowering::Visit(root.get());
+                }
+
+                void Finalize(std::vector<std::shared_ptr<Operator> > const& roots){
+                        // temporaries are numbered by their instruction,
+                        // so count them before fusing drops any
+                        auto num_temps = expr_.tape_.size();
+                        FuseNormal();
+
+                        // constant slots go between the inputs and the temporaries,
+                        // which we only know once everything has been visited
+                        auto num_inputs    = static_cast<std::uint32_t>(expr_.inputs_.size());
+                        auto num_constants = static_cast<std::uint32_t>(expr_.constants_.size());
+                        auto relocate = [&](std::uint32_t slot){
+                                switch(slot & SlotTagMask){
+                                case InputTag:    return slot & ~SlotTagMask;
+                                case ConstantTag: return num_inputs + (slot & ~SlotTagMask);
+                                default:          return num_inputs + num_constants + (slot & ~SlotTagMask);
+                                }
+                        };
+                        for(auto& instr : expr_.tape_ ){
+                                instr.Result = relocate(instr.Result);
+                                instr.Left   = relocate(instr.Left);
+                                instr.Right  = relocate(instr.Right);
+                        }
+                        for(auto const& root : roots ){
+                                expr_.outputs_.push_back(relocate(Lowered(root.get())));
+                        }
+                        expr_.workspace_size_ = num_inputs + num_constants + num_temps;
+                        expr_.workspace_.resize(expr_.workspace_size_);
+                }
+        private:
+                /*
+                        a TOP_PHI and a TOP_NPDF of the same slot become one
+                        TOP_PHI_NPDF at the earlier of the two, which only
+                        needs the argument to have been computed
+                 */
+                void FuseNormal(){
+                        auto& tape = expr_.tape_;
+                        std::unordered_map<std::uint32_t, size_t> phi;
+                        std::unordered_map<std::uint32_t, size_t> density;
+                        for(size_t idx=0;idx!=tape.size();++idx){
+                                if( tape[idx].Op == TOP_PHI )
+                                        phi.emplace(tape[idx].Left, idx);
+                                else if( tape[idx].Op == TOP_NPDF )
+                                        density.emplace(tape[idx].Left, idx);
+                        }
+                        std::vector<bool> fused(tape.size(), false);
+                        for(auto const& p : phi ){
+                                auto iter = density.find(p.first);
+                                if( iter == density.end() )
+                                        continue;
+                                auto first = std::min(p.second, iter->second);
+                                auto second = std::max(p.second, iter->second);
+                                tape[first] = TapeInstruction{TOP_PHI_NPDF, tape[p.second].Result, p.first, tape[iter->second].Result};
+                                fused[second] = true;
+                        }
+                        size_t out = 0;
+                        for(size_t idx=0;idx!=tape.size();++idx){
+                                if( ! fused[idx] )
+                                        tape[out++] = tape[idx];
+                        }
+                        tape.resize(out);
+                }
+
+                enum : std::uint32_t{
+                        SlotTagMask = 0xC0000000u,
+                        InputTag    = 0x00000000u,
+                        ConstantTag = 0x40000000u,
+                        TempTag     = 0x80000000u,
+                };
+
+                std::uint32_t ConstantSlot(double value){
+                        std::uint64_t bits;
+                        std::memcpy(&bits, &value, sizeof(bits));
+                        auto iter = constant_map_.find(bits);
+                        if( iter != constant_map_.end() )
+                                return iter->second;
+                        auto slot = ConstantTag | static_cast<std::uint32_t>(expr_.constants_.size());
+                        expr_.constants_.push_back(value);
+                        constant_map_[bits] = slot;
+                        return slot;
+                }
+                std::uint32_t Instr(TapeOpCode op, std::uint32_t left, std::uint32_t right = 0){
+                        auto slot = TempTag | static_cast<std::uint32_t>(expr_.tape_.size());
+                        expr_.tape_.push_back(TapeInstruction{op, slot, left, right});
+                        return slot;
+                }
+                friend struct PostOrderLowering<Compiler, std::uint32_t>;
+                std::uint32_t Emit(Operator const* op){
+                        switch(Classify(op)){
+                        case LK_CONSTANT: return ConstantSlot(static_cast<Constant const*>(op)->Value());
+                        case LK_EXO:      return InputSlot(static_cast<ExogenousSymbol const*>(op)->Id());
+                        case LK_ENDO:     return Arg(op, 0);
+                        case LK_USUB:     return Instr(TOP_USUB, Arg(op, 0));
+                        case LK_ADD:      return Instr(TOP_ADD, Arg(op, 0), Arg(op, 1));
+                        case LK_SUB:      return Instr(TOP_SUB, Arg(op, 0), Arg(op, 1));
+                        case LK_MUL:      return Instr(TOP_MUL, Arg(op, 0), Arg(op, 1));
+                        case LK_DIV:      return Instr(TOP_DIV, Arg(op, 0), Arg(op, 1));
+                        case LK_POW:      return Instr(TOP_POW, Arg(op, 0), Arg(op, 1));
+                        case LK_EXP:      return Instr(TOP_EXP, Arg(op, 0));
+                        case LK_LOG:      return Instr(TOP_LOG, Arg(op, 0));
+                        case LK_SIN:      return Instr(TOP_SIN, Arg(op, 0));
+                        case LK_COS:      return Instr(TOP_COS, Arg(op, 0));
+                        case LK_PHI:      return Instr(TOP_PHI, Arg(op, 0));
+                        case LK_SQRT:     return Instr(TOP_SQRT, Arg(op, 0));
+                        case LK_NPDF:     return Instr(TOP_NPDF, Arg(op, 0));
+                        case LK_UNKNOWN:  break;
+                        }
+                        std::stringstream ss;
+                        ss << "can't compile operator " << op->NameInvariantOfChildren();
+                        throw std::domain_error(ss.str());
+                }
+
+                CompiledExpression& expr_;
+                std::unordered_map<SymbolId, std::uint32_t> input_map_;
+                std::unordered_map<std::uint64_t, std::uint32_t> constant_map_;
+        };
+
+        std::vector<std::string> inputs_;
+        std::vector<SymbolId> input_ids_;
+        std::vector<double> constants_;
+        std::vector<TapeInstruction> tape_;
+        std::vector<std::uint32_t> outputs_;
+        size_t workspace_size_{0};
+        mutable std::vector<double> workspace_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_COMPILED_H
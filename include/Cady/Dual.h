@@ -0,0 +1,204 @@
+#ifndef INCLUDE_CADY_DUAL_H
+#define INCLUDE_CADY_DUAL_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "Normal.h"
+
+namespace Cady{
+namespace Forward{
+
+        enum : int{ Dynamic = -1 };
+
+        /*
+                Tangent storage for a Dual. With a fixed width it's an
+                inline array, so a Dual<N> never touches the heap and
+                the chain rule loops are fixed length. The dynamic width
+                treats missing trailing entries as zero, so constants
+                don't need to know how many directions are in flight.
+         */
+        template<int N>
+        struct DualTangent{
+                void Resize(size_t){}
+                size_t Size()const{ return N; }
+                double Get(size_t idx)const{ return data_[idx]; }
+                double& operator[](size_t idx){ return data_[idx]; }
+        private:
+                std::array<double, N> data_{};
+        };
+        template<>
+        struct DualTangent<Dynamic>{
+                void Resize(size_t n){ data_.resize(n); }
+                size_t Size()const{ return data_.size(); }
+                double Get(size_t idx)const{ return idx < data_.size() ? data_[idx] : 0.0; }
+                double& operator[](size_t idx){ return data_[idx]; }
+        private:
+                std::vector<double> data_;
+        };
+
+        /*
+                Forward mode dual number carrying a value and N partial
+                derivatives. Models written generically over their
+                number type, such as BlackScholesCallOption::Build<Double>,
+                evaluated with Dual<N> give the value and the derivative
+                with respect to each seeded input in a single pass,
+                without building an Operator graph.
+
+                        auto S = Dual<2>::Variable(50, 0);
+                        auto K = Dual<2>::Variable(60, 1);
+                        auto v = Log(S / K);
+                        v.D(0); // 1/S
+         */
+        template<int N>
+        struct Dual{
+                // non-explicit so constants mix with duals
+                Dual(double value = 0.0):value_{value}{}
+
+                /*
+                        the idx'th independent variable, a Dual<Dynamic>
+                        is made just wide enough to hold it
+                 */
+                static Dual Variable(double value, size_t idx){
+                        return Variable(value, idx, N == Dynamic ? idx + 1 : static_cast<size_t>(N));
+                }
+                // width is only used for Dual<Dynamic>, a Dual<N> is N wide
+                static Dual Variable(double value, size_t idx, size_t width){
+                        size_t bound = ( N == Dynamic ? width : static_cast<size_t>(N) );
+                        if( idx >= bound )
+                                throw std::domain_error("variable index out of range for the dual's width");
+                        Dual result(value);
+                        result.tangent_.Resize(bound);
+                        result.tangent_[idx] = 1.0;
+                        return result;
+                }
+
+                double Value()const{ return value_; }
+                double D(size_t idx)const{ return tangent_.Get(idx); }
+                size_t Width()const{ return tangent_.Size(); }
+
+                /*
+                        result has the given value, and tangent
+                                dl * l' + dr * r'
+                 */
+                static Dual Chain(double value, double dl, Dual const& l, double dr, Dual const& r){
+                        Dual result(value);
+                        size_t n = std::max(l.Width(), r.Width());
+                        result.tangent_.Resize(n);
+                        for(size_t idx=0;idx!=n;++idx){
+                                result.tangent_[idx] = dl * l.D(idx) + dr * r.D(idx);
+                        }
+                        return result;
+                }
+                static Dual Chain(double value, double dl, Dual const& l){
+                        Dual result(value);
+                        size_t n = l.Width();
+                        result.tangent_.Resize(n);
+                        for(size_t idx=0;idx!=n;++idx){
+                                result.tangent_[idx] = dl * l.D(idx);
+                        }
+                        return result;
+                }
+        private:
+                double value_;
+                DualTangent<N> tangent_;
+        };
+
+        template<int N>
+        inline Dual<N> operator+(Dual<N> const& l, Dual<N> const& r){
+                return Dual<N>::Chain(l.Value() + r.Value(), 1.0, l, 1.0, r);
+        }
+        template<int N>
+        inline Dual<N> operator-(Dual<N> const& l, Dual<N> const& r){
+                return Dual<N>::Chain(l.Value() - r.Value(), 1.0, l, -1.0, r);
+        }
+        template<int N>
+        inline Dual<N> operator*(Dual<N> const& l, Dual<N> const& r){
+                return Dual<N>::Chain(l.Value() * r.Value(), r.Value(), l, l.Value(), r);
+        }
+        template<int N>
+        inline Dual<N> operator/(Dual<N> const& l, Dual<N> const& r){
+                double inv = 1.0 / r.Value();
+                double value = l.Value() * inv;
+                return Dual<N>::Chain(value, inv, l, -value * inv, r);
+        }
+        template<int N>
+        inline Dual<N> operator-(Dual<N> const& arg){
+                return Dual<N>::Chain(-arg.Value(), -1.0, arg);
+        }
+
+        /*
+                mixed arithmetic with plain numbers, which only scale or
+                shift the tangent
+         */
+        template<int N>
+        inline Dual<N> operator+(Dual<N> const& l, double r){ return Dual<N>::Chain(l.Value() + r, 1.0, l); }
+        template<int N>
+        inline Dual<N> operator+(double l, Dual<N> const& r){ return Dual<N>::Chain(l + r.Value(), 1.0, r); }
+        template<int N>
+        inline Dual<N> operator-(Dual<N> const& l, double r){ return Dual<N>::Chain(l.Value() - r, 1.0, l); }
+        template<int N>
+        inline Dual<N> operator-(double l, Dual<N> const& r){ return Dual<N>::Chain(l - r.Value(), -1.0, r); }
+        template<int N>
+        inline Dual<N> operator*(Dual<N> const& l, double r){ return Dual<N>::Chain(l.Value() * r, r, l); }
+        template<int N>
+        inline Dual<N> operator*(double l, Dual<N> const& r){ return Dual<N>::Chain(l * r.Value(), l, r); }
+        template<int N>
+        inline Dual<N> operator/(Dual<N> const& l, double r){ return Dual<N>::Chain(l.Value() / r, 1.0 / r, l); }
+        template<int N>
+        inline Dual<N> operator/(double l, Dual<N> const& r){
+                double value = l / r.Value();
+                return Dual<N>::Chain(value, -value / r.Value(), r);
+        }
+
+        template<int N>
+        inline Dual<N> Exp(Dual<N> const& arg){
+                double value = std::exp(arg.Value());
+                return Dual<N>::Chain(value, value, arg);
+        }
+        template<int N>
+        inline Dual<N> Log(Dual<N> const& arg){
+                return Dual<N>::Chain(std::log(arg.Value()), 1.0 / arg.Value(), arg);
+        }
+        template<int N>
+        inline Dual<N> Sin(Dual<N> const& arg){
+                return Dual<N>::Chain(std::sin(arg.Value()), std::cos(arg.Value()), arg);
+        }
+        template<int N>
+        inline Dual<N> Cos(Dual<N> const& arg){
+                return Dual<N>::Chain(std::cos(arg.Value()), -std::sin(arg.Value()), arg);
+        }
+        template<int N>
+        inline Dual<N> Phi(Dual<N> const& arg){
+                double density;
+                double value = Normal::Cdf(arg.Value(), density);
+                return Dual<N>::Chain(value, density, arg);
+        }
+        template<int N>
+        inline Dual<N> Pow(Dual<N> const& l, double r){
+                return Dual<N>::Chain(std::pow(l.Value(), r), r * std::pow(l.Value(), r - 1), l);
+        }
+        template<int N>
+        inline Dual<N> Pow(double l, Dual<N> const& r){
+                double value = std::pow(l, r.Value());
+                return Dual<N>::Chain(value, value * std::log(l), r);
+        }
+        template<int N>
+        inline Dual<N> Pow(Dual<N> const& l, Dual<N> const& r){
+                double value = std::pow(l.Value(), r.Value());
+                // x^y is only differentiable in y for positive x
+                double dr = l.Value() > 0 ? value * std::log(l.Value()) : 0.0;
+                return Dual<N>::Chain(value, r.Value() * std::pow(l.Value(), r.Value() - 1), l, dr, r);
+        }
+
+} // end namespace Forward
+
+using Forward::Dual;
+using Forward::Dynamic;
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_DUAL_H
@@ -0,0 +1,849 @@
+#ifndef INCLUDE_CADY_EGRAPH_H
+#define INCLUDE_CADY_EGRAPH_H
+
+#include <array>
+#include <limits>
+
+#include "Cady.h"
+#include "CompactIR.h"
+#include "Transform.h"
+
+namespace Cady{
+
+/*
+        bounds on EGraph::Saturate(). The graph never has more than
+        MaxNodes nodes, the rule which would add the next one is where
+        saturation stops.
+
+        Rules are scheduled as by egg's BackoffScheduler. A rule which
+        matches more than MatchLimit << n times in one iteration, having
+        been banned n times before, has its matches dropped and sits out
+        the next BanLength << n iterations. That keeps commutativity and
+        associativity, which match everywhere and whose matches grow with
+        each application, from filling the graph before the other rules
+        have been tried.
+ */
+struct SaturationLimits{
+        size_t MaxIterations = 8;
+        size_t MaxNodes      = 20000;
+        size_t MatchLimit    = 1000;
+        size_t BanLength     = 5;
+};
+
+/*
+        An e-graph over the compact opcodes. Each class is a set of
+        equivalent nodes, and the operands of a node are classes rather
+        than nodes, so a single graph holds every form of an expression
+        found by the rewrites at once. Saturate() applies the rules
+        until nothing new is found or a limit is hit, and Extract()
+        then picks the cheapest form of each class under a CostTable.
+        Unlike the passes in Transform.h no rule commits to a form, so a
+        factorization that only pays off after several rewrites is
+        still found.
+
+        Statements are kept, each EndgenousSymbol is a node of its own
+        class, with its body as the operand, and nothing is rewritten
+        across it.
+
+        Merges are deferred as in egg, Merge() only joins the classes
+        and Rebuild() restores the invariant that equal nodes are in
+        the same class.
+ */
+struct EGraph{
+        using ClassId = std::uint32_t;
+        using ENode   = CompactNode;
+        enum : ClassId{ NoClass = CompactGraph::NoOperand };
+
+        // classes bound by a match, ie a, b and c in a*b + a*c
+        using Bindings = std::array<ClassId, 3>;
+        struct Rule{
+                std::string Name;
+                // appends a Bindings for each match of the rule at node
+                std::function<void(EGraph const&, ENode const&, std::vector<Bindings>&)> Search;
+                // the class equal to the matched one
+                std::function<ClassId(EGraph&, Bindings const&)> Apply;
+        };
+        inline static std::vector<Rule> DefaultRules();
+
+        using Limits = SaturationLimits;
+
+        static ENode Node(CompactOpCode op, ClassId left = NoClass, ClassId right = NoClass){
+                ENode node;
+                node.Op    = op;
+                node.Left  = left;
+                node.Right = right;
+                node.Value = 0.0;
+                return node;
+        }
+
+        /*
+                returns NoClass for a node over NoClass, so that a rule
+                building a term bottom up fails as a whole once the node
+                limit of Saturate() is reached
+         */
+        ClassId Add(ENode node){
+                auto operands = Operands(node.Op);
+                if( ( operands > 0 && node.Left == NoClass ) || ( operands > 1 && node.Right == NoClass ) )
+                        return NoClass;
+                node = Canonical(node);
+                auto iter = memo_.find(node);
+                if( iter != memo_.end() )
+                        return Find(iter->second);
+                if( Size() >= node_limit_ )
+                        return NoClass;
+                auto id = static_cast<ClassId>(classes_.size());
+                uf_.push_back(id);
+                classes_.emplace_back();
+                auto& cls = classes_.back();
+                cls.Nodes.push_back(node);
+                if( node.Op == COP_CONSTANT )
+                        cls.Value = node.Value;
+                if( node.Left != NoClass )
+                        classes_[node.Left].Parents.emplace_back(node, id);
+                if( node.Right != NoClass && node.Right != node.Left )
+                        classes_[node.Right].Parents.emplace_back(node, id);
+                memo_.emplace(node, id);
+                return id;
+        }
+        ClassId Add(CompactOpCode op, ClassId left, ClassId right = NoClass){
+                return Add(Node(op, left, right));
+        }
+        ClassId AddConstant(double value){
+                auto node = Node(COP_CONSTANT);
+                node.Value = value;
+                return Add(node);
+        }
+        // adds the graphs, returns the class of each root
+        inline std::vector<ClassId> Add(OperatorVector const& roots);
+
+        ClassId Find(ClassId id)const{
+                for(;uf_[id] != id;){
+                        id = uf_[id];
+                }
+                return id;
+        }
+        ClassId Merge(ClassId a, ClassId b){
+                a = Find(a);
+                b = Find(b);
+                if( a == b )
+                        return a;
+                if( classes_[a].Parents.size() < classes_[b].Parents.size() )
+                        std::swap(a, b);
+                uf_[b] = a;
+                ++merges_;
+                auto& into = classes_[a];
+                auto& from = classes_[b];
+                into.Nodes.insert(into.Nodes.end(), from.Nodes.begin(), from.Nodes.end());
+                into.Parents.insert(into.Parents.end(), from.Parents.begin(), from.Parents.end());
+                if( ! into.Value )
+                        into.Value = from.Value;
+                from = EClass{};
+                pending_.push_back(a);
+                return a;
+        }
+        inline void Rebuild();
+
+        // nodes of a canonical class, with canonical operands after Rebuild()
+        std::vector<ENode> const& Nodes(ClassId id)const{ return classes_[Find(id)].Nodes; }
+        boost::optional<double> ConstantOf(ClassId id)const{ return classes_[Find(id)].Value; }
+
+        // number of distinct nodes
+        size_t Size()const{ return memo_.size(); }
+        size_t Classes()const{
+                size_t n = 0;
+                for(size_t idx=0;idx!=uf_.size();++idx){
+                        if( uf_[idx] == idx )
+                                ++n;
+                }
+                return n;
+        }
+
+        // returns the number of iterations run
+        inline size_t Saturate(std::vector<Rule> const& rules = DefaultRules(), Limits const& limits = Limits{});
+
+        /*
+                cheapest form of the roots, where a subtree shared by
+                several parents is paid for once. The choice for each class
+                starts as the cheapest tree, then each class in the result
+                is switched to any of its other nodes which makes the whole
+                result cheaper, until none does
+         */
+        inline OperatorVector Extract(std::vector<ClassId> const& roots, Transform::CostTable const& costs = Transform::CostTable::Default());
+
+        static OperatorVector Optimize(OperatorVector const& roots,
+                                       Transform::CostTable const& costs = Transform::CostTable::Default(),
+                                       std::vector<Rule> const& rules = DefaultRules(),
+                                       Limits const& limits = Limits{})
+        {
+                EGraph graph;
+                auto ids = graph.Add(roots);
+                graph.Saturate(rules, limits);
+                return graph.Extract(ids, costs);
+        }
+        static std::shared_ptr<Operator> Optimize(std::shared_ptr<Operator> const& root,
+                                                  Transform::CostTable const& costs = Transform::CostTable::Default())
+        {
+                return Optimize(OperatorVector{root}, costs).front();
+        }
+
+private:
+        static size_t Operands(CompactOpCode op){
+                switch(op){
+                case COP_CONSTANT:
+                case COP_EXO:
+                        return 0;
+                case COP_ADD:
+                case COP_SUB:
+                case COP_MUL:
+                case COP_DIV:
+                case COP_POW:
+                        return 2;
+                }
+                return 1;
+        }
+
+        struct NodeHash{
+                size_t operator()(ENode const& node)const{
+                        Fnv1a h;
+                        h.Word(node.Op);
+                        h.Word(node.Left);
+                        h.Word(node.Right);
+                        h.Word(Payload(node));
+                        return static_cast<size_t>(h.Value());
+                }
+        };
+        struct NodeEqual{
+                bool operator()(ENode const& l, ENode const& r)const{
+                        return l.Op == r.Op &&
+                               l.Left == r.Left &&
+                               l.Right == r.Right &&
+                               Payload(l) == Payload(r);
+                }
+        };
+        static std::uint64_t Payload(ENode const& node){
+                switch(node.Op){
+                case COP_CONSTANT:
+                {
+                        std::uint64_t bits;
+                        std::memcpy(&bits, &node.Value, sizeof(bits));
+                        return bits;
+                }
+                case COP_EXO:
+                case COP_ENDO:
+                        return node.Symbol;
+                }
+                return 0;
+        }
+
+        struct EClass{
+                std::vector<ENode> Nodes;
+                // nodes using this class, and the class of each
+                std::vector<std::pair<ENode, ClassId> > Parents;
+                boost::optional<double> Value;
+        };
+
+        ENode Canonical(ENode node)const{
+                if( node.Left != NoClass )
+                        node.Left = Find(node.Left);
+                if( node.Right != NoClass )
+                        node.Right = Find(node.Right);
+                return node;
+        }
+        inline void Repair(ClassId id);
+
+        std::vector<ClassId> uf_;
+        std::vector<EClass> classes_;
+        std::unordered_map<ENode, ClassId, NodeHash, NodeEqual> memo_;
+        std::vector<ClassId> pending_;
+        size_t merges_{0};
+        size_t node_limit_{std::numeric_limits<size_t>::max()};
+};
+
+inline std::vector<EGraph::ClassId> EGraph::Add(OperatorVector const& roots){
+        auto compact = CompactGraph::FromOperators(roots);
+        std::vector<ClassId> ids(compact.Size());
+        for(size_t idx=0;idx!=compact.Size();++idx){
+                auto node = compact.Nodes()[idx];
+                if( node.Left != NoClass )
+                        node.Left = ids[node.Left];
+                if( node.Right != NoClass )
+                        node.Right = ids[node.Right];
+                ids[idx] = Add(node);
+        }
+        std::vector<ClassId> result;
+        for(auto root : compact.Roots()){
+                result.push_back(Find(ids[root]));
+        }
+        return result;
+}
+
+inline void EGraph::Repair(ClassId id){
+        auto parents = std::move(classes_[id].Parents);
+        classes_[id].Parents.clear();
+        for(auto const& p : parents){
+                memo_.erase(p.first);
+        }
+        std::unordered_map<ENode, ClassId, NodeHash, NodeEqual> unique;
+        for(auto const& p : parents){
+                auto node = Canonical(p.first);
+                auto iter = unique.find(node);
+                if( iter != unique.end() ){
+                        // two parents are now the same node
+                        Merge(iter->second, p.second);
+                }
+                unique[node] = Find(p.second);
+                memo_[node] = Find(p.second);
+        }
+        auto& cls = classes_[Find(id)];
+        for(auto const& p : unique){
+                cls.Parents.emplace_back(p.first, p.second);
+        }
+}
+
+inline void EGraph::Rebuild(){
+        for(;pending_.size();){
+                std::vector<ClassId> todo;
+                todo.swap(pending_);
+                std::unordered_set<ClassId> seen;
+                for(auto id : todo){
+                        id = Find(id);
+                        if( seen.insert(id).second )
+                                Repair(id);
+                }
+        }
+        for(size_t idx=0;idx!=classes_.size();++idx){
+                if( uf_[idx] != idx )
+                        continue;
+                auto& nodes = classes_[idx].Nodes;
+                std::unordered_set<ENode, NodeHash, NodeEqual> unique;
+                std::vector<ENode> result;
+                for(auto const& node : nodes){
+                        auto canonical = Canonical(node);
+                        if( unique.insert(canonical).second )
+                                result.push_back(canonical);
+                }
+                nodes.swap(result);
+        }
+}
+
+inline size_t EGraph::Saturate(std::vector<Rule> const& rules, Limits const& limits){
+        Rebuild();
+        struct Schedule{
+                size_t TimesBanned = 0;
+                size_t BannedUntil = 0;
+        };
+        std::vector<Schedule> schedule(rules.size());
+        node_limit_ = limits.MaxNodes;
+        size_t iter = 0;
+        for(;iter!=limits.MaxIterations;++iter){
+                if( Size() >= limits.MaxNodes )
+                        break;
+                // match everything before changing anything
+                std::vector<std::pair<size_t, Bindings> > matches;
+                std::vector<ClassId> matched;
+                std::vector<Bindings> found;
+                bool banned = false;
+                for(size_t r=0;r!=rules.size();++r){
+                        if( schedule[r].BannedUntil > iter ){
+                                banned = true;
+                                continue;
+                        }
+                        auto first = matches.size();
+                        for(size_t idx=0;idx!=classes_.size();++idx){
+                                if( uf_[idx] != idx )
+                                        continue;
+                                for(auto const& node : classes_[idx].Nodes){
+                                        found.clear();
+                                        rules[r].Search(*this, node, found);
+                                        for(auto const& b : found){
+                                                matches.emplace_back(r, b);
+                                                matched.push_back(static_cast<ClassId>(idx));
+                                        }
+                                }
+                        }
+                        auto& s = schedule[r];
+                        if( matches.size() - first > ( limits.MatchLimit << s.TimesBanned ) ){
+                                matches.resize(first);
+                                matched.resize(first);
+                                s.BannedUntil = iter + 1 + ( limits.BanLength << s.TimesBanned );
+                                ++s.TimesBanned;
+                                banned = true;
+                        }
+                }
+                auto size = Size();
+                auto merges = merges_;
+                for(size_t idx=0;idx!=matches.size();++idx){
+                        auto id = rules[matches[idx].first].Apply(*this, matches[idx].second);
+                        if( id != NoClass )
+                                Merge(matched[idx], id);
+                        if( Size() >= limits.MaxNodes )
+                                break;
+                }
+                Rebuild();
+                if( Size() == size && merges_ == merges ){
+                        if( ! banned ){
+                                ++iter;
+                                break;
+                        }
+                        // saturated under the rules left, so let the
+                        // banned ones back in rather than stopping
+                        for(auto& s : schedule){
+                                s.BannedUntil = 0;
+                        }
+                }
+        }
+        node_limit_ = std::numeric_limits<size_t>::max();
+        return iter;
+}
+
+inline OperatorVector EGraph::Extract(std::vector<ClassId> const& roots, Transform::CostTable const& costs){
+        auto op_cost = [&](ENode const& node){
+                switch(node.Op){
+                case COP_CONSTANT:
+                case COP_EXO:
+                case COP_ENDO: return 0.0;
+                case COP_ADD:  return costs.Cost("ADD");
+                case COP_SUB:  return costs.Cost("SUB");
+                case COP_MUL:  return costs.Cost("MUL");
+                case COP_DIV:  return costs.Cost("DIV");
+                case COP_POW:  return costs.Cost("POW");
+                case COP_USUB: return costs.Cost("USUB");
+                case COP_EXP:  return costs.Cost("Exp");
+                case COP_LOG:  return costs.Cost("Log");
+                case COP_SIN:  return costs.Cost("Sin");
+                case COP_COS:  return costs.Cost("Cos");
+                case COP_PHI:  return costs.Cost("Phi");
+                case COP_SQRT: return costs.Cost("Sqrt");
+                case COP_NPDF: return costs.Cost("NormalDensity");
+                }
+                return 0.0;
+        };
+
+        // cheapest tree for each class, iterated to a fixed point as a
+        // class can refer to itself
+        auto const inf = std::numeric_limits<double>::infinity();
+        std::vector<double> best(classes_.size(), inf);
+        std::vector<ENode> choice(classes_.size());
+        for(bool changed=true;changed;){
+                changed = false;
+                for(size_t idx=0;idx!=classes_.size();++idx){
+                        if( uf_[idx] != idx )
+                                continue;
+                        for(auto const& node : classes_[idx].Nodes){
+                                double cost = op_cost(node);
+                                if( node.Left != NoClass )
+                                        cost += best[Find(node.Left)];
+                                if( node.Right != NoClass )
+                                        cost += best[Find(node.Right)];
+                                if( cost < best[idx] ){
+                                        best[idx] = cost;
+                                        choice[idx] = node;
+                                        changed = true;
+                                }
+                        }
+                }
+        }
+
+        // cost of the DAG the choices give, each class reached counted
+        // once, and the classes reached in post order. A cycle costs inf
+        std::vector<ClassId> reached;
+        auto dag_cost = [&](){
+                enum{ Color_White, Color_Grey, Color_Black };
+                std::vector<char> color(classes_.size(), Color_White);
+                reached.clear();
+                double cost = 0.0;
+                std::vector<std::pair<ClassId, int> > stack;
+                for(auto root : roots){
+                        stack.emplace_back(Find(root), 0);
+                        for(;stack.size();){
+                                auto id = stack.back().first;
+                                auto& next = stack.back().second;
+                                if( next == 0 ){
+                                        if( color[id] == Color_Black ){
+                                                stack.pop_back();
+                                                continue;
+                                        }
+                                        if( color[id] == Color_Grey )
+                                                return inf;
+                                        color[id] = Color_Grey;
+                                }
+                                auto const& node = choice[id];
+                                auto operand = ( next == 0 ? node.Left : next == 1 ? node.Right : NoClass );
+                                if( next < 2 ){
+                                        ++next;
+                                        if( operand != NoClass )
+                                                stack.emplace_back(Find(operand), 0);
+                                        continue;
+                                }
+                                color[id] = Color_Black;
+                                cost += op_cost(node);
+                                reached.push_back(id);
+                                stack.pop_back();
+                        }
+                }
+                return cost;
+        };
+
+        double total = dag_cost();
+        for(bool changed=true;changed;){
+                changed = false;
+                auto candidates = reached;
+                for(auto id : candidates){
+                        auto current = choice[id];
+                        for(auto const& node : classes_[id].Nodes){
+                                if( NodeEqual{}(node, current) )
+                                        continue;
+                                if( ( node.Left  != NoClass && best[Find(node.Left)]  == inf ) ||
+                                    ( node.Right != NoClass && best[Find(node.Right)] == inf ) )
+                                        continue;
+                                choice[id] = node;
+                                double cost = dag_cost();
+                                if( cost < total ){
+                                        total = cost;
+                                        current = node;
+                                        changed = true;
+                                } else {
+                                        choice[id] = current;
+                                }
+                        }
+                }
+                dag_cost();
+        }
+
+        // reached is current for the final choices, and in post order,
+        // so the operands of each class are built before it
+        if( total == inf )
+                throw std::domain_error("no acyclic extraction");
+        std::vector<std::shared_ptr<Operator> > built(classes_.size());
+        for(auto id : reached){
+                auto const& node = choice[id];
+                auto left  = ( node.Left  != NoClass ? built[Find(node.Left)]  : nullptr );
+                auto right = ( node.Right != NoClass ? built[Find(node.Right)] : nullptr );
+                built[id] = CompactGraph::MakeOperator(node, left, right);
+        }
+        OperatorVector result;
+        for(auto root : roots){
+                result.push_back(built[Find(root)]);
+        }
+        return result;
+}
+
+/*
+        distributivity and factoring, the identities of exp, log and
+        pow, pushing negation through + - * /, and constant folding.
+        a/a is taken to be one and exp(log(a)) to be a, which only
+        assumes the source was defined.
+ */
+inline std::vector<EGraph::Rule> EGraph::DefaultRules(){
+        std::vector<Rule> rules;
+        auto is_constant = [](EGraph const& g, ClassId id, double value){
+                auto c = g.ConstantOf(id);
+                return c && *c == value;
+        };
+
+        for(auto op : {COP_ADD, COP_MUL}){
+                rules.push_back(Rule{
+                        "commute",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op == op )
+                                        out.push_back(Bindings{n.Left, n.Right, NoClass});
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(op, b[1], b[0]);
+                        }});
+                rules.push_back(Rule{
+                        "associate",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != op )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op == op )
+                                                out.push_back(Bindings{x.Left, x.Right, n.Right});
+                                }
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(op, b[0], g.Add(op, b[1], b[2]));
+                        }});
+        }
+
+        for(auto op : {COP_ADD, COP_SUB}){
+                // a*(b+c) => a*b + a*c
+                rules.push_back(Rule{
+                        "distribute",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != COP_MUL )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Right)){
+                                        if( x.Op == op )
+                                                out.push_back(Bindings{n.Left, x.Left, x.Right});
+                                }
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(op, g.Add(COP_MUL, b[0], b[1]), g.Add(COP_MUL, b[0], b[2]));
+                        }});
+                // a*b + a*c => a*(b+c)
+                rules.push_back(Rule{
+                        "factor",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != op )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op != COP_MUL )
+                                                continue;
+                                        for(auto const& y : g.Nodes(n.Right)){
+                                                if( y.Op == COP_MUL && x.Left == y.Left )
+                                                        out.push_back(Bindings{x.Left, x.Right, y.Right});
+                                        }
+                                }
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(COP_MUL, b[0], g.Add(op, b[1], b[2]));
+                        }});
+                // a/c + b/c => (a+b)/c
+                rules.push_back(Rule{
+                        "factor-div",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != op )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op != COP_DIV )
+                                                continue;
+                                        for(auto const& y : g.Nodes(n.Right)){
+                                                if( y.Op == COP_DIV && x.Right == y.Right )
+                                                        out.push_back(Bindings{x.Left, y.Left, x.Right});
+                                        }
+                                }
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(COP_DIV, g.Add(op, b[0], b[1]), b[2]);
+                        }});
+        }
+
+        // exp(a)*exp(b) => exp(a+b), exp(a)/exp(b) => exp(a-b), and
+        // log(a)+log(b) => log(a*b), log(a)-log(b) => log(a/b)
+        std::array<std::array<CompactOpCode, 3>, 4> homomorphisms{{
+                {{COP_EXP, COP_MUL, COP_ADD}},
+                {{COP_EXP, COP_DIV, COP_SUB}},
+                {{COP_LOG, COP_ADD, COP_MUL}},
+                {{COP_LOG, COP_SUB, COP_DIV}},
+        }};
+        for(auto const& h : homomorphisms){
+                rules.push_back(Rule{
+                        "combine",
+                        [h](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != h[1] )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op != h[0] )
+                                                continue;
+                                        for(auto const& y : g.Nodes(n.Right)){
+                                                if( y.Op == h[0] )
+                                                        out.push_back(Bindings{x.Left, y.Left, NoClass});
+                                        }
+                                }
+                        },
+                        [h](EGraph& g, Bindings const& b){
+                                return g.Add(h[0], g.Add(h[2], b[0], b[1]));
+                        }});
+        }
+
+        // exp(log(a)) => a, log(exp(a)) => a, -(-a) => a
+        std::array<std::array<CompactOpCode, 2>, 3> inverses{{
+                {{COP_EXP, COP_LOG}},
+                {{COP_LOG, COP_EXP}},
+                {{COP_USUB, COP_USUB}},
+        }};
+        for(auto const& inv : inverses){
+                rules.push_back(Rule{
+                        "inverse",
+                        [inv](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != inv[0] )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op == inv[1] )
+                                                out.push_back(Bindings{x.Left, NoClass, NoClass});
+                                }
+                        },
+                        [](EGraph& g, Bindings const& b){
+                                return b[0];
+                        }});
+        }
+
+        // pow(exp(a), b) => exp(a*b)
+        rules.push_back(Rule{
+                "pow-exp",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op != COP_POW )
+                                return;
+                        for(auto const& x : g.Nodes(n.Left)){
+                                if( x.Op == COP_EXP )
+                                        out.push_back(Bindings{x.Left, n.Right, NoClass});
+                        }
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.Add(COP_EXP, g.Add(COP_MUL, b[0], b[1]));
+                }});
+        // pow(a, n) for n of -1, 0, 0.5, 1 and 2
+        rules.push_back(Rule{
+                "pow-constant",
+                [is_constant](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op != COP_POW )
+                                return;
+                        for(double e : {-1.0, 0.0, 0.5, 1.0, 2.0}){
+                                if( is_constant(g, n.Right, e) )
+                                        out.push_back(Bindings{n.Left, n.Right, NoClass});
+                        }
+                },
+                [](EGraph& g, Bindings const& b){
+                        double e = *g.ConstantOf(b[1]);
+                        if( e == -1.0 )
+                                return g.Add(COP_DIV, g.AddConstant(1.0), b[0]);
+                        if( e == 0.0 )
+                                return g.AddConstant(1.0);
+                        if( e == 0.5 )
+                                return g.Add(COP_SQRT, b[0]);
+                        if( e == 1.0 )
+                                return b[0];
+                        return g.Add(COP_MUL, b[0], b[0]);
+                }});
+
+        // a-b => a+(-b), so that subtraction takes part in the + rules
+        rules.push_back(Rule{
+                "sub-neg",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op == COP_SUB )
+                                out.push_back(Bindings{n.Left, n.Right, NoClass});
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.Add(COP_ADD, b[0], g.Add(COP_USUB, b[1]));
+                }});
+        // a+(-b) => a-b
+        rules.push_back(Rule{
+                "add-neg",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op != COP_ADD )
+                                return;
+                        for(auto const& x : g.Nodes(n.Right)){
+                                if( x.Op == COP_USUB )
+                                        out.push_back(Bindings{n.Left, x.Left, NoClass});
+                        }
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.Add(COP_SUB, b[0], b[1]);
+                }});
+        // (-a)*b => -(a*b), (-a)/b => -(a/b)
+        for(auto op : {COP_MUL, COP_DIV}){
+                rules.push_back(Rule{
+                        "neg-out",
+                        [op](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                                if( n.Op != op )
+                                        return;
+                                for(auto const& x : g.Nodes(n.Left)){
+                                        if( x.Op == COP_USUB )
+                                                out.push_back(Bindings{x.Left, n.Right, NoClass});
+                                }
+                        },
+                        [op](EGraph& g, Bindings const& b){
+                                return g.Add(COP_USUB, g.Add(op, b[0], b[1]));
+                        }});
+        }
+        // -(a-b) => b-a
+        rules.push_back(Rule{
+                "neg-sub",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op != COP_USUB )
+                                return;
+                        for(auto const& x : g.Nodes(n.Left)){
+                                if( x.Op == COP_SUB )
+                                        out.push_back(Bindings{x.Left, x.Right, NoClass});
+                        }
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.Add(COP_SUB, b[1], b[0]);
+                }});
+
+        // a+0, a-0, a*1, a/1 => a and a*0 => 0
+        rules.push_back(Rule{
+                "identity",
+                [is_constant](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        switch(n.Op){
+                        case COP_ADD:
+                        case COP_SUB:
+                                if( is_constant(g, n.Right, 0.0) )
+                                        out.push_back(Bindings{n.Left, NoClass, NoClass});
+                                break;
+                        case COP_MUL:
+                        case COP_DIV:
+                                if( is_constant(g, n.Right, 1.0) )
+                                        out.push_back(Bindings{n.Left, NoClass, NoClass});
+                                if( n.Op == COP_MUL && is_constant(g, n.Right, 0.0) )
+                                        out.push_back(Bindings{n.Right, NoClass, NoClass});
+                                break;
+                        }
+                },
+                [](EGraph& g, Bindings const& b){
+                        return b[0];
+                }});
+        // a-a => 0, a/a => 1
+        rules.push_back(Rule{
+                "self-sub",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op == COP_SUB && n.Left == n.Right )
+                                out.push_back(Bindings{NoClass, NoClass, NoClass});
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.AddConstant(0.0);
+                }});
+        rules.push_back(Rule{
+                "self-div",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op == COP_DIV && n.Left == n.Right )
+                                out.push_back(Bindings{NoClass, NoClass, NoClass});
+                },
+                [](EGraph& g, Bindings const& b){
+                        return g.AddConstant(1.0);
+                }});
+
+        rules.push_back(Rule{
+                "fold",
+                [](EGraph const& g, ENode const& n, std::vector<Bindings>& out){
+                        if( n.Op == COP_CONSTANT || n.Op == COP_EXO || n.Op == COP_ENDO )
+                                return;
+                        if( n.Left != NoClass && ! g.ConstantOf(n.Left) )
+                                return;
+                        if( n.Right != NoClass && ! g.ConstantOf(n.Right) )
+                                return;
+                        // the opcode rides in the last binding
+                        out.push_back(Bindings{n.Left, n.Right, static_cast<ClassId>(n.Op)});
+                },
+                [](EGraph& g, Bindings const& b)->ClassId{
+                        auto op = static_cast<CompactOpCode>(b[2]);
+                        double l = *g.ConstantOf(b[0]);
+                        double r = ( b[1] != NoClass ? *g.ConstantOf(b[1]) : 0.0 );
+                        double value = 0.0;
+                        switch(op){
+                        case COP_ADD:  value = l + r; break;
+                        case COP_SUB:  value = l - r; break;
+                        case COP_MUL:  value = l * r; break;
+                        case COP_DIV:  value = l / r; break;
+                        case COP_POW:  value = std::pow(l, r); break;
+                        case COP_USUB: value = -l; break;
+                        case COP_EXP:  value = std::exp(l); break;
+                        case COP_LOG:  value = std::log(l); break;
+                        case COP_SIN:  value = std::sin(l); break;
+                        case COP_COS:  value = std::cos(l); break;
+                        case COP_PHI:  value = Normal::Cdf(l); break;
+                        case COP_SQRT: value = std::sqrt(l); break;
+                        case COP_NPDF: value = Normal::Density(l); break;
+                        }
+                        if( ! std::isfinite(value) )
+                                return NoClass;
+                        return g.AddConstant(value);
+                }});
+
+        return rules;
+}
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_EGRAPH_H
@@ -84,7 +84,9 @@ namespace Frontend{
         }  // end namespace Detail
         
         template<class T>
-        std::shared_ptr<Operator> AsOperator(T&& t){
+        auto AsOperator(T&& t)
+                -> decltype(Detail::AsOperatorImpl(std::forward<T>(t), Detail::PrecedenceDevice<100>{}))
+        {
                 return Detail::AsOperatorImpl(
                         std::forward<T>(t),
                         Detail::PrecedenceDevice<100>{}
@@ -135,29 +137,61 @@ namespace Frontend{
         inline auto Break(std::string const& name, Expr&& expr){
                 return WithOperators{EndgenousSymbol::Make(name, AsOperator(expr))};
         }
-        template<class T>
+        template<
+                class T,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<T>()) )
+                >
+        >
         inline auto Log(T&& arg){
                 return WithOperators{ Log::Make( AsOperator(arg) ) };
         }
-        template<class T>
+        template<
+                class T,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<T>()) )
+                >
+        >
         inline auto Sin(T&& arg){
                 return WithOperators{ Sin::Make( AsOperator(arg) ) };
         }
-        template<class T>
+        template<
+                class T,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<T>()) )
+                >
+        >
         inline auto Cos(T&& arg){
                 return WithOperators{ Cos::Make( AsOperator(arg) ) };
         }
-        template<class T>
+        template<
+                class T,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<T>()) )
+                >
+        >
         inline auto Exp(T&& arg){
                 return WithOperators{ Exp::Make( AsOperator(arg) ) };
         }
-        template<class T>
+        template<
+                class T,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<T>()) )
+                >
+        >
         inline auto Phi(T&& arg){
                 return WithOperators{ Phi::Make( AsOperator(arg) ) };
         }
 
 
-        template<class L, class R>
+        template<
+                class L,
+                class R,
+                class = std::__void_t<
+                        decltype( AsOperator(std::declval<L>()) ),
+                        decltype( AsOperator(std::declval<R>()) )
+                >
+        >
         inline auto Pow(L&& l, R&& r){
                 return WithOperators{ 
                         BinaryOperator::Pow( AsOperator(l), AsOperator(r) )
@@ -166,7 +200,7 @@ namespace Frontend{
 
         template<class Arg>
         inline auto Stmt(std::string const& name, Arg&& arg){
-                auto ptr = std::make_shared<EndgenousSymbol>(name, AsOperator(arg));
+                auto ptr = MakeNode<EndgenousSymbol>(name, AsOperator(arg));
                 return ptr;
         }
 
@@ -237,7 +271,7 @@ struct DoubleKernel : Frontend::ImbueWith{
                 : impl_{std::make_shared<DoubleKernelOperator>(op)}
         {}
         static DoubleKernel BuildFromExo(std::string const& name){
-                return DoubleKernel(Dispatch_Exo{}, std::make_shared<ExogenousSymbol>(name)); 
+                return DoubleKernel(Dispatch_Exo{}, ExogenousSymbol::Make(name));
         }
         std::shared_ptr<Operator> as_operator_()const{
                 return impl_->as_operator_();
@@ -248,7 +282,7 @@ private:
 namespace MathFunctions{
 
         inline double Phi(double x){
-                return std::erfc(-x/std::sqrt(2))/2;
+                return Normal::Cdf(x);
         }
         inline double Exp(double x){
                 return std::exp(x);
@@ -259,11 +293,19 @@ namespace MathFunctions{
         inline double Log(double x){
                 return std::log(x);
         }
+        inline double Sin(double x){
+                return std::sin(x);
+        }
+        inline double Cos(double x){
+                return std::cos(x);
+        }
 
         using Frontend::Phi;
         using Frontend::Exp;
         using Frontend::Pow;
         using Frontend::Log;
+        using Frontend::Sin;
+        using Frontend::Cos;
 
 } // end namespace MathFunctions
 } // end namespace Cady
@@ -0,0 +1,261 @@
+#ifndef INCLUDE_CADY_JIT_H
+#define INCLUDE_CADY_JIT_H
+
+#include "Cady.h"
+#include "CodeGen.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace Cady{
+
+/*
+        The compiler is run directly, never through a shell, so paths are
+        taken literally whatever they contain. Compiler is the program to
+        run, and Flags are split on whitespace into separate arguments.
+ */
+struct JitOptions{
+        JitOptions(){
+                if( auto cxx = std::getenv("CXX") )
+                        Compiler = cxx;
+        }
+        std::string Compiler{"c++"};
+        std::string Flags{"-std=c++14 -O2 -shared -fPIC"};
+        std::string TempDirectory{"/tmp"};
+        // leave the generated source and shared object on disk
+        bool KeepFiles{false};
+};
+
+/*
+        Compiles a Function to native code at runtime. The function is
+        emitted with StringCodeGenerator together with an extern "C"
+        entry point taking arrays,
+
+                double <name>_entry(double const* args, double* d_args)
+
+        which is then built into a shared object by the system compiler
+        and loaded with dlopen. d_args receives the derivative with
+        respect to each argument, and may be null.
+ */
+struct JitKernel{
+        using EntryPoint = double(*)(double const*, double*);
+
+        static std::shared_ptr<JitKernel> Compile(Function const& f, JitOptions const& opts = JitOptions{}){
+                char dir_template[4096];
+                std::snprintf(dir_template, sizeof(dir_template), "%s/cady_jit_XXXXXX", opts.TempDirectory.c_str());
+                if( ! ::mkdtemp(dir_template) )
+                        throw std::domain_error("unable to create jit directory");
+                std::string dir = dir_template;
+                std::string object_path = dir + "/" + f.Name() + ".so";
+
+                auto cleanup = [&](){
+                        if( opts.KeepFiles )
+                                return;
+                        ::unlink(object_path.c_str());
+                        ::rmdir(dir.c_str());
+                };
+
+                std::shared_ptr<JitKernel> result;
+                try{
+                        BuildSharedObject(f, object_path, opts);
+                        result = Load(object_path, f.Name(), f.Arguments());
+                } catch(...){
+                        cleanup();
+                        throw;
+                }
+                // the mapping stays valid once the file is unlinked
+                cleanup();
+                return result;
+        }
+
+        /*
+                writes the translation unit next to object_path and runs
+                the compiler on it, throwing with the compiler output on
+                failure
+         */
+        static void BuildSharedObject(Function const& f, std::string const& object_path, JitOptions const& opts = JitOptions{}){
+                std::string source_path = object_path + ".cxx";
+                std::string log_path    = object_path + ".log";
+
+                auto cleanup = [&](){
+                        if( opts.KeepFiles )
+                                return;
+                        ::unlink(source_path.c_str());
+                        ::unlink(log_path.c_str());
+                };
+
+                {
+                        std::ofstream out(source_path);
+                        EmitTranslationUnit(out, f);
+                        if( ! out )
+                                throw std::domain_error("unable to write " + source_path);
+                }
+
+                auto args = CompileCommand(source_path, object_path, opts);
+                if( Run(args, log_path) != 0 ){
+                        std::ifstream log(log_path);
+                        std::stringstream ss;
+                        ss << "jit compilation failed :";
+                        for(auto const& arg : args ){
+                                ss << " '" << arg << "'";
+                        }
+                        ss << "\n" << log.rdbuf();
+                        cleanup();
+                        throw std::domain_error(ss.str());
+                }
+                cleanup();
+        }
+
+        static std::vector<std::string> CompileCommand(std::string const& source_path,
+                                                       std::string const& object_path,
+                                                       JitOptions const& opts = JitOptions{})
+        {
+                std::vector<std::string> args{opts.Compiler};
+                std::istringstream flags(opts.Flags);
+                for(std::string flag;flags >> flag;){
+                        args.push_back(flag);
+                }
+                args.push_back("-o");
+                args.push_back(object_path);
+                args.push_back(source_path);
+                return args;
+        }
+
+        /*
+                runs args[0] with stdout and stderr going to log_path,
+                returning its exit status, or -1 if it didn't exit
+         */
+        static int Run(std::vector<std::string> const& args, std::string const& log_path){
+                // everything the child needs is made before the fork
+                std::vector<char*> argv;
+                for(auto const& arg : args ){
+                        argv.push_back(const_cast<char*>(arg.c_str()));
+                }
+                argv.push_back(nullptr);
+                static char const exec_failed[] = "unable to run the compiler\n";
+
+                int log = ::open(log_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+                if( log < 0 )
+                        throw std::domain_error("unable to write " + log_path);
+                pid_t pid = ::fork();
+                if( pid < 0 ){
+                        ::close(log);
+                        throw std::domain_error("unable to start the compiler");
+                }
+                if( pid == 0 ){
+                        ::dup2(log, STDOUT_FILENO);
+                        ::dup2(log, STDERR_FILENO);
+                        ::execvp(argv[0], argv.data());
+                        ssize_t ignored = ::write(STDERR_FILENO, exec_failed, sizeof(exec_failed) - 1);
+                        (void)ignored;
+                        ::_exit(127);
+                }
+                ::close(log);
+                int status = 0;
+                while( ::waitpid(pid, &status, 0) < 0 ){
+                        if( errno != EINTR )
+                                return -1;
+                }
+                return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+
+        /*
+                builds a function from every statement the root depends
+                on, in dependency order
+         */
+        static std::shared_ptr<JitKernel> Compile(std::string const& name,
+                                                  std::shared_ptr<Operator> const& root,
+                                                  std::vector<std::string> const& args,
+                                                  JitOptions const& opts = JitOptions{})
+        {
+                return Compile(MakeFunction(name, root, args), opts);
+        }
+
+        static Function MakeFunction(std::string const& name,
+                                     std::shared_ptr<Operator> const& root,
+                                     std::vector<std::string> const& args)
+        {
+                Function f(name);
+                for(auto const& arg : args ){
+                        f.AddArgument(arg);
+                }
+                auto result = root;
+                if( result->Kind() != OPKind_EndgenousSymbol )
+                        result = EndgenousSymbol::Make(name + "_result", root);
+                auto deps = result->DepthFirstAnySymbolicDependencyAndThis();
+                for(auto const& ptr : deps.DepthFirst ){
+                        if( ptr->IsEndo() )
+                                f.AddStatement(std::reinterpret_pointer_cast<EndgenousSymbol>(ptr));
+                }
+                return f;
+        }
+
+        static std::shared_ptr<JitKernel> Load(std::string const& object_path,
+                                               std::string const& name,
+                                               std::vector<std::string> const& args)
+        {
+                auto handle = ::dlopen(object_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+                if( ! handle ){
+                        std::stringstream ss;
+                        ss << "unable to load " << object_path << " : " << ::dlerror();
+                        throw std::domain_error(ss.str());
+                }
+                std::shared_ptr<void> owner(handle, [](void* ptr){ ::dlclose(ptr); });
+                auto symbol = ::dlsym(handle, EntryPointName(name).c_str());
+                if( ! symbol ){
+                        std::stringstream ss;
+                        ss << "unable to find " << EntryPointName(name) << " in " << object_path;
+                        throw std::domain_error(ss.str());
+                }
+                auto result = std::make_shared<JitKernel>();
+                result->handle_ = owner;
+                result->entry_  = reinterpret_cast<EntryPoint>(symbol);
+                result->args_   = args;
+                return result;
+        }
+
+        static std::string EntryPointName(std::string const& name){
+                return name + "_entry";
+        }
+
+        static void EmitTranslationUnit(std::ostream& ss, Function const& f){
+                ss << "#include <cmath>\n";
+                ss << "\n";
+                CodeGen::StringCodeGenerator cg;
+                cg.Emit(ss, f);
+                ss << "\n";
+                ss << "extern \"C\" double " << EntryPointName(f.Name()) << "(double const* args, double* d_args){\n";
+                ss << "    double scratch[" << std::max<size_t>(f.Arguments().size(), 1) << "];\n";
+                ss << "    if( ! d_args )\n";
+                ss << "        d_args = scratch;\n";
+                ss << "    return " << f.Name() << "(";
+                for(size_t idx=0;idx!=f.Arguments().size();++idx){
+                        if( idx != 0 )
+                                ss << ", ";
+                        ss << "args[" << idx << "], d_args + " << idx;
+                }
+                ss << ");\n";
+                ss << "}\n";
+        }
+
+        EntryPoint Get()const{ return entry_; }
+        std::vector<std::string> const& Arguments()const{ return args_; }
+
+        double operator()(double const* args, double* d_args = nullptr)const{
+                return entry_(args, d_args);
+        }
+
+private:
+        std::shared_ptr<void> handle_;
+        EntryPoint entry_{nullptr};
+        std::vector<std::string> args_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_JIT_H
@@ -0,0 +1,239 @@
+#ifndef INCLUDE_CADY_KERNELCACHE_H
+#define INCLUDE_CADY_KERNELCACHE_H
+
+#include "Jit.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+
+namespace Cady{
+
+/*
+        Persistent cache of JitKernel shared objects. Entries are
+        content addressed,
+
+                <directory>/<key>.so
+                <directory>/<key>.meta
+
+        where key is a hash of the function's structure, the code
+        generator version, and the compiler and flags. The meta file
+        records the size and checksum of the shared object, and an
+        entry which doesn't match is discarded and rebuilt, so a
+        truncated write or corrupted file is never loaded. When the
+        directory grows beyond MaxBytes the least recently used
+        entries are evicted.
+ */
+struct KernelCache{
+        // bump whenever the emitted translation unit changes shape
+        static std::string CodeGenVersion(){ return "StringCodeGenerator/4"; }
+
+        explicit KernelCache(std::string const& directory,
+                             std::uint64_t max_bytes = 256ull * 1024 * 1024,
+                             JitOptions const& opts = JitOptions{})
+                : directory_{directory}
+                , max_bytes_{max_bytes}
+                , opts_(opts)
+        {
+                if( ::mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST )
+                        throw std::domain_error("unable to create kernel cache " + directory_);
+        }
+
+        std::string const& Directory()const{ return directory_; }
+        std::uint64_t MaxBytes()const{ return max_bytes_; }
+
+        std::uint64_t Key(Function const& f)const{
+                Fnv1a h;
+                h.String(CodeGenVersion());
+                h.String(opts_.Compiler);
+                h.String(opts_.Flags);
+                h.String(f.Name());
+                h.Word(f.Arguments().size());
+                for(auto const& arg : f.Arguments() ){
+                        h.String(arg);
+                }
+                h.Word(f.Statements().size());
+                for(auto const& stmt : f.Statements() ){
+                        h.Word(stmt->StructuralHash());
+                }
+                return h.Value();
+        }
+
+        /*
+                loads the kernel from disk when present and intact,
+                otherwise generates, compiles and stores it
+         */
+        std::shared_ptr<JitKernel> Get(Function const& f){
+                auto key = KeyString(Key(f));
+                if( auto kernel = Lookup(key, f) )
+                        return kernel;
+                ++misses_;
+
+                std::string object_path = PathOf(key, ".so");
+                std::string meta_path   = PathOf(key, ".meta");
+                // build under a private name and rename into place, so
+                // concurrent processes never see a partial file
+                std::string unique = TempSuffix();
+                JitKernel::BuildSharedObject(f, object_path + unique, opts_);
+                std::uint64_t size = 0;
+                std::uint64_t checksum = 0;
+                if( ! Checksum(object_path + unique, size, checksum) ){
+                        ::unlink((object_path + unique).c_str());
+                        throw std::domain_error("unable to read " + object_path + unique);
+                }
+                {
+                        std::ofstream out(meta_path + unique);
+                        out << key << " " << size << " " << checksum << "\n";
+                }
+                if( ::rename((object_path + unique).c_str(), object_path.c_str()) != 0 ||
+                    ::rename((meta_path + unique).c_str(), meta_path.c_str()) != 0 )
+                {
+                        auto error = std::string{std::strerror(errno)};
+                        ::unlink((object_path + unique).c_str());
+                        ::unlink((meta_path + unique).c_str());
+                        throw std::domain_error("unable to store " + object_path + ", " + error);
+                }
+
+                auto kernel = JitKernel::Load(object_path, f.Name(), f.Arguments());
+                Evict(key);
+                return kernel;
+        }
+        std::shared_ptr<JitKernel> Get(std::string const& name,
+                                       std::shared_ptr<Operator> const& root,
+                                       std::vector<std::string> const& args)
+        {
+                return Get(JitKernel::MakeFunction(name, root, args));
+        }
+
+        size_t Hits()const{ return hits_; }
+        size_t Misses()const{ return misses_; }
+
+        /*
+                removes least recently used entries until the directory
+                fits in MaxBytes, never removing keep
+         */
+        void Evict(std::string const& keep = std::string{}){
+                struct Entry{
+                        std::string Key;
+                        std::uint64_t Bytes;
+                        time_t LastUse;
+                };
+                std::vector<Entry> entries;
+                std::uint64_t total = 0;
+                for(auto const& key : Keys() ){
+                        struct stat so;
+                        struct stat meta;
+                        if( ::stat(PathOf(key, ".so").c_str(), &so) != 0 )
+                                continue;
+                        std::uint64_t bytes = so.st_size;
+                        if( ::stat(PathOf(key, ".meta").c_str(), &meta) == 0 )
+                                bytes += meta.st_size;
+                        total += bytes;
+                        if( key != keep )
+                                entries.push_back(Entry{key, bytes, so.st_mtime});
+                }
+                std::sort(entries.begin(), entries.end(), [](auto const& l, auto const& r){
+                        return l.LastUse < r.LastUse;
+                });
+                for(auto const& e : entries ){
+                        if( total <= max_bytes_ )
+                                break;
+                        Remove(e.Key);
+                        total -= e.Bytes;
+                }
+        }
+
+private:
+        std::shared_ptr<JitKernel> Lookup(std::string const& key, Function const& f){
+                std::string object_path = PathOf(key, ".so");
+                std::ifstream meta(PathOf(key, ".meta"));
+                if( ! meta )
+                        return nullptr;
+                std::string meta_key;
+                std::uint64_t expected_size = 0;
+                std::uint64_t expected_checksum = 0;
+                meta >> meta_key >> expected_size >> expected_checksum;
+                std::uint64_t size = 0;
+                std::uint64_t checksum = 0;
+                if( ! meta || meta_key != key ||
+                    ! Checksum(object_path, size, checksum) ||
+                    size != expected_size || checksum != expected_checksum )
+                {
+                        Remove(key);
+                        return nullptr;
+                }
+                std::shared_ptr<JitKernel> kernel;
+                try{
+                        kernel = JitKernel::Load(object_path, f.Name(), f.Arguments());
+                } catch(std::domain_error const&){
+                        Remove(key);
+                        return nullptr;
+                }
+                // the modification time doubles as the last use for eviction
+                ::utime(object_path.c_str(), nullptr);
+                ++hits_;
+                return kernel;
+        }
+
+        static bool Checksum(std::string const& path, std::uint64_t& size, std::uint64_t& checksum){
+                std::ifstream in(path, std::ios::binary);
+                if( ! in )
+                        return false;
+                Fnv1a h;
+                char buffer[1 << 16];
+                size = 0;
+                while( in ){
+                        in.read(buffer, sizeof(buffer));
+                        h.Bytes(buffer, in.gcount());
+                        size += in.gcount();
+                }
+                checksum = h.Value();
+                return true;
+        }
+
+        std::vector<std::string> Keys()const{
+                std::vector<std::string> result;
+                auto dir = ::opendir(directory_.c_str());
+                if( ! dir )
+                        return result;
+                while( auto entry = ::readdir(dir) ){
+                        std::string name = entry->d_name;
+                        if( name.size() > 3 && name.compare(name.size() - 3, 3, ".so") == 0 )
+                                result.push_back(name.substr(0, name.size() - 3));
+                }
+                ::closedir(dir);
+                return result;
+        }
+        void Remove(std::string const& key){
+                ::unlink(PathOf(key, ".so").c_str());
+                ::unlink(PathOf(key, ".meta").c_str());
+        }
+
+        // distinct for every build, across threads as well as processes
+        static std::string TempSuffix(){
+                static std::atomic<unsigned long> counter{0};
+                return "." + std::to_string(::getpid()) + "." + std::to_string(counter.fetch_add(1)) + ".tmp";
+        }
+        static std::string KeyString(std::uint64_t key){
+                char buffer[17];
+                std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(key));
+                return buffer;
+        }
+        std::string PathOf(std::string const& key, char const* extension)const{
+                return directory_ + "/" + key + extension;
+        }
+
+        std::string directory_;
+        std::uint64_t max_bytes_;
+        JitOptions opts_;
+        size_t hits_{0};
+        size_t misses_{0};
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_KERNELCACHE_H
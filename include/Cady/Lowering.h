@@ -0,0 +1,125 @@
+#ifndef INCLUDE_CADY_LOWERING_H
+#define INCLUDE_CADY_LOWERING_H
+
+#include "Cady.h"
+
+#include <unordered_set>
+
+namespace Cady{
+
+/*
+        What the flat representations, the instruction tape of
+        CompiledExpression and the node array of CompactGraph, see of an
+        Operator. Classify() is the one place which maps the node types
+        onto this, so a new node type is added here and to the
+        lowerings' switches rather than to a dynamic_cast ladder in each
+ */
+enum LoweredKind{
+        LK_CONSTANT,
+        LK_EXO,
+        LK_ENDO,
+        LK_USUB,
+        LK_ADD,
+        LK_SUB,
+        LK_MUL,
+        LK_DIV,
+        LK_POW,
+        LK_EXP,
+        LK_LOG,
+        LK_SIN,
+        LK_COS,
+        LK_PHI,
+        LK_SQRT,
+        LK_NPDF,
+        LK_UNKNOWN,
+};
+
+inline LoweredKind Classify(Operator const* op){
+        switch(op->Kind()){
+        case OPKind_Constant:        return LK_CONSTANT;
+        case OPKind_ExogenousSymbol: return LK_EXO;
+        case OPKind_EndgenousSymbol: return LK_ENDO;
+        case OPKind_UnaryOperator:   return LK_USUB;
+        case OPKind_BinaryOperator:
+                switch(static_cast<BinaryOperator const*>(op)->OpKind()){
+                case OP_ADD: return LK_ADD;
+                case OP_SUB: return LK_SUB;
+                case OP_MUL: return LK_MUL;
+                case OP_DIV: return LK_DIV;
+                case OP_POW: return LK_POW;
+                }
+                break;
+        default:
+                if( dynamic_cast<Exp const*>(op) ) return LK_EXP;
+                if( dynamic_cast<Log const*>(op) ) return LK_LOG;
+                if( dynamic_cast<Sin const*>(op) ) return LK_SIN;
+                if( dynamic_cast<Cos const*>(op) ) return LK_COS;
+                if( dynamic_cast<Phi const*>(op) ) return LK_PHI;
+                if( dynamic_cast<Sqrt const*>(op) ) return LK_SQRT;
+                if( dynamic_cast<NormalDensity const*>(op) ) return LK_NPDF;
+                break;
+        }
+        return LK_UNKNOWN;
+}
+
+/*
+        Lowers a DAG one node at a time, children first, every node
+        exactly once however many parents it has. Derived provides
+
+                Ref Emit(Operator const* op);
+
+        which is called with the Refs of op's children already
+        available through Arg().
+ */
+template<class Derived, class Ref>
+struct PostOrderLowering{
+        /*
+                iterative post order so that deep graphs don't
+                exhaust the stack
+         */
+        Ref Visit(Operator const* root){
+                struct Frame{
+                        Operator const* Op;
+                        bool Expanded;
+                };
+                std::vector<Frame> stack{Frame{root, false}};
+                std::unordered_set<Operator const*> in_progress;
+                for(;stack.size();){
+                        auto frame = stack.back();
+                        stack.pop_back();
+                        if( memo_.count(frame.Op) )
+                                continue;
+                        if( frame.Expanded ){
+                                in_progress.erase(frame.Op);
+                                memo_[frame.Op] = static_cast<Derived*>(this)->Emit(frame.Op);
+                                continue;
+                        }
+                        if( in_progress.count(frame.Op) )
+                                throw std::domain_error("recursive graph");
+                        in_progress.insert(frame.Op);
+                        stack.push_back(Frame{frame.Op, true});
+                        auto const& children = frame.Op->Children();
+                        for(auto iter = children.rbegin(), end = children.rend();iter!=end;++iter){
+                                if( memo_.count(iter->get()) == 0 ){
+                                        if( in_progress.count(iter->get()) )
+                                                throw std::domain_error("recursive graph");
+                                        stack.push_back(Frame{iter->get(), false});
+                                }
+                        }
+                }
+                return memo_.at(root);
+        }
+        Ref Lowered(Operator const* op)const{
+                return memo_.at(op);
+        }
+protected:
+        Ref Arg(Operator const* op, size_t idx)const{
+                return memo_.at(op->Children()[idx].get());
+        }
+private:
+        std::unordered_map<Operator const*, Ref> memo_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_LOWERING_H
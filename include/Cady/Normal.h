@@ -0,0 +1,49 @@
+#ifndef INCLUDE_CADY_NORMAL_H
+#define INCLUDE_CADY_NORMAL_H
+
+#include <cmath>
+
+namespace Cady{
+namespace Normal{
+
+        // 1/sqrt(2 pi), the code generators emit the density from this too
+        constexpr double InvSqrt2Pi = 0.398942280401432677939946059934381868;
+
+        /*
+                The standard normal distribution function and density
+                of x, both taken from the scaled argument z = x/sqrt(2)
+
+                        Phi(x) = erfc(-z)/2
+                        phi(x) = exp(-z^2)/sqrt(2 pi)
+
+                so that every evaluator agrees to the last bit, and
+                when both are wanted for the same argument, as Phi(x)
+                and its derivative are, Cdf() shares the argument with
+                Density() rather than recomputing it.
+         */
+        inline double Scale(double x){
+                return x / std::sqrt(2.0);
+        }
+        inline double DensityOfScaled(double z){
+                return InvSqrt2Pi * std::exp(-z * z);
+        }
+        inline double CdfOfScaled(double z){
+                return std::erfc(-z) / 2;
+        }
+
+        inline double Cdf(double x){
+                return CdfOfScaled(Scale(x));
+        }
+        inline double Density(double x){
+                return DensityOfScaled(Scale(x));
+        }
+        inline double Cdf(double x, double& density){
+                double const z = Scale(x);
+                density = DensityOfScaled(z);
+                return CdfOfScaled(z);
+        }
+
+} // end namespace Normal
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_NORMAL_H
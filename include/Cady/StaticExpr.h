@@ -0,0 +1,187 @@
+#ifndef INCLUDE_CADY_STATICEXPR_H
+#define INCLUDE_CADY_STATICEXPR_H
+
+#include "Dual.h"
+
+#include <type_traits>
+
+namespace Cady{
+namespace Static{
+
+        /*
+                Expression template frontend. Unlike Frontend::WithOperators,
+                which allocates an Operator for every operation, here each
+                operation yields a small value type whose type encodes the
+                whole formula, so a kernel known at build time is
+
+                        Static::Arg<0> S;
+                        Static::Arg<1> K;
+                        auto f = Log(S / K) * Exp(-0.5 * S);
+
+                and both f.Value(args) and f.Gradient(args, d_args) are
+                instantiated and inlined by the compiler, with no heap use,
+                no runtime tree and no generated source. The gradient is a
+                single forward pass with Dual<Arity> arguments.
+         */
+        template<class Derived>
+        struct Expr{
+                Derived const& Self()const{ return static_cast<Derived const&>(*this); }
+
+                template<class T>
+                T Eval(T const* args)const{
+                        return Self().template EvalImpl<T>(args);
+                }
+                double Value(double const* args)const{
+                        return Eval(args);
+                }
+                /*
+                        d_args receives one partial per argument, returns the
+                        value
+                 */
+                double Gradient(double const* args, double* d_args)const{
+                        using D = Dual<Derived::Arity>;
+                        std::array<D, Derived::Arity> duals;
+                        for(size_t idx=0;idx!=duals.size();++idx){
+                                duals[idx] = D::Variable(args[idx], idx);
+                        }
+                        auto result = Eval(duals.data());
+                        for(size_t idx=0;idx!=duals.size();++idx){
+                                d_args[idx] = result.D(idx);
+                        }
+                        return result.Value();
+                }
+        };
+
+        namespace Detail{
+                inline double Exp(double x){ return std::exp(x); }
+                inline double Log(double x){ return std::log(x); }
+                inline double Sin(double x){ return std::sin(x); }
+                inline double Cos(double x){ return std::cos(x); }
+                inline double Phi(double x){ return Normal::Cdf(x); }
+                inline double Pow(double x, double y){ return std::pow(x, y); }
+                using Forward::Exp;
+                using Forward::Log;
+                using Forward::Sin;
+                using Forward::Cos;
+                using Forward::Phi;
+                using Forward::Pow;
+
+                constexpr int MaxArity(int l, int r){ return l < r ? r : l; }
+        } // end namespace Detail
+
+        // the idx'th argument of the kernel
+        template<int Idx>
+        struct Arg : Expr<Arg<Idx> >{
+                enum{ Arity = Idx + 1 };
+                template<class T>
+                T EvalImpl(T const* args)const{ return args[Idx]; }
+        };
+
+        struct Lit : Expr<Lit>{
+                enum{ Arity = 0 };
+                explicit Lit(double value):value_{value}{}
+                template<class T>
+                T EvalImpl(T const* args)const{ return T(value_); }
+        private:
+                double value_;
+        };
+
+        #define STATIC_DEFINE_BINARY(NAME, APPLY)                                       \
+        template<class L, class R>                                                      \
+        struct NAME : Expr<NAME<L, R> >{                                                \
+                enum{ Arity = Detail::MaxArity(L::Arity, R::Arity) };                   \
+                NAME(L const& l, R const& r):l_(l), r_(r){}                             \
+                template<class T>                                                       \
+                T EvalImpl(T const* args)const{                                         \
+                        T const l = l_.template EvalImpl<T>(args);                      \
+                        T const r = r_.template EvalImpl<T>(args);                      \
+                        return APPLY;                                                   \
+                }                                                                       \
+        private:                                                                        \
+                L l_;                                                                   \
+                R r_;                                                                   \
+        };
+        STATIC_DEFINE_BINARY(AddExpr, l + r)
+        STATIC_DEFINE_BINARY(SubExpr, l - r)
+        STATIC_DEFINE_BINARY(MulExpr, l * r)
+        STATIC_DEFINE_BINARY(DivExpr, l / r)
+        STATIC_DEFINE_BINARY(PowExpr, Detail::Pow(l, r))
+        #undef STATIC_DEFINE_BINARY
+
+        #define STATIC_DEFINE_UNARY(NAME, APPLY)                                        \
+        template<class E>                                                               \
+        struct NAME : Expr<NAME<E> >{                                                   \
+                enum{ Arity = E::Arity };                                               \
+                explicit NAME(E const& e):e_(e){}                                       \
+                template<class T>                                                       \
+                T EvalImpl(T const* args)const{                                         \
+                        T const x = e_.template EvalImpl<T>(args);                      \
+                        return APPLY;                                                   \
+                }                                                                       \
+        private:                                                                        \
+                E e_;                                                                   \
+        };
+        STATIC_DEFINE_UNARY(NegExpr, -x)
+        STATIC_DEFINE_UNARY(ExpExpr, Detail::Exp(x))
+        STATIC_DEFINE_UNARY(LogExpr, Detail::Log(x))
+        STATIC_DEFINE_UNARY(SinExpr, Detail::Sin(x))
+        STATIC_DEFINE_UNARY(CosExpr, Detail::Cos(x))
+        STATIC_DEFINE_UNARY(PhiExpr, Detail::Phi(x))
+        #undef STATIC_DEFINE_UNARY
+
+        namespace Detail{
+                /*
+                        lifts plain numbers to Lit so that operators can
+                        mix them with expressions
+                 */
+                template<class T>
+                T const& Lift(Expr<T> const& e){ return e.Self(); }
+                inline Lit Lift(double value){ return Lit{value}; }
+
+                template<class T>
+                struct IsExpr : std::is_base_of<Expr<typename std::decay<T>::type>, typename std::decay<T>::type>{};
+
+                template<class T>
+                struct IsOperand : std::integral_constant<bool,
+                        IsExpr<T>::value || std::is_arithmetic<typename std::decay<T>::type>::value>{};
+
+                template<class L, class R>
+                using EnableBinary = typename std::enable_if<
+                        IsOperand<L>::value && IsOperand<R>::value &&
+                        ( IsExpr<L>::value || IsExpr<R>::value )
+                >::type;
+
+                template<class T>
+                using Lifted = typename std::decay<decltype(Lift(std::declval<T>()))>::type;
+        } // end namespace Detail
+
+        #define STATIC_DEFINE_OPERATOR(LEXICAL_TOKEN, NAME)                             \
+        template<class L, class R, class = Detail::EnableBinary<L, R> >                 \
+        auto LEXICAL_TOKEN(L const& l, R const& r){                                     \
+                return NAME<Detail::Lifted<L>, Detail::Lifted<R> >(                     \
+                        Detail::Lift(l), Detail::Lift(r));                              \
+        }
+        STATIC_DEFINE_OPERATOR(operator+, AddExpr)
+        STATIC_DEFINE_OPERATOR(operator-, SubExpr)
+        STATIC_DEFINE_OPERATOR(operator*, MulExpr)
+        STATIC_DEFINE_OPERATOR(operator/, DivExpr)
+        STATIC_DEFINE_OPERATOR(Pow, PowExpr)
+        #undef STATIC_DEFINE_OPERATOR
+
+        template<class E>
+        auto operator-(Expr<E> const& e){ return NegExpr<E>(e.Self()); }
+        template<class E>
+        auto Exp(Expr<E> const& e){ return ExpExpr<E>(e.Self()); }
+        template<class E>
+        auto Log(Expr<E> const& e){ return LogExpr<E>(e.Self()); }
+        template<class E>
+        auto Sin(Expr<E> const& e){ return SinExpr<E>(e.Self()); }
+        template<class E>
+        auto Cos(Expr<E> const& e){ return CosExpr<E>(e.Self()); }
+        template<class E>
+        auto Phi(Expr<E> const& e){ return PhiExpr<E>(e.Self()); }
+
+} // end namespace Static
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_STATICEXPR_H
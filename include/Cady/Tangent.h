@@ -0,0 +1,192 @@
+#ifndef INCLUDE_CADY_TANGENT_H
+#define INCLUDE_CADY_TANGENT_H
+
+#include "Compiled.h"
+
+namespace Cady{
+
+/*
+        Vector forward mode differentiation of a CompiledExpression.
+        Every slot carries its value together with a contiguous row of
+        Width() tangents, and each instruction applies its local partials
+        to the whole row in one loop the compiler can vectorize. One pass
+        gives Width() directional derivatives of every output, so a full
+        Jacobian costs a single pass when Width() == NumInputs(), rather
+        than one scalar forward pass per input.
+ */
+struct TangentEvaluator{
+        explicit TangentEvaluator(CompiledExpression const& expr, size_t width)
+                : expr_(expr)
+                , width_{width}
+                , workspace_(expr.WorkspaceSize())
+                , tangent_(expr.WorkspaceSize() * width)
+        {
+                if( width_ == 0 )
+                        throw std::domain_error("tangent width must be positive");
+        }
+
+        size_t Width()const{ return width_; }
+
+        /*
+                seed is NumInputs() rows of Width() tangents, row i holding
+                the direction of input i. After the pass, Value(k) and
+                Tangent(k) hold the k-th output and its Width() directional
+                derivatives
+         */
+        void Execute(double const* inputs, double const* seed){
+                expr_.Execute(inputs, workspace_.data());
+                std::fill(tangent_.begin(), tangent_.end(), 0.0);
+                std::copy(seed, seed + expr_.NumInputs() * width_, tangent_.begin());
+                Sweep();
+        }
+
+        double Value(size_t output)const{
+                return workspace_[expr_.Outputs()[output]];
+        }
+        double const* Tangent(size_t output)const{
+                return Row(expr_.Outputs()[output]);
+        }
+
+        /*
+                derivative of each output along direction, which has one
+                entry per input. Only uses the first tangent lane
+         */
+        void Directional(double const* inputs, double const* direction, double* outputs){
+                std::vector<double> seed(expr_.NumInputs() * width_);
+                for(size_t idx=0;idx!=expr_.NumInputs();++idx){
+                        seed[idx * width_] = direction[idx];
+                }
+                Execute(inputs, seed.data());
+                for(size_t idx=0;idx!=expr_.NumOutputs();++idx){
+                        outputs[idx] = Tangent(idx)[0];
+                }
+        }
+
+        /*
+                jacobian is NumOutputs() rows of NumInputs(), computed in
+                ceil(NumInputs() / Width()) passes
+         */
+        void Jacobian(double const* inputs, double* jacobian){
+                size_t num_inputs = expr_.NumInputs();
+                std::vector<double> seed(num_inputs * width_);
+                for(size_t offset=0;offset<num_inputs;offset+=width_){
+                        size_t lanes = std::min(width_, num_inputs - offset);
+                        std::fill(seed.begin(), seed.end(), 0.0);
+                        for(size_t j=0;j!=lanes;++j){
+                                seed[(offset + j) * width_ + j] = 1.0;
+                        }
+                        Execute(inputs, seed.data());
+                        for(size_t idx=0;idx!=expr_.NumOutputs();++idx){
+                                std::copy(Tangent(idx), Tangent(idx) + lanes, jacobian + idx * num_inputs + offset);
+                        }
+                }
+        }
+
+private:
+        double* Row(size_t slot){
+                return tangent_.data() + slot * width_;
+        }
+        double const* Row(size_t slot)const{
+                return tangent_.data() + slot * width_;
+        }
+
+        void Sweep(){
+                double const* w = workspace_.data();
+                size_t const n = width_;
+                for(auto const& instr : expr_.Tape() ){
+                        double* __restrict t        = Row(instr.Result);
+                        double const* __restrict tx = Row(instr.Left);
+                        double const* __restrict ty = Row(instr.Right);
+                        double const x = w[instr.Left];
+                        double const y = w[instr.Right];
+                        double const r = w[instr.Result];
+                        switch(instr.Op){
+                        case TOP_ADD:
+                                for(size_t j=0;j!=n;++j) t[j] = tx[j] + ty[j];
+                                break;
+                        case TOP_SUB:
+                                for(size_t j=0;j!=n;++j) t[j] = tx[j] - ty[j];
+                                break;
+                        case TOP_MUL:
+                                for(size_t j=0;j!=n;++j) t[j] = y * tx[j] + x * ty[j];
+                                break;
+                        case TOP_DIV:
+                        {
+                                double const inv = 1.0 / y;
+                                for(size_t j=0;j!=n;++j) t[j] = ( tx[j] - r * ty[j] ) * inv;
+                                break;
+                        }
+                        case TOP_POW:
+                        {
+                                double const dx = y * std::pow(x, y - 1);
+                                // x^y is only differentiable in y for positive x
+                                double const dy = x > 0 ? r * std::log(x) : 0.0;
+                                for(size_t j=0;j!=n;++j) t[j] = dx * tx[j] + dy * ty[j];
+                                break;
+                        }
+                        case TOP_USUB:
+                                for(size_t j=0;j!=n;++j) t[j] = -tx[j];
+                                break;
+                        case TOP_EXP:
+                                for(size_t j=0;j!=n;++j) t[j] = r * tx[j];
+                                break;
+                        case TOP_LOG:
+                        {
+                                double const inv = 1.0 / x;
+                                for(size_t j=0;j!=n;++j) t[j] = inv * tx[j];
+                                break;
+                        }
+                        case TOP_SIN:
+                        {
+                                double const d = std::cos(x);
+                                for(size_t j=0;j!=n;++j) t[j] = d * tx[j];
+                                break;
+                        }
+                        case TOP_COS:
+                        {
+                                double const d = -std::sin(x);
+                                for(size_t j=0;j!=n;++j) t[j] = d * tx[j];
+                                break;
+                        }
+                        case TOP_PHI:
+                        {
+                                double const d = Normal::Density(x);
+                                for(size_t j=0;j!=n;++j) t[j] = d * tx[j];
+                                break;
+                        }
+                        case TOP_SQRT:
+                        {
+                                double const d = 0.5 / r;
+                                for(size_t j=0;j!=n;++j) t[j] = d * tx[j];
+                                break;
+                        }
+                        case TOP_NPDF:
+                        {
+                                double const d = -x * r;
+                                for(size_t j=0;j!=n;++j) t[j] = d * tx[j];
+                                break;
+                        }
+                        case TOP_PHI_NPDF:
+                        {
+                                // y is the density, Right the second result
+                                double* __restrict td = Row(instr.Right);
+                                double const d = -x * y;
+                                for(size_t j=0;j!=n;++j){
+                                        t[j]  = y * tx[j];
+                                        td[j] = d * tx[j];
+                                }
+                                break;
+                        }
+                        }
+                }
+        }
+
+        CompiledExpression const& expr_;
+        size_t width_;
+        std::vector<double> workspace_;
+        std::vector<double> tangent_;
+};
+
+} // end namespace Cady
+
+#endif // INCLUDE_CADY_TANGENT_H
@@ -6,14 +6,26 @@
 namespace Cady{
 namespace Transform{
 
-struct FoldZero{
+/*
+        folds constant arithmetic and the identities of zero and one,
+        each call to Fold() is one pass
+ */
+struct FoldZero : Rewriter{
+        explicit FoldZero(RewriteMode mode = RewriteMode_Pure)
+                : Rewriter{mode}
+        {}
 
-        std::shared_ptr<Operator> Fold(std::shared_ptr<Operator> root){
+        std::shared_ptr<Operator> Fold(std::shared_ptr<Operator> const& root){
+                Reset();
+                return Apply(root);
+        }
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& root)override{
                 if( root->Kind() == OPKind_BinaryOperator ){
                         auto bin_op = static_cast<BinaryOperator*>(root.get());
 
-                        auto left_folded = this->Fold(bin_op->At(0));
-                        auto right_folded = this->Fold(bin_op->At(1));
+                        auto left_folded = Mapped(bin_op->At(0));
+                        auto right_folded = Mapped(bin_op->At(1));
 
                         auto left_desc  = ConstantDescription{left_folded};
                         auto right_desc = ConstantDescription{right_folded};
@@ -102,16 +114,13 @@ struct FoldZero{
                                         break;
                                 }
                         }
-                        return std::make_shared<BinaryOperator>(
-                                bin_op->OpKind(),
-                                left_folded,
-                                right_folded);
+                        return Rebuild(root);
                 }
                 
                 if( root->Kind() == OPKind_UnaryOperator ){
                         auto unary_op = static_cast<UnaryOperator*>(root.get());
 
-                        auto folded_arg = this->Fold(unary_op->At(0));
+                        auto folded_arg = Mapped(unary_op->At(0));
 
                         auto arg_desc  = ConstantDescription{folded_arg};
 
@@ -119,19 +128,483 @@ struct FoldZero{
                                 return Constant::Make(0.0);
                         }
 
-                        return UnaryOperator::UnaryMinus(folded_arg);
+                        return Rebuild(root);
                 }
 
-                if( root->IsNonTerminal() ){
-                        for(size_t idx=0;idx!=root->Arity();++idx){
-                                auto folded = this->Fold(root->At(idx));
-                                root->Rebind(idx, folded);
+                return Rebuild(root);
+        }
+};
+
+/*
+        inlines every statement into the expressions using it
+ */
+struct RemoveEndo : Rewriter{
+        explicit RemoveEndo(RewriteMode mode = RewriteMode_Pure)
+                : Rewriter{mode}
+        {}
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                if( ptr->Kind() == OPKind_EndgenousSymbol )
+                        return Mapped(ptr->At(0));
+                return Rebuild(ptr);
+        }
+};
+
+/*
+        Rewrites the costly forms produced by differentiation into
+        cheaper ones
+                pow(x, c)    =>  x*x, 1/x, sqrt(x), 1/sqrt(x), ...
+                         for c one of -2, -1, -0.5, 0.5, 1, 1.5, 2, 3
+                a / c        =>  a * (1/c), the reciprocal precomputed
+                a * (1/x)    =>  a / x
+                (-1) * x     =>  -x
+        and pushes negation outwards so that it cancels, or folds into
+        an enclosing + or -. Exponents are only recognized once they're
+        constants, so this is best run after FoldZero. Multiplying by a
+        reciprocal rather than dividing may change the last bit.
+ */
+struct StrengthReduce : Rewriter{
+        explicit StrengthReduce(RewriteMode mode = RewriteMode_Pure)
+                : Rewriter{mode}
+        {}
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                if( ptr->Kind() == OPKind_BinaryOperator ){
+                        auto l = Mapped(ptr->At(0));
+                        auto r = Mapped(ptr->At(1));
+                        switch(static_cast<BinaryOperator const*>(ptr.get())->OpKind()){
+                        case OP_ADD: return Sum(l, r);
+                        case OP_SUB: return Difference(l, r);
+                        case OP_MUL: return Product(l, r);
+                        case OP_DIV: return Quotient(l, r);
+                        case OP_POW:
+                        {
+                                auto desc = ConstantDescription{r};
+                                if( desc.IsConstantValue() ){
+                                        if( auto p = Power(l, desc.ValueOrThrow()) )
+                                                return p;
+                                }
+                                break;
+                        }
                         }
                 }
-                return root;
+                if( ptr->Kind() == OPKind_UnaryOperator ){
+                        return Negate(Mapped(ptr->At(0)));
+                }
+                return Rebuild(ptr);
+        }
+private:
+        static bool IsNegation(std::shared_ptr<Operator> const& ptr){
+                return ptr->Kind() == OPKind_UnaryOperator;
+        }
+        // 1/x
+        static bool IsReciprocal(std::shared_ptr<Operator> const& ptr){
+                return ptr->Kind() == OPKind_BinaryOperator &&
+                       static_cast<BinaryOperator const*>(ptr.get())->OpKind() == OP_DIV &&
+                       ConstantDescription{ptr->At(0)}.IsOne();
+        }
+
+        static std::shared_ptr<Operator> Negate(std::shared_ptr<Operator> const& x){
+                if( IsNegation(x) )
+                        return x->At(0);
+                auto desc = ConstantDescription{x};
+                if( desc.IsConstantValue() )
+                        return Constant::Make(-desc.ValueOrThrow());
+                return UnaryOperator::UnaryMinus(x);
+        }
+        static std::shared_ptr<Operator> Sum(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+                if( IsNegation(r) )
+                        return BinaryOperator::Sub(l, r->At(0));
+                if( IsNegation(l) )
+                        return BinaryOperator::Sub(r, l->At(0));
+                return BinaryOperator::Add(l, r);
+        }
+        static std::shared_ptr<Operator> Difference(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+                if( IsNegation(r) )
+                        return BinaryOperator::Add(l, r->At(0));
+                return BinaryOperator::Sub(l, r);
+        }
+        static std::shared_ptr<Operator> Product(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+                auto l_desc = ConstantDescription{l};
+                auto r_desc = ConstantDescription{r};
+                if( l_desc.IsOne() )
+                        return r;
+                if( r_desc.IsOne() )
+                        return l;
+                if( l_desc.IsConstantValue() && l_desc.ValueOrThrow() == -1.0 )
+                        return Negate(r);
+                if( r_desc.IsConstantValue() && r_desc.ValueOrThrow() == -1.0 )
+                        return Negate(l);
+                if( IsNegation(l) )
+                        return Negate(Product(l->At(0), r));
+                if( IsNegation(r) )
+                        return Negate(Product(l, r->At(0)));
+                if( IsReciprocal(r) )
+                        return Quotient(l, r->At(1));
+                if( IsReciprocal(l) )
+                        return Quotient(r, l->At(1));
+                return BinaryOperator::Mul(l, r);
+        }
+        static std::shared_ptr<Operator> Quotient(std::shared_ptr<Operator> const& l, std::shared_ptr<Operator> const& r){
+                auto r_desc = ConstantDescription{r};
+                if( r_desc.IsConstantValue() && ! r_desc.IsZero() )
+                        return Product(l, Constant::Make(1.0 / r_desc.ValueOrThrow()));
+                if( IsNegation(l) )
+                        return Negate(Quotient(l->At(0), r));
+                if( IsNegation(r) )
+                        return Negate(Quotient(l, r->At(0)));
+                return BinaryOperator::Div(l, r);
+        }
+        static std::shared_ptr<Operator> Reciprocal(std::shared_ptr<Operator> const& x){
+                return BinaryOperator::Div(Constant::Make(1.0), x);
         }
+        // x^e for the exponents with a cheaper form, otherwise null
+        static std::shared_ptr<Operator> Power(std::shared_ptr<Operator> const& x, double e){
+                if( e == 1.0 )  return x;
+                if( e == 2.0 )  return BinaryOperator::Mul(x, x);
+                if( e == 3.0 )  return BinaryOperator::Mul(BinaryOperator::Mul(x, x), x);
+                if( e == -1.0 ) return Reciprocal(x);
+                if( e == -2.0 ) return Reciprocal(BinaryOperator::Mul(x, x));
+                if( e == 0.5 )  return Sqrt::Make(x);
+                if( e == -0.5 ) return Reciprocal(Sqrt::Make(x));
+                if( e == 1.5 )  return BinaryOperator::Mul(x, Sqrt::Make(x));
+                return nullptr;
+        }
+};
+
+/*
+        Global value numbering, maps a graph to one in which each value
+        is a single node. + and * are compared up to the order and
+        grouping of their operands, so a*b and b*a, or (a+b)+c and
+        c+(b+a), are the same node. Each chain of + or * is flattened,
+        its constants folded into one, and the operands sorted before
+        it's rebuilt left to right. Note that regrouping a chain can
+        change the result in the last bits.
+
+        A chain is only flattened into its parent while the result has
+        at most max_width operands, beyond that it's an opaque operand.
+        Otherwise a chain used twice in its parent, as in s = s + s,
+        doubles the operands at every level.
+
+        The numbering is kept across calls, so roots numbered by the
+        same object share their values.
+ */
+struct GlobalValueNumbering : Rewriter{
+        explicit GlobalValueNumbering(size_t max_width = 64)
+                : max_width_{max_width}
+        {}
+        // number of distinct values
+        size_t Values()const{ return values_.size(); }
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                if( ptr->Kind() == OPKind_BinaryOperator ){
+                        auto op = static_cast<BinaryOperator const*>(ptr.get())->OpKind();
+                        if( op == OP_ADD || op == OP_MUL )
+                                return Chain(op, ptr);
+                }
+                return Number(Rebuild(ptr));
+        }
+private:
+        struct ChainEntry{
+                BinaryOperatorKind Op;
+                OperatorVector Operands;
+        };
+
+        std::shared_ptr<Operator> Number(std::shared_ptr<Operator> const& candidate){
+                // the children are already numbered, so comparing them
+                // by pointer is enough
+                return *values_.insert(candidate).first;
+        }
+        std::shared_ptr<Operator> Chain(BinaryOperatorKind op, std::shared_ptr<Operator> const& ptr){
+                double const identity = ( op == OP_ADD ? 0.0 : 1.0 );
+                double folded = identity;
+                OperatorVector operands;
+                auto push = [&](std::shared_ptr<Operator> const& operand){
+                        if( operand->Kind() == OPKind_Constant ){
+                                auto value = static_cast<Constant const*>(operand.get())->Value();
+                                folded = ( op == OP_ADD ? folded + value : folded * value );
+                        } else {
+                                operands.push_back(operand);
+                        }
+                };
+                for(size_t idx=0;idx!=ptr->Arity();++idx){
+                        auto child = Mapped(ptr->At(idx));
+                        auto iter = chains_.find(child.get());
+                        bool flatten = iter != chains_.end() &&
+                                       iter->second.Op == op &&
+                                       operands.size() + iter->second.Operands.size() <= max_width_;
+                        if( flatten ){
+                                for(auto const& operand : iter->second.Operands){
+                                        push(operand);
+                                }
+                        } else {
+                                push(child);
+                        }
+                }
+                if( op == OP_MUL && folded == 0.0 )
+                        return Number(Constant::Make(0.0));
+
+                std::sort(operands.begin(), operands.end(), [](auto const& l, auto const& r){
+                        auto lh = l->StructuralHash();
+                        auto rh = r->StructuralHash();
+                        if( lh != rh )
+                                return lh < rh;
+                        return l.get() < r.get();
+                });
+                if( folded != identity || operands.empty() )
+                        operands.insert(operands.begin(), Number(Constant::Make(folded)));
+
+                auto acc = operands.front();
+                for(size_t idx=1;idx!=operands.size();++idx){
+                        acc = Number(MakeNode<BinaryOperator>(op, acc, operands[idx]));
+                        if( chains_.count(acc.get()) == 0 ){
+                                chains_[acc.get()] = ChainEntry{op, OperatorVector(operands.begin(), operands.begin() + idx + 1)};
+                        }
+                }
+                return acc;
+        }
+
+        size_t max_width_;
+        // the flattened operands of each chain made, keyed on nodes
+        // held by values_
+        std::unordered_map<Operator const*, ChainEntry> chains_;
+        std::unordered_set<
+                std::shared_ptr<Operator>,
+                OperatorHash,
+                OperatorShallowEqual
+        > values_;
 };
 
+/*
+        cost of evaluating each operation once, used to weigh the
+        saving of hoisting a subtree. Binary and unary operators are
+        keyed by their operation, ie ADD, DIV or USUB, any other node
+        by its name, ie Exp or Phi. Terminals and statements are free
+        to refer to.
+ */
+struct CostTable{
+        explicit CostTable(double default_cost = 10.0)
+                : default_{default_cost}
+        {}
+        static CostTable Default(){
+                CostTable table;
+                table.Set("ADD", 1.0)
+                     .Set("SUB", 1.0)
+                     .Set("USUB", 1.0)
+                     .Set("MUL", 2.0)
+                     .Set("DIV", 50.0)
+                     .Set("POW", 100.0)
+                     .Set("Exp", 100.0)
+                     .Set("Log", 100.0)
+                     .Set("Sin", 100.0)
+                     .Set("Cos", 100.0)
+                     .Set("Sqrt", 20.0)
+                     .Set("NormalDensity", 110.0)
+                     .Set("Phi", 1000.0);
+                return table;
+        }
+        CostTable& Set(std::string const& key, double cost){
+                table_[key] = cost;
+                return *this;
+        }
+        double Cost(Operator const& node)const{
+                if( node.IsTerminal() || node.Kind() == OPKind_EndgenousSymbol )
+                        return 0.0;
+                return Cost(KeyOf(node));
+        }
+        double Cost(std::string const& key)const{
+                auto iter = table_.find(key);
+                if( iter == table_.end() )
+                        return default_;
+                return iter->second;
+        }
+private:
+        static std::string KeyOf(Operator const& node){
+                switch(node.Kind()){
+                case OPKind_BinaryOperator:
+                        return node.HiddenArguments().at(0);
+                case OPKind_UnaryOperator:
+                        switch(static_cast<UnaryOperator const&>(node).OpKind()){
+                        case UOP_USUB: return "USUB";
+                        }
+                        break;
+                }
+                return node.Name();
+        }
+        double default_;
+        std::unordered_map<std::string, double> table_;
+};
+
+/*
+        Hoists common subtrees into statements, weighted by cost. The
+        graph is first value numbered so that structurally equal
+        subtrees are one node, then
+                for(;;){
+                        count the uses of each subtree
+                        take the largest saving, ( count - 1 ) * cost
+                        if it's not above the threshold
+                                break
+                        make that subtree a statement
+                }
+        where the cost of a subtree is what it costs to evaluate as
+        written, up to the statements under it. Unlike making every
+        node a temporary this only names the subtrees worth sharing,
+        and leaves the rest inline for the compiler.
+
+        The graph is numbered by GlobalValueNumbering first, so the
+        operands of + and * match in any order. The source graph isn't
+        modified, statements already in it are kept and the body of
+        each counts once.
+ */
+struct CommonSubtreeExtraction{
+        explicit CommonSubtreeExtraction(CostTable const& costs = CostTable::Default(),
+                                         double threshold = 1.0,
+                                         std::string const& prefix = "__cse_")
+                : costs_{costs}
+                , threshold_{threshold}
+                , prefix_{prefix}
+        {}
+
+        std::shared_ptr<Operator> Extract(std::shared_ptr<Operator> const& root){
+                return Extract(OperatorVector{root}).front();
+        }
+        // the roots share their statements
+        inline OperatorVector Extract(OperatorVector const& roots);
+
+        // statements made by the last Extract(), each after those it uses
+        EndgenousSymbolVec const& Statements()const{ return stmts_; }
+
+private:
+        struct Node{
+                std::shared_ptr<Operator> Ptr;
+                std::vector<size_t> Children;
+                double LocalCost;
+                bool IsStatement;
+                bool Hoisted;
+        };
+
+        // maps each node to the one representative of its structure
+        struct ValueNumbering : Rewriter{
+                explicit ValueNumbering(CommonSubtreeExtraction& self):self_(self){}
+        protected:
+                virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                        // the children are already representatives, so
+                        // comparing them by pointer is enough
+                        auto candidate = Rebuild(ptr);
+                        auto iter = self_.index_.find(candidate);
+                        if( iter != self_.index_.end() )
+                                return self_.nodes_[iter->second].Ptr;
+                        Node node{candidate, {}, self_.costs_.Cost(*candidate), candidate->Kind() == OPKind_EndgenousSymbol, false};
+                        for(size_t idx=0;idx!=candidate->Arity();++idx){
+                                node.Children.push_back(self_.index_.at(candidate->At(idx)));
+                        }
+                        self_.index_.emplace(candidate, self_.nodes_.size());
+                        self_.nodes_.push_back(std::move(node));
+                        return candidate;
+                }
+        private:
+                CommonSubtreeExtraction& self_;
+        };
+        struct Hoist : Rewriter{
+                explicit Hoist(CommonSubtreeExtraction& self):self_(self){}
+        protected:
+                virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
+                        auto result = Rebuild(ptr);
+                        if( ! self_.nodes_[self_.index_.at(ptr)].Hoisted )
+                                return result;
+                        std::stringstream name;
+                        name << self_.prefix_ << self_.counter_;
+                        ++self_.counter_;
+                        auto stmt = EndgenousSymbol::Make(name.str(), result);
+                        self_.stmts_.push_back(stmt);
+                        return stmt;
+                }
+        private:
+                CommonSubtreeExtraction& self_;
+        };
+
+        CostTable costs_;
+        double threshold_;
+        std::string prefix_;
+        size_t counter_{0};
+
+        // representatives in post order, so children come first
+        std::vector<Node> nodes_;
+        std::unordered_map<
+                std::shared_ptr<Operator>,
+                size_t,
+                OperatorHash,
+                OperatorShallowEqual
+        > index_;
+        EndgenousSymbolVec stmts_;
+};
+
+inline OperatorVector CommonSubtreeExtraction::Extract(OperatorVector const& roots){
+        nodes_.clear();
+        index_.clear();
+        stmts_.clear();
+
+        GlobalValueNumbering gvn;
+        ValueNumbering numbering(*this);
+        std::vector<size_t> root_index;
+        for(auto const& root : roots){
+                root_index.push_back(index_.at(numbering.Apply(gvn.Apply(root))));
+        }
+
+        std::vector<double> cost(nodes_.size());
+        std::vector<double> count(nodes_.size());
+        for(;;){
+                for(size_t idx=0;idx!=nodes_.size();++idx){
+                        auto const& node = nodes_[idx];
+                        cost[idx] = node.LocalCost;
+                        for(auto child : node.Children){
+                                if( ! nodes_[child].IsStatement && ! nodes_[child].Hoisted )
+                                        cost[idx] += cost[child];
+                        }
+                }
+                std::fill(count.begin(), count.end(), 0.0);
+                for(auto idx : root_index){
+                        count[idx] += 1.0;
+                }
+                // parents before children, a statement is evaluated once
+                // however many times it's referred to
+                for(size_t idx=nodes_.size();idx!=0;){
+                        --idx;
+                        auto const& node = nodes_[idx];
+                        if( count[idx] == 0.0 )
+                                continue;
+                        double uses = ( node.IsStatement || node.Hoisted ? 1.0 : count[idx] );
+                        for(auto child : node.Children){
+                                count[child] += uses;
+                        }
+                }
+
+                boost::optional<size_t> best;
+                double best_saving = threshold_;
+                for(size_t idx=nodes_.size();idx!=0;){
+                        --idx;
+                        auto const& node = nodes_[idx];
+                        if( node.Ptr->IsTerminal() || node.IsStatement || node.Hoisted )
+                                continue;
+                        double saving = ( count[idx] - 1.0 ) * cost[idx];
+                        if( saving > best_saving ){
+                                best = idx;
+                                best_saving = saving;
+                        }
+                }
+                if( ! best )
+                        break;
+                nodes_[*best].Hoisted = true;
+        }
+
+        Hoist hoist(*this);
+        OperatorVector result;
+        for(auto idx : root_index){
+                result.push_back(hoist.Apply(nodes_[idx].Ptr));
+        }
+        return result;
+}
+
 } // end namespace Transform
 } // end namespace Cady
 
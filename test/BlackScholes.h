@@ -0,0 +1,31 @@
+#ifndef TEST_BLACKSCHOLES_H
+#define TEST_BLACKSCHOLES_H
+
+#include "Cady/Frontend.h"
+
+struct BlackScholesCallOption{
+        template<class Double>
+        struct Build{
+                Double Evaluate(
+                        Double t,
+                        Double T,
+                        Double r,
+                        Double S,
+                        Double K,
+                        Double vol )const
+                {
+                        using Cady::MathFunctions::Phi;
+                        using Cady::MathFunctions::Exp;
+                        using Cady::MathFunctions::Pow;
+                        using Cady::MathFunctions::Log;
+
+                        Double d1 = ((1.0 / ( vol * Pow((T - t),0.5) )) * ( Log(S / K) +   (r + ( Pow(vol,2.0) ) / 2 ) * (T - t) ));
+                        Double d2 = d1 - vol * (T - t);
+                        Double pv = K * Exp( -r * ( T - t ) );
+                        Double black = Phi(d1) * S - Phi(d2) * pv;
+                        return black;
+                }
+        };
+};
+
+#endif // TEST_BLACKSCHOLES_H
@@ -0,0 +1,61 @@
+#include <gtest/gtest.h>
+#include "Cady/Active.h"
+#include "Cady/Dual.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+TEST(Active,Black){
+        auto position = ActiveTape::Current().Position();
+
+        double args[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+        std::vector<Active> inputs;
+        for(auto arg : args ){
+                inputs.push_back(Active::Variable(arg));
+        }
+        auto black = BlackScholesCallOption::Build<Active>{}.Evaluate(
+                inputs[0], inputs[1], inputs[2], inputs[3], inputs[4], inputs[5]);
+
+        auto expected = BlackScholesCallOption::Build<Dual<6> >{}.Evaluate(
+                Dual<6>::Variable(args[0], 0),
+                Dual<6>::Variable(args[1], 1),
+                Dual<6>::Variable(args[2], 2),
+                Dual<6>::Variable(args[3], 3),
+                Dual<6>::Variable(args[4], 4),
+                Dual<6>::Variable(args[5], 5)
+        );
+        EXPECT_FLOAT_EQ(expected.Value(), black.Value());
+
+        auto gradient = black.Gradient();
+        for(size_t idx=0;idx!=6;++idx){
+                EXPECT_NEAR(expected.D(idx), gradient.D(inputs[idx]), 1e-12);
+        }
+        // constants don't touch the tape
+        EXPECT_EQ(0.0, gradient.D(Active{2.0}));
+
+        ActiveTape::Current().Rewind(position);
+        EXPECT_EQ(position, ActiveTape::Current().Size());
+}
+
+TEST(Active,CashFlows){
+        auto position = ActiveTape::Current().Position();
+
+        // present value of a long schedule against a flat rate
+        size_t n = 10000;
+        auto r = Active::Variable(0.03);
+        Active pv = 0.0;
+        double expected_pv = 0.0;
+        double expected_d = 0.0;
+        for(size_t idx=0;idx!=n;++idx){
+                double t = 0.25 * ( idx + 1 );
+                pv = pv + 100 * Reverse::Exp(-r * t);
+                expected_pv += 100 * std::exp(-0.03 * t);
+                expected_d  += -t * 100 * std::exp(-0.03 * t);
+        }
+        auto gradient = pv.Gradient();
+        EXPECT_NEAR(expected_pv, pv.Value(), 1e-8 * expected_pv);
+        EXPECT_NEAR(expected_d, gradient.D(r), 1e-8 * std::fabs(expected_d));
+
+        ActiveTape::Current().Rewind(position);
+        EXPECT_THROW(pv.Gradient(), std::domain_error);
+}
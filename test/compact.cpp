@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+#include "Cady/Cady.h"
+#include "Cady/CompactIR.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+TEST(CompactIR,Black){
+        EXPECT_EQ(24, sizeof(CompactNode));
+
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto expr = as_black.as_operator_();
+
+        SymbolTable ST;
+        ST("t"  , 0.0);
+        ST("T"  , 10.0);
+        ST("r"  , 0.04);
+        ST("S"  , 50);
+        ST("K"  , 60);
+        ST("vol", 0.2);
+
+        auto compact = CompactGraph::FromOperator(expr);
+        EXPECT_FLOAT_EQ(expr->Eval(ST), compact.Eval(ST));
+
+        // operands always refer to earlier nodes
+        for(size_t idx=0;idx!=compact.Size();++idx){
+                auto const& node = compact.Nodes()[idx];
+                if( node.Left != CompactGraph::NoOperand ){
+                        EXPECT_LT(node.Left, idx);
+                }
+                if( node.Right != CompactGraph::NoOperand ){
+                        EXPECT_LT(node.Right, idx);
+                }
+        }
+
+        auto round_trip = compact.ToOperator();
+        EXPECT_FLOAT_EQ(expr->Eval(ST), round_trip->Eval(ST));
+        EXPECT_EQ(compact.Size(), CompactGraph::FromOperator(round_trip).Size());
+}
+
+TEST(CompactIR,Sharing){
+        auto x = ExogenousSymbol::Make("x");
+        auto s = EndgenousSymbol::Make("s", Exp::Make(x));
+        auto expr = BinaryOperator::Mul(s, BinaryOperator::Add(s, Constant::Make(0.5)));
+
+        auto compact = CompactGraph::FromOperator(expr);
+        // x, exp, s, 0.5, add, mul
+        EXPECT_EQ(6, compact.Size());
+
+        auto round_trip = compact.ToOperator();
+        EXPECT_EQ(round_trip->At(0), round_trip->At(1)->At(0));
+        EXPECT_EQ(OPKind_EndgenousSymbol, round_trip->At(0)->Kind());
+        EXPECT_EQ("s", std::static_pointer_cast<Symbol>(round_trip->At(0))->Name());
+}
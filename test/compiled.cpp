@@ -0,0 +1,296 @@
+#include <gtest/gtest.h>
+#include "Cady/Cady.h"
+#include "Cady/Compiled.h"
+#include "Cady/Batch.h"
+#include "Cady/Adjoint.h"
+#include "Cady/Tangent.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+TEST(Compiled,SharedSubexpression){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto s = EndgenousSymbol::Make("s", BinaryOperator::Add(x, y));
+        auto expr = BinaryOperator::Mul(
+                Exp::Make(s),
+                BinaryOperator::Sub(s, Constant::Make(2.0)));
+
+        auto compiled = CompiledExpression::Compile(expr, {"x", "y"});
+
+        // add, exp, sub, mul
+        EXPECT_EQ(4, compiled.Tape().size());
+        EXPECT_EQ(2, compiled.NumInputs());
+
+        SymbolTable ST;
+        ST("x", 0.3);
+        ST("y", 1.2);
+        EXPECT_FLOAT_EQ(expr->Eval(ST), compiled.Eval(ST));
+
+        double inputs[] = {0.3, 1.2};
+        EXPECT_FLOAT_EQ(expr->Eval(ST), compiled.Eval(inputs));
+}
+
+TEST(Compiled,Black){
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto expr = as_black.as_operator_();
+
+        auto compiled = CompiledExpression::Compile(expr, {"t", "T", "r", "S", "K", "vol"});
+        std::stringstream listing;
+        compiled.Display(listing);
+        EXPECT_NE(std::string::npos, listing.str().find(" = phi "));
+        EXPECT_NE(std::string::npos, listing.str().find("   ret w"));
+
+        SymbolTable ST;
+        ST("t"  , 0.0);
+        ST("T"  , 10.0);
+        ST("r"  , 0.04);
+        ST("S"  , 50);
+        ST("K"  , 60);
+        ST("vol", 0.2);
+
+        double inputs[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+        EXPECT_FLOAT_EQ(expr->Eval(ST), compiled.Eval(inputs));
+
+        std::vector<double> workspace(compiled.WorkspaceSize());
+        compiled.Execute(inputs, workspace.data());
+        EXPECT_FLOAT_EQ(expr->Eval(ST), workspace[compiled.Outputs()[0]]);
+}
+
+namespace{
+// a node type the compiler has no instruction for
+struct Tanh : Operator{
+        explicit Tanh(std::shared_ptr<Operator> arg)
+                :Operator{"Tanh"}
+        {
+                Push(arg);
+        }
+        virtual std::shared_ptr<Operator> DiffImpl(DiffContext& ctx)const override{
+                throw std::domain_error("not needed");
+        }
+        virtual void EmitCode(std::ostream& ss)const override{
+                ss << "std::tanh(";
+                At(0)->EmitCode(ss);
+                ss << ")";
+        }
+        virtual std::shared_ptr<Operator> Clone(std::shared_ptr<OperatorTransform> const& opt_trans)const override{
+                return std::make_shared<Tanh>(opt_trans->Apply(At(0)));
+        }
+        virtual double EvalImpl(EvalContext const& ctx)const override{
+                return std::tanh(At(0)->EvalImpl(ctx));
+        }
+};
+} // end namespace anonymous
+
+TEST(Compiled,Unsupported){
+        auto x = ExogenousSymbol::Make("x");
+        auto expr = BinaryOperator::Add(std::make_shared<Tanh>(x), x);
+        EXPECT_THROW(CompiledExpression::Compile(expr), std::domain_error);
+}
+
+TEST(Compiled,BareSymbol){
+        auto expr = ExogenousSymbol::Make("x");
+        auto compiled = CompiledExpression::Compile(expr);
+        double inputs[] = {1.5};
+        EXPECT_EQ(0, compiled.Tape().size());
+        EXPECT_FLOAT_EQ(1.5, compiled.Eval(inputs));
+        EXPECT_THROW(compiled.InputIndex("y"), std::domain_error);
+}
+
+TEST(Compiled,BatchBlack){
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto compiled = CompiledExpression::Compile(as_black.as_operator_(), {"t", "T", "r", "S", "K", "vol"});
+
+        // not a multiple of the tile size, so the last tile is partial
+        size_t n = 1000;
+        double t   = 0.0;
+        double r   = 0.04;
+        double vol = 0.2;
+        std::vector<double> T(n), S(n), K(n), output(n);
+        for(size_t idx=0;idx!=n;++idx){
+                T[idx] = 0.5 + 0.01 * idx;
+                S[idx] = 40 + 0.02 * idx;
+                K[idx] = 60;
+        }
+
+        BatchEvaluator batch(compiled, 64);
+        batch.Eval({
+                BatchColumn::Broadcast(&t),
+                BatchColumn::Vector(T.data()),
+                BatchColumn::Broadcast(&r),
+                BatchColumn::Vector(S.data()),
+                BatchColumn::Vector(K.data()),
+                BatchColumn::Broadcast(&vol)
+        }, output.data(), n);
+
+        for(size_t idx=0;idx!=n;++idx){
+                double inputs[] = {t, T[idx], r, S[idx], K[idx], vol};
+                EXPECT_FLOAT_EQ(compiled.Eval(inputs), output[idx]);
+        }
+}
+
+TEST(Compiled,AdjointBlack){
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto expr = as_black.as_operator_();
+        std::vector<std::string> args{"t", "T", "r", "S", "K", "vol"};
+        auto compiled = CompiledExpression::Compile(expr, args);
+
+        SymbolTable ST;
+        ST("t"  , 0.0);
+        ST("T"  , 10.0);
+        ST("r"  , 0.04);
+        ST("S"  , 50);
+        ST("K"  , 60);
+        ST("vol", 0.2);
+
+        AdjointEvaluator adjoint(compiled);
+        std::vector<double> gradient;
+        EXPECT_FLOAT_EQ(expr->Eval(ST), adjoint.Gradient(ST, gradient));
+        ASSERT_EQ(args.size(), gradient.size());
+        double inputs[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+        double epsilon = 1e-6;
+        for(size_t idx=0;idx!=args.size();++idx){
+                double up[6], down[6];
+                std::copy(inputs, inputs + 6, up);
+                std::copy(inputs, inputs + 6, down);
+                up[idx]   += epsilon;
+                down[idx] -= epsilon;
+                double fd = ( compiled.Eval(up) - compiled.Eval(down) ) / ( 2 * epsilon );
+                EXPECT_NEAR(fd, gradient[idx], 1e-4 * std::max(1.0, std::fabs(fd))) << args[idx];
+        }
+}
+
+TEST(Compiled,AdjointPow){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto expr = BinaryOperator::Pow(x, BinaryOperator::Mul(y, y));
+        auto compiled = CompiledExpression::Compile(expr, {"x", "y"});
+
+        AdjointEvaluator adjoint(compiled);
+        double inputs[] = {1.7, 1.3};
+        double gradient[2];
+        double value = adjoint.Gradient(inputs, gradient);
+        EXPECT_FLOAT_EQ(std::pow(1.7, 1.69), value);
+        EXPECT_FLOAT_EQ(1.69 * std::pow(1.7, 0.69), gradient[0]);
+        EXPECT_FLOAT_EQ(value * std::log(1.7) * 2 * 1.3, gradient[1]);
+}
+
+TEST(Compiled,TangentJacobian){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto z = ExogenousSymbol::Make("z");
+        Function f("f");
+        f.AddArgument("x");
+        f.AddArgument("y");
+        f.AddArgument("z");
+        auto s0 = f.AddStatement(EndgenousSymbol::Make("s0", BinaryOperator::Mul(x, Exp::Make(y))));
+        auto s1 = f.AddStatement(EndgenousSymbol::Make("s1", BinaryOperator::Div(s0, BinaryOperator::Add(z, Log::Make(x)))));
+        f.AddStatement(EndgenousSymbol::Make("s2", BinaryOperator::Pow(s1, z)));
+        auto compiled = CompiledExpression::CompileStatements(f);
+        ASSERT_EQ(3, compiled.NumOutputs());
+
+        double inputs[] = {1.3, 0.4, 2.1};
+        AdjointEvaluator adjoint(compiled);
+
+        // a width less than the number of inputs takes several passes
+        for(size_t width : {1, 2, 3, 8}){
+                TangentEvaluator tangent(compiled, width);
+                std::vector<double> jacobian(3 * 3);
+                tangent.Jacobian(inputs, jacobian.data());
+                for(size_t row=0;row!=3;++row){
+                        double gradient[3];
+                        adjoint.Gradient(inputs, gradient, row);
+                        for(size_t col=0;col!=3;++col){
+                                EXPECT_NEAR(gradient[col], jacobian[row * 3 + col], 1e-12) << width << " " << row << " " << col;
+                        }
+                }
+        }
+
+        TangentEvaluator tangent(compiled, 4);
+        double direction[] = {1.0, -2.0, 0.5};
+        double outputs[3];
+        tangent.Directional(inputs, direction, outputs);
+        for(size_t row=0;row!=3;++row){
+                double gradient[3];
+                adjoint.Gradient(inputs, gradient, row);
+                EXPECT_NEAR(gradient[0] - 2.0 * gradient[1] + 0.5 * gradient[2], outputs[row], 1e-12);
+        }
+}
+
+TEST(Compiled,FusedNormal){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto arg = BinaryOperator::Add(x, BinaryOperator::Mul(y, y));
+        auto phi = Phi::Make(arg);
+        // the derivative brings in the density of the same argument
+        auto expr = BinaryOperator::Add(phi, phi->Diff("y"));
+        auto compiled = CompiledExpression::Compile(expr, {"x", "y"});
+
+        size_t fused = 0;
+        for(auto const& instr : compiled.Tape() ){
+                EXPECT_NE(TOP_PHI, instr.Op);
+                EXPECT_NE(TOP_NPDF, instr.Op);
+                fused += ( instr.Op == TOP_PHI_NPDF );
+        }
+        EXPECT_EQ(1, fused);
+
+        double inputs[] = {-0.7, 0.6};
+        double a = -0.7 + 0.36;
+        double value = Normal::Cdf(a) + Normal::Density(a) * 2 * 0.6;
+        EXPECT_FLOAT_EQ(value, compiled.Eval(inputs));
+
+        size_t n = 100;
+        std::vector<double> xs(n), output(n);
+        for(size_t idx=0;idx!=n;++idx){
+                xs[idx] = -4.0 + 0.08 * idx;
+        }
+        BatchEvaluator batch(compiled, 32);
+        batch.Eval({ BatchColumn::Vector(xs.data()), BatchColumn::Broadcast(&inputs[1]) }, output.data(), n);
+        for(size_t idx=0;idx!=n;++idx){
+                double lane[] = {xs[idx], inputs[1]};
+                EXPECT_EQ(compiled.Eval(lane), output[idx]);
+        }
+
+        AdjointEvaluator adjoint(compiled);
+        double gradient[2];
+        EXPECT_FLOAT_EQ(value, adjoint.Gradient(inputs, gradient));
+        double epsilon = 1e-6;
+        for(size_t idx=0;idx!=2;++idx){
+                double up[2]   = {inputs[0], inputs[1]};
+                double down[2] = {inputs[0], inputs[1]};
+                up[idx]   += epsilon;
+                down[idx] -= epsilon;
+                double fd = ( compiled.Eval(up) - compiled.Eval(down) ) / ( 2 * epsilon );
+                EXPECT_NEAR(fd, gradient[idx], 1e-6) << idx;
+        }
+
+        TangentEvaluator tangent(compiled, 2);
+        double jacobian[2];
+        tangent.Jacobian(inputs, jacobian);
+        EXPECT_NEAR(gradient[0], jacobian[0], 1e-12);
+        EXPECT_NEAR(gradient[1], jacobian[1], 1e-12);
+}
@@ -0,0 +1,83 @@
+#include <gtest/gtest.h>
+#include "Cady/Cady.h"
+#include "Cady/Dual.h"
+#include "Cady/Compiled.h"
+#include "Cady/Adjoint.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+namespace{
+        template<class Double>
+        Double EvaluateBlack(double const* inputs, size_t width){
+                auto kernel = BlackScholesCallOption::Build<Double>{};
+                return kernel.Evaluate(
+                        Double::Variable(inputs[0], 0, width),
+                        Double::Variable(inputs[1], 1, width),
+                        Double::Variable(inputs[2], 2, width),
+                        Double::Variable(inputs[3], 3, width),
+                        Double::Variable(inputs[4], 4, width),
+                        Double::Variable(inputs[5], 5, width)
+                );
+        }
+} // end namespace anonymous
+
+TEST(Dual,Black){
+        double inputs[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto compiled = CompiledExpression::Compile(as_black.as_operator_(), {"t", "T", "r", "S", "K", "vol"});
+        AdjointEvaluator adjoint(compiled);
+        double gradient[6];
+        double expected = adjoint.Gradient(inputs, gradient);
+
+        auto black = BlackScholesCallOption::Build<double>{}.Evaluate(0.0, 10.0, 0.04, 50, 60, 0.2);
+        EXPECT_FLOAT_EQ(black, expected);
+
+        auto fixed = EvaluateBlack<Dual<6> >(inputs, 6);
+        auto dynamic = EvaluateBlack<Dual<Dynamic> >(inputs, 6);
+        EXPECT_FLOAT_EQ(expected, fixed.Value());
+        EXPECT_FLOAT_EQ(expected, dynamic.Value());
+        EXPECT_EQ(6, dynamic.Width());
+        for(size_t idx=0;idx!=6;++idx){
+                EXPECT_NEAR(gradient[idx], fixed.D(idx), 1e-12);
+                EXPECT_NEAR(gradient[idx], dynamic.D(idx), 1e-12);
+        }
+}
+
+TEST(Dual,Functions){
+        using MathFunctions::Sin;
+        using MathFunctions::Cos;
+        using MathFunctions::Pow;
+
+        auto x = Dual<2>::Variable(0.7, 0);
+        auto y = Dual<2>::Variable(1.9, 1);
+
+        auto a = Sin(x) * Cos(y) + Pow(x, y) - 2 / x;
+        EXPECT_FLOAT_EQ(std::sin(0.7) * std::cos(1.9) + std::pow(0.7, 1.9) - 2 / 0.7, a.Value());
+        EXPECT_FLOAT_EQ(std::cos(0.7) * std::cos(1.9) + 1.9 * std::pow(0.7, 0.9) + 2 / (0.7 * 0.7), a.D(0));
+        EXPECT_FLOAT_EQ(-std::sin(0.7) * std::sin(1.9) + std::pow(0.7, 1.9) * std::log(0.7), a.D(1));
+
+        // constants have no tangent until combined with a variable
+        Dual<Dynamic> c = 3.0;
+        EXPECT_EQ(0, c.Width());
+        auto z = c * Dual<Dynamic>::Variable(2.0, 1, 3);
+        EXPECT_EQ(3, z.Width());
+        EXPECT_FLOAT_EQ(0.0, z.D(0));
+        EXPECT_FLOAT_EQ(3.0, z.D(1));
+
+        // without a width a dynamic variable is just wide enough
+        auto w = Dual<Dynamic>::Variable(2.0, 4);
+        EXPECT_EQ(5, w.Width());
+        EXPECT_FLOAT_EQ(1.0, w.D(4));
+        EXPECT_THROW(Dual<Dynamic>::Variable(2.0, 3, 3), std::domain_error);
+        EXPECT_THROW(Dual<2>::Variable(2.0, 2), std::domain_error);
+}
@@ -0,0 +1,163 @@
+#include <gtest/gtest.h>
+#include "Cady/Cady.h"
+#include "Cady/EGraph.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+namespace{
+// cost of evaluating each distinct node once
+double DagCost(OperatorVector const& roots, Transform::CostTable const& costs = Transform::CostTable::Default()){
+        std::unordered_set<Operator const*> seen;
+        std::vector<Operator const*> stack;
+        for(auto const& root : roots)
+                stack.push_back(root.get());
+        double cost = 0.0;
+        for(;stack.size();){
+                auto head = stack.back();
+                stack.pop_back();
+                if( ! seen.insert(head).second )
+                        continue;
+                cost += costs.Cost(*head);
+                for(auto const& child : head->Children())
+                        stack.push_back(child.get());
+        }
+        return cost;
+}
+} // end namespace anonymous
+
+TEST(EGraph,Rewrites){
+        auto a = ExogenousSymbol::Make("a");
+        auto b = ExogenousSymbol::Make("b");
+        auto c = ExogenousSymbol::Make("c");
+        SymbolTable ST;
+        ST("a", 1.7);
+        ST("b", 0.4);
+        ST("c", -2.1);
+
+        // a*b + c*a => a*(b+c)
+        auto factor = BinaryOperator::Add(BinaryOperator::Mul(a, b), BinaryOperator::Mul(c, a));
+        auto factored = EGraph::Optimize(factor);
+        EXPECT_EQ(OPKind_BinaryOperator, factored->Kind());
+        EXPECT_EQ(OP_MUL, std::static_pointer_cast<BinaryOperator>(factored)->OpKind());
+        EXPECT_NEAR(factor->Eval(ST), factored->Eval(ST), 1e-12);
+
+        // exp(a)*exp(b) => exp(a+b)
+        auto exps = BinaryOperator::Mul(Exp::Make(a), Exp::Make(b));
+        auto combined = EGraph::Optimize(exps);
+        EXPECT_EQ("Exp", combined->Name());
+        EXPECT_NEAR(exps->Eval(ST), combined->Eval(ST), 1e-12);
+
+        // -(-(exp(log(a)))) + 0*b => a
+        auto ident = BinaryOperator::Add(
+                UnaryOperator::UnaryMinus(UnaryOperator::UnaryMinus(Exp::Make(Log::Make(a)))),
+                BinaryOperator::Mul(Constant::Make(0.0), b));
+        EXPECT_TRUE(EGraph::Optimize(ident)->StructurallyEquals(*a));
+
+        // pow(a, 2) => a*a, the constants fold
+        auto pow = BinaryOperator::Pow(a, BinaryOperator::Add(Constant::Make(1.5), Constant::Make(0.5)));
+        auto squared = EGraph::Optimize(pow);
+        EXPECT_EQ(OPKind_BinaryOperator, squared->Kind());
+        EXPECT_EQ(OP_MUL, std::static_pointer_cast<BinaryOperator>(squared)->OpKind());
+        EXPECT_TRUE(squared->At(0)->StructurallyEquals(*a));
+        EXPECT_EQ(squared->At(0), squared->At(1));
+
+        // (-a)*b - (-c) => c - a*b, or the like
+        auto neg = BinaryOperator::Sub(
+                BinaryOperator::Mul(UnaryOperator::UnaryMinus(a), b),
+                UnaryOperator::UnaryMinus(c));
+        auto pushed = EGraph::Optimize(neg);
+        EXPECT_LT(DagCost({pushed}), DagCost({neg}));
+        EXPECT_NEAR(neg->Eval(ST), pushed->Eval(ST), 1e-12);
+
+        // statements are kept, and their bodies optimized
+        auto stmt = EndgenousSymbol::Make("__egraph_stmt", BinaryOperator::Mul(a, Constant::Make(1.0)));
+        auto use = EGraph::Optimize(BinaryOperator::Add(stmt, Constant::Make(0.0)));
+        ASSERT_EQ(OPKind_EndgenousSymbol, use->Kind());
+        EXPECT_TRUE(use->At(0)->StructurallyEquals(*a));
+}
+
+TEST(EGraph,SharedCost){
+        auto a = ExogenousSymbol::Make("a");
+        auto b = ExogenousSymbol::Make("b");
+        auto c = ExogenousSymbol::Make("c");
+        auto ac = BinaryOperator::Div(a, c);
+        auto bc = BinaryOperator::Div(b, c);
+
+        // on its own a/c + b/c is cheaper as (a+b)/c
+        auto sum = BinaryOperator::Add(ac, bc);
+        auto factored = EGraph::Optimize(sum);
+        ASSERT_EQ(OPKind_BinaryOperator, factored->Kind());
+        EXPECT_EQ(OP_DIV, std::static_pointer_cast<BinaryOperator>(factored)->OpKind());
+
+        // but not when a/c and b/c are needed anyway, which the cheapest
+        // tree for the sum doesn't see
+        auto shared = BinaryOperator::Mul(BinaryOperator::Mul(sum, ac), bc);
+        auto optimized = EGraph::Optimize(shared);
+        EXPECT_GE(DagCost({shared}), DagCost({optimized}));
+
+        SymbolTable ST;
+        ST("a", 1.7);
+        ST("b", 0.4);
+        ST("c", -2.1);
+        EXPECT_NEAR(shared->Eval(ST), optimized->Eval(ST), 1e-12);
+}
+
+TEST(EGraph,Limits){
+        // a long sum blows up under commutativity and associativity
+        auto x = ExogenousSymbol::Make("x");
+        std::shared_ptr<Operator> sum = x;
+        for(size_t idx=0;idx!=12;++idx){
+                sum = BinaryOperator::Add(sum, ExogenousSymbol::Make("x" + std::to_string(idx)));
+        }
+        EGraph graph;
+        auto ids = graph.Add(OperatorVector{sum});
+        EGraph::Limits limits;
+        limits.MaxIterations = 100;
+        limits.MaxNodes = 2000;
+        auto iterations = graph.Saturate(EGraph::DefaultRules(), limits);
+        // the rules would go on, but stop at the limit
+        EXPECT_GT(limits.MaxIterations, iterations);
+        EXPECT_GE(limits.MaxNodes, graph.Size());
+        EXPECT_LT(limits.MaxNodes - 10, graph.Size());
+
+        SymbolTable ST;
+        ST("x", 1.0);
+        for(size_t idx=0;idx!=12;++idx){
+                ST("x" + std::to_string(idx), idx * 0.5);
+        }
+        EXPECT_NEAR(sum->Eval(ST), graph.Extract(ids).front()->Eval(ST), 1e-12);
+}
+
+TEST(EGraph,Black){
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto expr = as_black.as_operator_()->Clone(std::make_shared<Transform::RemoveEndo>());
+
+        SymbolTable ST;
+        ST("t"  , 0.0);
+        ST("T"  , 10.0);
+        ST("r"  , 0.04);
+        ST("S"  , 50);
+        ST("K"  , 60);
+        ST("vol", 0.2);
+
+        OperatorVector greeks{expr};
+        for(auto sym : { "t", "T", "r", "S", "K", "vol" }){
+                greeks.push_back(expr->Diff(sym));
+        }
+        auto optimized = EGraph::Optimize(greeks);
+        ASSERT_EQ(greeks.size(), optimized.size());
+        for(size_t idx=0;idx!=greeks.size();++idx){
+                auto expected = greeks[idx]->Eval(ST);
+                EXPECT_NEAR(expected, optimized[idx]->Eval(ST), 1e-9 * std::max(1.0, std::fabs(expected)));
+        }
+        EXPECT_LT(DagCost(optimized), DagCost(greeks));
+}
@@ -1,7 +1,10 @@
 #include <gtest/gtest.h>
 #include <list>
+#include <pthread.h>
 #include "Cady/Cady.h"
 #include "Cady/Transform.h"
+#include "Cady/CodeGen.h"
+#include "Cady/Compiled.h"
 
 using namespace Cady;
 
@@ -49,6 +52,637 @@ TEST(Expr,EndgenousSymbol){
         EXPECT_EQ(0.0, std::reinterpret_pointer_cast<Constant>(ds_dt)->Value() );
 }
 
+TEST(Expr,SymbolId){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        EXPECT_EQ(x->Id(), SymbolRegistry::Intern("x"));
+        EXPECT_EQ(x->Id(), ExogenousSymbol::Make("x")->Id());
+        EXPECT_NE(x->Id(), y->Id());
+        EXPECT_EQ("y", SymbolRegistry::NameOf(y->Id()));
+
+        auto expr = BinaryOperator::Mul(x, BinaryOperator::Add(x, y));
+
+        SymbolTable ST;
+        ST("x", 2.0);
+        ST(y->Id(), 3.0);
+        EXPECT_EQ(10.0, expr->Eval(ST));
+
+        double inputs[] = {3.0, 2.0};
+        ArgumentList args{"y", "x"};
+        EXPECT_EQ(10.0, expr->Eval(args, inputs));
+        EXPECT_EQ(1, args.Position(x->Id()));
+        // a symbol which isn't an argument is never read
+        EXPECT_THROW(expr->Eval(ArgumentList{"x"}, inputs), std::domain_error);
+        EXPECT_THROW(ArgumentList({"x", "x"}), std::domain_error);
+
+        // d/dx x*(x+y) = 2x + y
+        EXPECT_EQ(7.0, expr->Diff(x->Id())->Eval(ST));
+        EXPECT_EQ(7.0, expr->Diff("x")->Eval(ST));
+
+        EXPECT_THROW(expr->Eval(SymbolTable{}), std::domain_error);
+}
+
+TEST(Expr,EvalMemo){
+        // each statement references the previous one twice, so
+        // without memoization this is 2^depth evaluations
+        size_t depth = 60;
+        std::shared_ptr<Operator> head = ExogenousSymbol::Make("x");
+        for(size_t idx=0;idx!=depth;++idx){
+                head = EndgenousSymbol::Make("s" + std::to_string(idx), BinaryOperator::Add(head, head));
+        }
+
+        SymbolTable ST;
+        ST("x", 1.0);
+
+        EvalMemo memo(*head);
+        EXPECT_EQ(depth, memo.Size());
+        EXPECT_EQ(std::pow(2.0, depth), head->Eval(ST, memo));
+
+        ST("x", 3.0);
+        EXPECT_EQ(3.0 * std::pow(2.0, depth), head->Eval(ST, memo));
+        EXPECT_EQ(3.0 * std::pow(2.0, depth), head->EvalMemoized(ST));
+
+        // a second memo sharing the statements leaves the first one
+        // caching, else this would be 2^depth evaluations again
+        auto tail = EndgenousSymbol::Make("tail", BinaryOperator::Add(head, head));
+        EvalMemo other(*tail);
+        EXPECT_EQ(depth + 1, other.Size());
+        EXPECT_EQ(6.0 * std::pow(2.0, depth), tail->Eval(ST, other));
+        EXPECT_EQ(3.0 * std::pow(2.0, depth), head->Eval(ST, memo));
+}
+
+TEST(Expr,Validate){
+        auto x = ExogenousSymbol::Make("x");
+        auto sum = BinaryOperator::Add(x, Constant::Make(1.0));
+        auto s = EndgenousSymbol::Make("s", sum);
+
+        SymbolTable ST;
+        ST("x", 1.0);
+
+        EXPECT_EQ(2.0, s->Eval(ST));
+        EXPECT_TRUE(s->IsValidated());
+        EXPECT_TRUE(sum->IsValidated());
+        EXPECT_EQ(2.0, s->EvalChecked(ST));
+
+        // s = s + 1
+        sum->Rebind(1, s);
+        EXPECT_FALSE(s->IsValidated());
+        EXPECT_THROW(s->Validate(), std::domain_error);
+        EXPECT_THROW(s->Eval(ST), std::domain_error);
+        EXPECT_THROW(s->EvalChecked(ST), std::domain_error);
+
+        // break the cycle so it can be freed
+        sum->Rebind(1, Constant::Make(2.0));
+        EXPECT_EQ(3.0, s->Eval(ST));
+}
+
+TEST(Expr,Invalidate){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto left  = BinaryOperator::Mul(x, y);
+        auto right = Exp::Make(y);
+        auto root  = BinaryOperator::Add(left, right);
+        auto other = BinaryOperator::Sub(ExogenousSymbol::Make("z"), Constant::Make(1.0));
+
+        SymbolTable ST;
+        ST("x", 2.0);
+        ST("y", 3.0);
+        ST("z", 4.0);
+        EXPECT_EQ(6.0 + std::exp(3.0), root->Eval(ST));
+        EXPECT_EQ(3.0, other->Eval(ST));
+        auto hash = root->StructuralHash();
+        auto other_hash = other->StructuralHash();
+        auto version = right->Version();
+
+        // only the mutated node and its ancestors are invalidated
+        left->Rebind(1, x);
+        EXPECT_FALSE(root->IsValidated());
+        EXPECT_FALSE(left->IsValidated());
+        EXPECT_TRUE(right->IsValidated());
+        EXPECT_TRUE(other->IsValidated());
+        EXPECT_EQ(version, right->Version());
+        EXPECT_NE(hash, root->StructuralHash());
+        EXPECT_EQ(other_hash, other->StructuralHash());
+        EXPECT_EQ(4.0 + std::exp(3.0), root->Eval(ST));
+        EXPECT_TRUE(root->IsValidated());
+
+        // a shared node reaches every parent, and the dependencies follow
+        auto shared = BinaryOperator::Add(y, Constant::Make(1.0));
+        auto a = Exp::Make(shared);
+        auto b = Log::Make(shared);
+        EXPECT_TRUE(a->Dependencies()->Contains(y->Id()));
+        EXPECT_TRUE(b->Dependencies()->Contains(y->Id()));
+        shared->Rebind(0, x);
+        EXPECT_FALSE(a->Dependencies()->Contains(y->Id()));
+        EXPECT_TRUE(b->Dependencies()->Contains(x->Id()));
+}
+
+TEST(Expr,GraphContext){
+        SymbolTable ST;
+        ST("x", 0.7);
+        ST("y", 1.3);
+
+        std::shared_ptr<Operator> survivor;
+        {
+                GraphContext ctx;
+                {
+                        GraphContext::Scope scope(ctx);
+                        auto x = ExogenousSymbol::Make("x");
+                        auto y = ExogenousSymbol::Make("y");
+                        auto expr = BinaryOperator::Mul(Exp::Make(x), BinaryOperator::Div(y, x));
+                        auto d = expr->Diff("x");
+                        EXPECT_LT(0, ctx.LiveNodes());
+                        EXPECT_FLOAT_EQ(std::exp(0.7) * 1.3 / 0.7, expr->Eval(ST));
+                        EXPECT_FLOAT_EQ(std::exp(0.7) * 1.3 / 0.7 - std::exp(0.7) * 1.3 / (0.7 * 0.7), d->Eval(ST));
+                        survivor = d;
+                }
+                // nodes made outside a scope don't come from the arena
+                auto live = ctx.LiveNodes();
+                auto other = Constant::Make(1.0);
+                EXPECT_EQ(live, ctx.LiveNodes());
+        }
+        // the arena outlives its context while nodes still refer to it
+        EXPECT_FLOAT_EQ(std::exp(0.7) * 1.3 / 0.7 - std::exp(0.7) * 1.3 / (0.7 * 0.7), survivor->Eval(ST));
+        survivor.reset();
+
+        GraphContext ctx;
+        {
+                GraphContext::Scope scope(ctx);
+                auto x = ExogenousSymbol::Make("x");
+                x->Diff("x");
+        }
+        EXPECT_EQ(0, ctx.LiveNodes());
+}
+
+TEST(Expr,StructuralHash){
+        auto build = [](double c){
+                auto x = ExogenousSymbol::Make("x");
+                auto s = EndgenousSymbol::Make("s", Exp::Make(x));
+                return BinaryOperator::Mul(s, BinaryOperator::Add(s, Constant::Make(c)));
+        };
+        auto a = build(0.5);
+        auto b = build(0.5);
+        auto c = build(0.5000001);
+        EXPECT_NE(a, b);
+        EXPECT_EQ(a->StructuralHash(), b->StructuralHash());
+        EXPECT_TRUE(a->StructurallyEquals(*b));
+        EXPECT_FALSE(a->ShallowEquals(*b));
+        EXPECT_NE(a->StructuralHash(), c->StructuralHash());
+        EXPECT_FALSE(a->StructurallyEquals(*c));
+
+        // operands are ordered
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        EXPECT_FALSE(BinaryOperator::Sub(x, y)->StructurallyEquals(*BinaryOperator::Sub(y, x)));
+        EXPECT_TRUE(BinaryOperator::Sub(x, y)->ShallowEquals(*BinaryOperator::Sub(x, y)));
+
+        // the cached hash follows in place mutation
+        auto hash = b->StructuralHash();
+        b->At(1)->Rebind(1, Constant::Make(0.5000001));
+        EXPECT_NE(hash, b->StructuralHash());
+        EXPECT_EQ(c->StructuralHash(), b->StructuralHash());
+}
+
+TEST(Expr,DiffShared){
+        // each statement of the chain uses the previous expression
+        // three times, so an unshared derivative grows as 3^depth
+        size_t depth = 30;
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        std::shared_ptr<Operator> head = x;
+        for(size_t idx=0;idx!=depth;++idx){
+                head = BinaryOperator::Add(BinaryOperator::Mul(head, head), BinaryOperator::Mul(head, y));
+        }
+        DiffContext ctx(SymbolRegistry::Intern("x"));
+        auto d = ctx.Diff(head);
+        EXPECT_LE(ctx.Size(), 5 * depth + 3);
+
+        std::unordered_set<Operator const*> nodes;
+        std::vector<Operator const*> stack{d.get()};
+        for(;stack.size();){
+                auto node = stack.back();
+                stack.pop_back();
+                if( ! nodes.insert(node).second )
+                        continue;
+                for(auto const& child : node->Children() )
+                        stack.push_back(child.get());
+        }
+        EXPECT_LT(nodes.size(), 20 * depth);
+
+        // nothing here depends on z
+        auto dz = head->Diff("z");
+        EXPECT_TRUE(DiffContext::IsZero(dz));
+
+        SymbolTable ST;
+        ST("x", 0.1);
+        ST("y", 0.2);
+        // f(x) = x*x + x*y, f' = 2x + y
+        auto small = BinaryOperator::Add(BinaryOperator::Mul(x, x), BinaryOperator::Mul(x, y));
+        EXPECT_FLOAT_EQ(0.4, small->Diff("x")->Eval(ST));
+        // d/dy x^y = x^y log(x)
+        EXPECT_FLOAT_EQ(std::pow(0.1, 0.2) * std::log(0.1), BinaryOperator::Pow(x, y)->Diff("y")->Eval(ST));
+}
+
+TEST(Expr,HashCons){
+        auto build = [](){
+                auto x = ExogenousSymbol::Make("x");
+                auto y = ExogenousSymbol::Make("y");
+                return BinaryOperator::Mul(
+                        Exp::Make(BinaryOperator::Add(x, Constant::Make(1.0))),
+                        BinaryOperator::Add(BinaryOperator::Add(x, Constant::Make(1.0)), y));
+        };
+        EXPECT_NE(build(), build());
+
+        HashConsContext ctx;
+        HashConsContext::Scope scope(ctx);
+        auto expr = build();
+        EXPECT_EQ(expr, build());
+        // x + 1 is shared within the expression
+        EXPECT_EQ(expr->At(0)->At(0), expr->At(1)->At(0));
+        // d/dx exp(x*y) = exp(x*y) * y reuses the exp node
+        auto e = Exp::Make(BinaryOperator::Mul(ExogenousSymbol::Make("x"), ExogenousSymbol::Make("y")));
+        auto d = e->Diff("x");
+        EXPECT_EQ(e, d->At(0));
+        EXPECT_LT(0, ctx.Hits());
+
+        SymbolTable ST;
+        ST("x", 0.5);
+        ST("y", 2.0);
+        EXPECT_FLOAT_EQ(std::exp(1.5) * 3.5, expr->Eval(ST));
+
+        // a mutated node no longer matches its key
+        auto sum = BinaryOperator::Add(ExogenousSymbol::Make("x"), Constant::Make(2.0));
+        sum->Rebind(1, Constant::Make(3.0));
+        auto fresh = BinaryOperator::Add(ExogenousSymbol::Make("x"), Constant::Make(2.0));
+        EXPECT_NE(sum, fresh);
+        EXPECT_FLOAT_EQ(2.5, fresh->Eval(ST));
+}
+
+
+TEST(Expr,Dependencies){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        auto z = ExogenousSymbol::Make("z");
+        auto xy = BinaryOperator::Mul(x, Exp::Make(y));
+        auto deps = xy->Dependencies();
+        EXPECT_EQ(2u, deps->Size());
+        EXPECT_TRUE(deps->Contains(x->Id()));
+        EXPECT_TRUE(deps->Contains(y->Id()));
+        EXPECT_FALSE(deps->Contains(z->Id()));
+        // sets are shared rather than copied
+        EXPECT_EQ(deps, BinaryOperator::Add(xy, x)->Dependencies());
+        EXPECT_TRUE(Constant::Make(2.0)->Dependencies()->Empty());
+
+        // statements are opaque
+        auto stmt = EndgenousSymbol::Make("__deps_stmt", xy);
+        auto use = BinaryOperator::Add(stmt, z);
+        EXPECT_TRUE(use->Dependencies()->Contains(stmt->Id()));
+        EXPECT_FALSE(use->Dependencies()->Contains(x->Id()));
+
+        // and follow in place mutation
+        use->Rebind(1, y);
+        EXPECT_FALSE(use->Dependencies()->Contains(z->Id()));
+        EXPECT_TRUE(use->Dependencies()->Contains(y->Id()));
+
+        // the second statement only depends on y, so no tangent is
+        // emitted for it in the x direction
+        Function f("deps_f");
+        f.AddArgument("x");
+        f.AddArgument("y");
+        auto s0 = f.AddStatement(EndgenousSymbol::Make("deps_s0", Exp::Make(y)));
+        auto s1 = f.AddStatement(EndgenousSymbol::Make("deps_s1", BinaryOperator::Mul(s0, x)));
+        std::stringstream code;
+        CodeGen::StringCodeGenerator{}.Emit(code, f);
+        EXPECT_EQ(std::string::npos, code.str().find("__diff_deps_s0_x"));
+        EXPECT_NE(std::string::npos, code.str().find("__diff_deps_s0_y"));
+        EXPECT_NE(std::string::npos, code.str().find("__diff_deps_s1_x"));
+        EXPECT_EQ(std::string::npos, code.str().find("0.0;"));
+}
+
+
+TEST(Expr,TotalDiff){
+        // each statement uses the previous one three times, inlining
+        // the statements makes a tree of 3^depth nodes
+        size_t depth = 25;
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        std::shared_ptr<Operator> head = x;
+        for(size_t idx=0;idx!=depth;++idx){
+                std::stringstream name;
+                name << "__total_stmt_" << idx;
+                head = EndgenousSymbol::Make(name.str(),
+                        BinaryOperator::Add(BinaryOperator::Mul(head, head), BinaryOperator::Mul(head, y)));
+        }
+
+        // statements are opaque to the partial derivative
+        EXPECT_TRUE(DiffContext::IsZero(head->Diff("x")));
+        EXPECT_TRUE(head->Dependencies(DiffMode_Total)->Contains(x->Id()));
+        EXPECT_FALSE(head->Dependencies(DiffMode_Partial)->Contains(x->Id()));
+
+        auto d = head->TotalDiff("x");
+        ASSERT_EQ(OPKind_EndgenousSymbol, d->Kind());
+        // at most one derivative statement per primal statement
+        std::unordered_set<Operator const*> nodes;
+        size_t statements = 0;
+        std::vector<Operator const*> stack{d.get()};
+        for(;stack.size();){
+                auto node = stack.back();
+                stack.pop_back();
+                if( ! nodes.insert(node).second )
+                        continue;
+                statements += ( node->Kind() == OPKind_EndgenousSymbol );
+                for(auto const& child : node->Children() )
+                        stack.push_back(child.get());
+        }
+        EXPECT_LE(statements, 2 * depth);
+        EXPECT_LT(nodes.size(), 20 * depth);
+
+        // f_{n+1} = f_n^2 + f_n y, f_{n+1}' = ( 2 f_n + y ) f_n'
+        SymbolTable ST;
+        ST("x", 0.1);
+        ST("y", 0.2);
+        double f = 0.1, df = 1.0;
+        for(size_t idx=0;idx!=depth;++idx){
+                df = ( 2 * f + 0.2 ) * df;
+                f = f * f + f * 0.2;
+        }
+        EXPECT_FLOAT_EQ(f, head->EvalMemoized(ST));
+        EXPECT_FLOAT_EQ(df, d->EvalMemoized(ST));
+
+        // only the statements depending on y are differentiated
+        auto s0 = EndgenousSymbol::Make("__total_s0", BinaryOperator::Mul(x, x));
+        auto s1 = EndgenousSymbol::Make("__total_s1", BinaryOperator::Mul(s0, y));
+        auto dy = s1->TotalDiff("y");
+        EXPECT_EQ(s0, dy);
+        EXPECT_FLOAT_EQ(0.01, dy->Eval(ST));
+}
+
+
+/*
+        runs f on a thread with a stack of a few hundred frames, so that
+        anything taking a frame per level of a graph overflows it at a
+        depth which is still quick to build
+ */
+template<class F>
+static void OnSmallStack(F f){
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstacksize(&attr, 256 * 1024);
+        pthread_t thread;
+        auto body = [](void* arg)->void*{
+                (*static_cast<F*>(arg))();
+                return nullptr;
+        };
+        ASSERT_EQ(0, pthread_create(&thread, &attr, body, &f));
+        pthread_join(thread, nullptr);
+        pthread_attr_destroy(&attr);
+}
+
+TEST(Expr,DeepDiff){
+        // f_{n+1} = f_n/2 + x so f_{n+1}' = f_n'/2 + 1, which tends to 2
+        double arg = 0.3;
+        double partial = 0.0, total = 0.0;
+        bool partial_of_statement_is_zero = false;
+        OnSmallStack([&](){
+                auto x = ExogenousSymbol::Make("x");
+                auto half = Constant::Make(0.5);
+
+                std::shared_ptr<Operator> expr = x;
+                for(size_t idx=0;idx!=5000;++idx){
+                        expr = BinaryOperator::Add(BinaryOperator::Mul(expr, half), x);
+                }
+                partial = CompiledExpression::Compile(expr->Diff("x"), {"x"}).Eval(&arg);
+
+                // the same through statements, each with its own
+                // derivative statement
+                std::shared_ptr<Operator> head = x;
+                for(size_t idx=0;idx!=2000;++idx){
+                        std::stringstream name;
+                        name << "__deep_stmt_" << idx;
+                        head = EndgenousSymbol::Make(name.str(),
+                                BinaryOperator::Add(BinaryOperator::Mul(head, half), x));
+                }
+                total = CompiledExpression::Compile(head->TotalDiff("x"), {"x"}).Eval(&arg);
+                partial_of_statement_is_zero = DiffContext::IsZero(head->Diff("x"));
+        });
+        EXPECT_NEAR(2.0, partial, 1e-12);
+        EXPECT_NEAR(2.0, total, 1e-12);
+        EXPECT_TRUE(partial_of_statement_is_zero);
+}
+
+
+TEST(Expr,Rewriter){
+        // each level refers to the one below twice, as a tree this is
+        // 2^depth nodes
+        size_t depth = 40;
+        auto x = ExogenousSymbol::Make("x");
+        auto one = Constant::Make(1.0);
+        auto zero = Constant::Make(0.0);
+        std::shared_ptr<Operator> head = x;
+        for(size_t idx=0;idx!=depth;++idx){
+                head = BinaryOperator::Add(
+                        BinaryOperator::Mul(head, one),
+                        BinaryOperator::Mul(Exp::Make(BinaryOperator::Add(head, zero)), x));
+        }
+        auto count = [](std::shared_ptr<Operator> const& root){
+                std::unordered_set<Operator const*> nodes;
+                std::vector<Operator const*> stack{root.get()};
+                for(;stack.size();){
+                        auto node = stack.back();
+                        stack.pop_back();
+                        if( ! nodes.insert(node).second )
+                                continue;
+                        for(auto const& child : node->Children() )
+                                stack.push_back(child.get());
+                }
+                return nodes.size();
+        };
+        size_t before = count(head);
+
+        // the copy is a DAG rather than a tree, and shares nothing
+        auto copy = head->Clone();
+        EXPECT_EQ(before, count(copy));
+        EXPECT_EQ(copy->At(0)->At(0), copy->At(1)->At(0)->At(0)->At(0));
+        EXPECT_NE(head->At(0), copy->At(0));
+
+        // each distinct node is folded once, the source is untouched
+        Transform::FoldZero folder;
+        auto folded = folder.Fold(head);
+        EXPECT_EQ(before, folder.Size());
+        EXPECT_EQ(before, count(head));
+        EXPECT_EQ(folded->At(0), folded->At(1)->At(0)->At(0));
+        EXPECT_LT(count(folded), before);
+
+        // Eval() walks the graph as a tree, the tape doesn't
+        SymbolTable ST;
+        ST("x", -3.0);
+        EXPECT_FLOAT_EQ(CompiledExpression::Compile(head).Eval(ST),
+                        CompiledExpression::Compile(folded).Eval(ST));
+
+        // in place, the statement is inlined into the node using it
+        auto stmt = EndgenousSymbol::Make("__rewriter_stmt", BinaryOperator::Mul(x, x));
+        auto use = BinaryOperator::Add(stmt, stmt);
+        Transform::RemoveEndo inliner(RewriteMode_InPlace);
+        EXPECT_EQ(use, inliner.Apply(use));
+        EXPECT_EQ(OPKind_BinaryOperator, use->At(0)->Kind());
+        EXPECT_EQ(use->At(0), use->At(1));
+        EXPECT_FLOAT_EQ(18.0, use->Eval(ST));
+}
+
+TEST(Expr,ValueNumbering){
+        auto a = ExogenousSymbol::Make("a");
+        auto b = ExogenousSymbol::Make("b");
+        auto c = ExogenousSymbol::Make("c");
+        auto two = Constant::Make(2.0);
+        auto three = Constant::Make(3.0);
+
+        Transform::GlobalValueNumbering gvn;
+        EXPECT_EQ(gvn.Apply(BinaryOperator::Mul(a, b)), gvn.Apply(BinaryOperator::Mul(b, a)));
+
+        auto abc = gvn.Apply(BinaryOperator::Add(BinaryOperator::Add(a, b), c));
+        EXPECT_EQ(abc, gvn.Apply(BinaryOperator::Add(a, BinaryOperator::Add(b, c))));
+        EXPECT_EQ(abc, gvn.Apply(BinaryOperator::Add(BinaryOperator::Add(c, a), b)));
+        // the chain is broken by the subtraction
+        EXPECT_NE(abc, gvn.Apply(BinaryOperator::Add(a, BinaryOperator::Sub(b, c))));
+
+        // constants in a chain are folded into one
+        auto six_a = gvn.Apply(BinaryOperator::Mul(Constant::Make(6.0), a));
+        EXPECT_EQ(six_a, gvn.Apply(BinaryOperator::Mul(BinaryOperator::Mul(two, a), three)));
+        EXPECT_EQ(a, gvn.Apply(BinaryOperator::Add(BinaryOperator::Add(two, a), Constant::Make(-2.0))));
+        EXPECT_EQ(OPKind_Constant, gvn.Apply(BinaryOperator::Mul(BinaryOperator::Mul(a, Constant::Make(0.0)), b))->Kind());
+
+        // the derivatives of a product are products of the same terms in
+        // different orders
+        auto expr = BinaryOperator::Div(
+                BinaryOperator::Mul(Exp::Make(BinaryOperator::Mul(a, b)), c),
+                BinaryOperator::Add(BinaryOperator::Mul(b, a), c));
+        auto count = [](OperatorVector const& roots){
+                std::unordered_set<Operator const*> nodes;
+                std::vector<Operator const*> stack;
+                for(auto const& root : roots)
+                        stack.push_back(root.get());
+                for(;stack.size();){
+                        auto node = stack.back();
+                        stack.pop_back();
+                        if( ! nodes.insert(node).second )
+                                continue;
+                        for(auto const& child : node->Children() )
+                                stack.push_back(child.get());
+                }
+                return nodes.size();
+        };
+        OperatorVector diffs{expr->Diff("a"), expr->Diff("b"), expr->Diff("c")};
+        OperatorVector numbered;
+        for(auto const& d : diffs){
+                numbered.push_back(gvn.Apply(d));
+        }
+        EXPECT_LT(count(numbered), count(diffs));
+
+        SymbolTable ST;
+        ST("a", 0.3);
+        ST("b", -1.1);
+        ST("c", 2.4);
+        for(size_t idx=0;idx!=diffs.size();++idx){
+                EXPECT_NEAR(diffs[idx]->Eval(ST), numbered[idx]->Eval(ST), 1e-12);
+        }
+}
+
+TEST(Expr,ValueNumberingShared){
+        // each level uses the one below twice, flattening through both
+        // uses would double the operands at every level
+        size_t depth = 40;
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        std::shared_ptr<Operator> sum = BinaryOperator::Add(x, y);
+        std::shared_ptr<Operator> product = BinaryOperator::Mul(x, y);
+        for(size_t idx=0;idx!=depth;++idx){
+                sum = BinaryOperator::Add(sum, sum);
+                product = BinaryOperator::Mul(product, product);
+        }
+
+        Transform::GlobalValueNumbering gvn;
+        auto numbered_sum = gvn.Apply(sum);
+        auto numbered_product = gvn.Apply(product);
+        EXPECT_LT(gvn.Values(), 100 * depth);
+
+        // the graphs are shared 2^depth times over, so they're only
+        // evaluated compiled
+        auto eval = [](std::shared_ptr<Operator> const& root, double x, double y){
+                double args[] = {x, y};
+                return CompiledExpression::Compile(root, {"x", "y"}).Eval(args);
+        };
+        EXPECT_DOUBLE_EQ(std::ldexp(1.0, depth), eval(numbered_sum, 0.75, 0.25));
+        // (3/16)^(2^40) underflows, so take a product near one, e^16,
+        // where squaring 40 times magnifies the rounding of the regrouped
+        // product
+        double near_one = 1.0 + std::ldexp(1.0, -36);
+        EXPECT_NEAR(1.0, eval(numbered_product, near_one, 1.0) / eval(product, near_one, 1.0), 1e-5);
+        EXPECT_NEAR(1.0, eval(product, near_one, 1.0) / std::exp(16.0), 1e-5);
+
+        // and extraction, which numbers the graph first
+        Transform::CommonSubtreeExtraction cse;
+        EXPECT_DOUBLE_EQ(std::ldexp(1.0, depth), eval(cse.Extract(sum), 0.75, 0.25));
+}
+
+TEST(Expr,CommonSubtree){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        // built twice, so they're only structurally equal
+        auto make_phi = [&](){ return Phi::Make(BinaryOperator::Div(x, y)); };
+        auto make_sum = [&](){ return BinaryOperator::Add(x, y); };
+        auto expr = BinaryOperator::Add(
+                BinaryOperator::Add(
+                        BinaryOperator::Mul(make_phi(), x),
+                        BinaryOperator::Mul(make_phi(), y)),
+                BinaryOperator::Mul(make_sum(), make_sum()));
+
+        SymbolTable ST;
+        ST("x", 0.7);
+        ST("y", 1.3);
+
+        // the division is only used by Phi once that's hoisted, and
+        // sharing an addition doesn't pay
+        Transform::CommonSubtreeExtraction cse;
+        auto result = cse.Extract(expr);
+        ASSERT_EQ(1, cse.Statements().size());
+        EXPECT_EQ("Phi", cse.Statements()[0]->Expr()->Name());
+        size_t uses = 0;
+        std::vector<std::shared_ptr<Operator> > stack{result};
+        for(;stack.size();){
+                auto head = stack.back();
+                stack.pop_back();
+                for(size_t idx=0;idx!=head->Arity();++idx){
+                        if( head->At(idx) == cse.Statements()[0] )
+                                ++uses;
+                        else
+                                stack.push_back(head->At(idx));
+                }
+        }
+        EXPECT_EQ(2, uses);
+        EXPECT_FLOAT_EQ(expr->Eval(ST), result->Eval(ST));
+
+        auto costly_add = Transform::CostTable::Default().Set("ADD", 10.0);
+        Transform::CommonSubtreeExtraction add_cse(costly_add);
+        add_cse.Extract(expr);
+        EXPECT_EQ(2, add_cse.Statements().size());
+
+        Transform::CommonSubtreeExtraction high_cse(Transform::CostTable::Default(), 1e6);
+        EXPECT_FLOAT_EQ(expr->Eval(ST), high_cse.Extract(expr)->Eval(ST));
+        EXPECT_EQ(0, high_cse.Statements().size());
+
+        // roots share statements, and the result is unchanged
+        auto d_x = expr->Diff("x");
+        auto d_y = expr->Diff("y");
+        auto roots = cse.Extract(OperatorVector{expr, d_x, d_y});
+        EXPECT_LT(0, cse.Statements().size());
+        for(size_t idx=1;idx<cse.Statements().size();++idx){
+                EXPECT_NE(cse.Statements()[idx-1]->Name(), cse.Statements()[idx]->Name());
+        }
+        EXPECT_FLOAT_EQ(expr->Eval(ST), roots[0]->EvalMemoized(ST));
+        EXPECT_FLOAT_EQ(d_x->Eval(ST), roots[1]->EvalMemoized(ST));
+        EXPECT_FLOAT_EQ(d_y->Eval(ST), roots[2]->EvalMemoized(ST));
+}
+
 
 
 enum InstructionKind{
@@ -292,17 +926,7 @@ TEST(Black,Numeric){
         double c_value = df_value * ( F_value * nd1_value - K_value * nd2_value );
         EXPECT_FLOAT_EQ(c_value, c->Eval(ST));
         
-        struct RemoveEndo : OperatorTransform{
-                virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                        auto candidate = ptr->Clone(shared_from_this());
-                        if( candidate->Kind() == OPKind_EndgenousSymbol ){
-                                if( auto typed = std::dynamic_pointer_cast<EndgenousSymbol>(candidate)){
-                                        return typed->Expr();
-                                }
-                        }
-                        return candidate;
-                }
-        };
+        using Transform::RemoveEndo;
         auto c_raw = c->Clone(std::make_shared<RemoveEndo>());
 
         EXPECT_FLOAT_EQ(c->Eval(ST), c_raw->Eval(ST));
@@ -443,7 +1067,7 @@ TEST(Black,Numeric){
                 return ( sig_bump - baseline ) / epsilon;
         };
         auto ana_diff = [&](auto sym){
-                return c_raw->Diff(sym)->Eval(ST);
+                return c->TotalDiff(sym)->EvalMemoized(ST);
         };
 
 
@@ -454,6 +1078,8 @@ TEST(Black,Numeric){
                 std::cout << "ana_diff(sym) => " << ana_diff(sym) << "\n"; // __CandyPrint__(cxx-print-scalar,ana_diff(sym))
 
                 EXPECT_FLOAT_EQ( ana_diff(sym), adj_diff(sym));
+                // the same as differentiating the inlined expression
+                EXPECT_FLOAT_EQ( c_raw->Diff(sym)->Eval(ST), ana_diff(sym));
         }
 
         InstructionBlock IB;
@@ -476,31 +1102,7 @@ TEST(Black,Numeric){
 }
 
 
-#include "Cady/Frontend.h"
-struct BlackScholesCallOption{
-        template<class Double>
-        struct Build{
-                Double Evaluate(
-                        Double t,
-                        Double T,
-                        Double r,
-                        Double S,
-                        Double K,
-                        Double vol )const
-                {
-                        using MathFunctions::Phi;
-                        using MathFunctions::Exp;
-                        using MathFunctions::Pow;
-                        using MathFunctions::Log;
-
-                        Double d1 = ((1.0 / ( vol * Pow((T - t),0.5) )) * ( Log(S / K) +   (r + ( Pow(vol,2.0) ) / 2 ) * (T - t) ));
-                        Double d2 = d1 - vol * (T - t);
-                        Double pv = K * Exp( -r * ( T - t ) );
-                        Double black = Phi(d1) * S - Phi(d2) * pv;
-                        return black;
-                }
-        };
-};
+#include "BlackScholes.h"
 
 
 TEST(Kernel,Black){
@@ -532,6 +1134,14 @@ TEST(Kernel,Black){
         std::cout << "expr->Kind() => " << expr->Kind() << "\n"; // __CandyPrint__(cxx-print-scalar,expr->Kind())
 }
 
+TEST(Kernel,ConsedInputs){
+        HashConsContext ctx;
+        HashConsContext::Scope scope(ctx);
+        // inputs go through the factories like any other node
+        EXPECT_EQ(ExogenousSymbol::Make("S"), DoubleKernel::BuildFromExo("S").as_operator_());
+        EXPECT_EQ(DoubleKernel::BuildFromExo("K").as_operator_(), DoubleKernel::BuildFromExo("K").as_operator_());
+}
+
 /*
         struct BaseName{
                 struct ResultType{
@@ -731,17 +1341,7 @@ struct NaiveBlackSingleProfile : ProfileFunction{
 
                 auto expr = as_black.as_operator_();
 
-                struct RemoveEndo : OperatorTransform{
-                        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                                auto candidate = ptr->Clone(shared_from_this());
-                                if( candidate->Kind() == OPKind_EndgenousSymbol ){
-                                        if( auto typed = std::dynamic_pointer_cast<EndgenousSymbol>(candidate)){
-                                                return typed->Expr();
-                                        }
-                                }
-                                return candidate;
-                        }
-                };
+                using Transform::RemoveEndo;
                 auto single_expr = std::reinterpret_pointer_cast<EndgenousSymbol>(expr)->Expr()->Clone(std::make_shared<RemoveEndo>());
 
 
@@ -751,7 +1351,7 @@ struct NaiveBlackSingleProfile : ProfileFunction{
 
         }
 };
-struct RemapUnique : OperatorTransform{
+struct RemapUnique : Rewriter{
         explicit RemapUnique(std::string const& prefix = "__symbol_")
                 : prefix_{prefix}
         {
@@ -763,14 +1363,14 @@ struct RemapUnique : OperatorTransform{
         void mutate_prefix(std::string const& prefix){
                 prefix_ = prefix;
         }
-        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
+protected:
+        virtual std::shared_ptr<Operator> Rewrite(std::shared_ptr<Operator> const& ptr)override{
 
-                auto candidate = ptr->Clone(shared_from_this());
+                auto candidate = Rebuild(ptr);
 
-                auto key = std::make_tuple(
-                        candidate->NameInvariantOfChildren(),
-                        candidate->Children()
-                        );
+                // the children have already been remapped, so they're
+                // unique and comparing them by pointer is enough
+                auto const& key = candidate;
 
                 auto iter = ops_.find(key);
                 if( iter != ops_.end() )
@@ -797,12 +1397,11 @@ struct RemapUnique : OperatorTransform{
         }
 private:
         std::string prefix_;
-        std::map<
-                std::tuple<
-                        std::string,
-                        std::vector<std::shared_ptr<Operator> > 
-                >,
-                std::shared_ptr<Operator>
+        std::unordered_map<
+                std::shared_ptr<Operator>,
+                std::shared_ptr<Operator>,
+                OperatorHash,
+                OperatorShallowEqual
         > ops_;
 };
 struct NaiveBlackThreeAddressProfile : ProfileFunction{
@@ -873,23 +1472,16 @@ struct NaiveBlackForwardThreeAddressProfile : ProfileFunction{
                 }
                 ResultMapping["c"] = deps.DepthFirst.back()->Name();
                 
-                struct RemoveEndo : OperatorTransform{
-                        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                                auto candidate = ptr->Clone(shared_from_this());
-                                if( candidate->Kind() == OPKind_EndgenousSymbol ){
-                                        if( auto typed = std::dynamic_pointer_cast<EndgenousSymbol>(candidate)){
-                                                return typed->Expr();
-                                        }
-                                }
-                                return candidate;
-                        }
-                };
+                using Transform::RemoveEndo;
                 auto single_expr = std::reinterpret_pointer_cast<EndgenousSymbol>(expr)->Expr()->Clone(std::make_shared<RemoveEndo>());
 
                 std::vector<std::string> exo{ "t", "T", "r", "S", "K", "vol" };
                 #if 1
+                // the derivatives of products repeat the same terms in
+                // different orders
+                Transform::GlobalValueNumbering gvn;
                 for(auto sym : exo ){
-                        auto sym_diff = single_expr->Diff(sym);
+                        auto sym_diff = gvn.Apply(single_expr->Diff(sym));
                         #if 0
                         auto sym_diff_unique = EndgenousSymbol::Make("d_"+sym,sym_diff->Clone(std::make_shared<RemapUnique>("__d_" + sym)));
                         #endif
@@ -950,17 +1542,7 @@ struct NaiveBlackADThreeAddressProfile : ProfileFunction{
                 }
                 ResultMapping["c"] = deps.DepthFirst.back()->Name();
                 
-                struct RemoveEndo : OperatorTransform{
-                        virtual std::shared_ptr<Operator> Apply(std::shared_ptr<Operator> const& ptr){
-                                auto candidate = ptr->Clone(shared_from_this());
-                                if( candidate->Kind() == OPKind_EndgenousSymbol ){
-                                        if( auto typed = std::dynamic_pointer_cast<EndgenousSymbol>(candidate)){
-                                                return typed->Expr();
-                                        }
-                                }
-                                return candidate;
-                        }
-                };
+                using Transform::RemoveEndo;
                 auto single_expr = std::reinterpret_pointer_cast<EndgenousSymbol>(expr)->Expr()->Clone(std::make_shared<RemoveEndo>());
                 auto expr_deps = unique->DepthFirstAnySymbolicDependencyAndThis();
 
@@ -1044,5 +1626,108 @@ TEST(ProfileGen,A){
         cg.EmitCode(out);
 }
 
+TEST(Expr,StrengthReduce){
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        SymbolTable ST;
+        ST("x", 2.3);
+        ST("y", -0.7);
+
+        auto code = [](std::shared_ptr<Operator> const& ptr){
+                std::stringstream ss;
+                ptr->EmitCode(ss);
+                return ss.str();
+        };
+        auto reduce = [&](std::shared_ptr<Operator> const& expr){
+                Transform::StrengthReduce pass;
+                auto result = pass.Apply(expr);
+                EXPECT_NEAR(expr->Eval(ST), result->Eval(ST), 1e-12) << code(expr);
+                return result;
+        };
+
+        EXPECT_EQ("std::sqrt(x)", code(reduce(BinaryOperator::Pow(x, Constant::Make(0.5)))));
+        EXPECT_EQ("((1)/(std::sqrt(x)))", code(reduce(BinaryOperator::Pow(x, Constant::Make(-0.5)))));
+        EXPECT_EQ("((x)*(x))", code(reduce(BinaryOperator::Pow(x, Constant::Make(2.0)))));
+        EXPECT_EQ("((y)*(0.25))", code(reduce(BinaryOperator::Div(y, Constant::Make(4.0)))));
+        EXPECT_EQ("(-(x))", code(reduce(BinaryOperator::Mul(Constant::Make(-1.0), x))));
+        EXPECT_EQ("((y)/(x))", code(reduce(BinaryOperator::Mul(y, BinaryOperator::Div(Constant::Make(1.0), x)))));
+        // the negation cancels, and the other folds into the subtraction
+        EXPECT_EQ("((y)-(((x)/(y))))", code(reduce(
+                BinaryOperator::Add(
+                        y,
+                        BinaryOperator::Mul(
+                                UnaryOperator::UnaryMinus(UnaryOperator::UnaryMinus(UnaryOperator::UnaryMinus(x))),
+                                BinaryOperator::Pow(y, Constant::Make(-1.0)))))));
+        // not a cheaper form
+        EXPECT_EQ("std::pow(x, 0.3)", code(reduce(BinaryOperator::Pow(x, Constant::Make(0.3)))));
+
+        auto sqrt = Sqrt::Make(BinaryOperator::Mul(x, x));
+        EXPECT_NEAR(2 * 2.3 / ( 2 * std::sqrt(2.3 * 2.3) ), sqrt->Diff("x")->Eval(ST), 1e-12);
+        EXPECT_FLOAT_EQ(sqrt->Eval(ST), CompiledExpression::Compile(sqrt).Eval(ST));
 
+        // the greeks of Black
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto black = as_black.as_operator_()->Clone(std::make_shared<Transform::RemoveEndo>());
+        SymbolTable black_ST;
+        black_ST("t"  , 0.0);
+        black_ST("T"  , 10.0);
+        black_ST("r"  , 0.04);
+        black_ST("S"  , 50);
+        black_ST("K"  , 60);
+        black_ST("vol", 0.2);
+        auto count_pow = [&](std::shared_ptr<Operator> const& ptr){
+                auto text = code(ptr);
+                size_t n = 0;
+                for(size_t pos = text.find("std::pow");pos != std::string::npos;pos = text.find("std::pow", pos+1))
+                        ++n;
+                return n;
+        };
+        Transform::StrengthReduce pass;
+        for(auto sym : { "t", "T", "r", "S", "K", "vol" }){
+                auto greek = Transform::FoldZero{}.Fold(black->Diff(sym));
+                auto reduced = pass.Apply(greek);
+                EXPECT_EQ(0, count_pow(reduced)) << sym;
+                EXPECT_NEAR(greek->Eval(black_ST), reduced->Eval(black_ST), 1e-12) << sym;
+        }
+}
 
+TEST(Expr,NormalDensity){
+        auto x = ExogenousSymbol::Make("x");
+        SymbolTable ST;
+        ST("x", -1.3);
+
+        // Phi' is the density node, not exp(0 - 0.5*pow(x, 2))/2.50663
+        auto phi = Phi::Make(x);
+        auto d_phi = phi->Diff("x");
+        EXPECT_EQ("NormalDensity", d_phi->Name());
+        EXPECT_EQ(Normal::Density(-1.3), d_phi->Eval(ST));
+        EXPECT_NEAR(1.3 * Normal::Density(-1.3), d_phi->Diff("x")->Eval(ST), 1e-15);
+        EXPECT_EQ(Normal::Cdf(-1.3), phi->Eval(ST));
+
+        double value = 0.0;
+        EXPECT_EQ(Normal::Cdf(-1.3), Normal::Cdf(-1.3, value));
+        EXPECT_EQ(Normal::Density(-1.3), value);
+        std::stringstream density;
+        d_phi->EmitCode(density);
+        EXPECT_EQ("(0.3989422804014327*std::exp(-std::pow((x)/std::sqrt(2.0), 2.0)))", density.str());
+
+        // constants are emitted with enough digits to round trip
+        auto code = [](double value){
+                std::stringstream ss;
+                Constant::Make(value)->EmitCode(ss);
+                return ss.str();
+        };
+        EXPECT_EQ("0.3", code(0.3));
+        EXPECT_EQ("2.5066282746310002", code(2.5066282746310002));
+        for(double value : { 0.1, 1.0 / 3, 2.5066282746310002, 1e-300, -123456.789 }){
+                EXPECT_EQ(value, std::strtod(code(value).c_str(), nullptr));
+        }
+}
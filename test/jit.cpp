@@ -0,0 +1,209 @@
+#include <gtest/gtest.h>
+#include "Cady/Cady.h"
+#include "Cady/Jit.h"
+#include "Cady/KernelCache.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+TEST(Jit,Function){
+        Function f("jit_f");
+        f.AddArgument("x");
+        f.AddArgument("y");
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        f.AddStatement(EndgenousSymbol::Make("stmt0", BinaryOperator::Add(BinaryOperator::Mul(x, y), Exp::Make(x))));
+
+        auto kernel = JitKernel::Compile(f);
+
+        double args[] = {0.5, 3.0};
+        double d_args[2];
+        double value = (*kernel)(args, d_args);
+        EXPECT_FLOAT_EQ(0.5 * 3.0 + std::exp(0.5), value);
+        EXPECT_FLOAT_EQ(3.0 + std::exp(0.5), d_args[0]);
+        EXPECT_FLOAT_EQ(0.5, d_args[1]);
+        EXPECT_FLOAT_EQ(value, kernel->Get()(args, nullptr));
+}
+
+TEST(Jit,Black){
+        auto ad_kernel = BlackScholesCallOption::Build<DoubleKernel>{};
+        auto as_black = ad_kernel.Evaluate(
+                DoubleKernel::BuildFromExo("t"),
+                DoubleKernel::BuildFromExo("T"),
+                DoubleKernel::BuildFromExo("r"),
+                DoubleKernel::BuildFromExo("S"),
+                DoubleKernel::BuildFromExo("K"),
+                DoubleKernel::BuildFromExo("vol")
+        );
+        auto expr = as_black.as_operator_();
+
+        auto kernel = JitKernel::Compile("jit_black", expr, {"t", "T", "r", "S", "K", "vol"});
+
+        SymbolTable ST;
+        ST("t"  , 0.0);
+        ST("T"  , 10.0);
+        ST("r"  , 0.04);
+        ST("S"  , 50);
+        ST("K"  , 60);
+        ST("vol", 0.2);
+
+        double args[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+        double d_args[6];
+        EXPECT_FLOAT_EQ(expr->Eval(ST), (*kernel)(args, d_args));
+
+        double epsilon = 1e-6;
+        for(size_t idx=0;idx!=6;++idx){
+                double up[6], down[6];
+                std::copy(args, args + 6, up);
+                std::copy(args, args + 6, down);
+                up[idx]   += epsilon;
+                down[idx] -= epsilon;
+                double fd = ( (*kernel)(up) - (*kernel)(down) ) / ( 2 * epsilon );
+                EXPECT_NEAR(fd, d_args[idx], 1e-4 * std::max(1.0, std::fabs(fd)));
+        }
+}
+
+TEST(Jit,FusedNormal){
+        Function f("jit_phi");
+        f.AddArgument("x");
+        f.AddArgument("y");
+        auto x = ExogenousSymbol::Make("x");
+        auto y = ExogenousSymbol::Make("y");
+        f.AddStatement(EndgenousSymbol::Make("jit_phi_stmt", Phi::Make(BinaryOperator::Mul(x, y))));
+
+        // Phi and the density in its partials come from one scaling
+        std::stringstream code;
+        CodeGen::StringCodeGenerator{}.Emit(code, f);
+        EXPECT_NE(std::string::npos, code.str().find("double jit_phi_stmt = __normal_cdf_0;"));
+        EXPECT_NE(std::string::npos, code.str().find("__normal_pdf_0"));
+        EXPECT_EQ(std::string::npos, code.str().find("__normal_z_1"));
+
+        auto kernel = JitKernel::Compile(f);
+        double args[] = {-0.7, 1.9};
+        double d_args[2];
+        double value = (*kernel)(args, d_args);
+        EXPECT_DOUBLE_EQ(Normal::Cdf(-0.7 * 1.9), value);
+        EXPECT_DOUBLE_EQ(Normal::Density(-0.7 * 1.9) * 1.9, d_args[0]);
+        EXPECT_DOUBLE_EQ(Normal::Density(-0.7 * 1.9) * -0.7, d_args[1]);
+}
+
+TEST(Jit,CompileError){
+        Function f("jit_bad");
+        JitOptions opts;
+        opts.Compiler = "false";
+        f.AddArgument("x");
+        f.AddStatement(EndgenousSymbol::Make("stmt0", ExogenousSymbol::Make("x")));
+        EXPECT_THROW(JitKernel::Compile(f, opts), std::domain_error);
+
+        opts.Compiler = "/no/such/compiler";
+        EXPECT_THROW(JitKernel::Compile(f, opts), std::domain_error);
+}
+
+TEST(Jit,LiteralPaths){
+        // nothing in the paths is interpreted by a shell
+        char dir_template[] = "/tmp/cady_jit_test_XXXXXX";
+        ASSERT_TRUE( ::mkdtemp(dir_template) );
+        std::string base = dir_template;
+        // through a shell this would be split and the build would fail
+        std::string odd = base + "/with space;echo $HOME";
+        ASSERT_EQ(0, ::mkdir(odd.c_str(), 0700));
+
+        Function f("jit_literal");
+        f.AddArgument("x");
+        f.AddStatement(EndgenousSymbol::Make("stmt0", Exp::Make(ExogenousSymbol::Make("x"))));
+        JitOptions opts;
+        opts.TempDirectory = odd;
+        auto kernel = JitKernel::Compile(f, opts);
+        double args[] = {0.5};
+        EXPECT_FLOAT_EQ(std::exp(0.5), (*kernel)(args));
+
+        ::rmdir(odd.c_str());
+        ::rmdir(base.c_str());
+}
+
+namespace{
+        std::shared_ptr<Operator> MakeCacheExpr(double scale){
+                auto x = ExogenousSymbol::Make("x");
+                auto y = ExogenousSymbol::Make("y");
+                return BinaryOperator::Mul(Constant::Make(scale), BinaryOperator::Add(BinaryOperator::Mul(x, y), Exp::Make(x)));
+        }
+        std::string CachePath(std::string const& dir, KernelCache const& cache, char const* name, double scale){
+                auto key = cache.Key(JitKernel::MakeFunction(name, MakeCacheExpr(scale), {"x", "y"}));
+                char buffer[17];
+                std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(key));
+                return dir + "/" + buffer + ".so";
+        }
+        bool Exists(std::string const& path){
+                struct stat st;
+                return ::stat(path.c_str(), &st) == 0;
+        }
+        // the cache directory is flat
+        void RemoveDirectory(std::string const& dir){
+                if( auto handle = ::opendir(dir.c_str()) ){
+                        while( auto entry = ::readdir(handle) ){
+                                std::string name = entry->d_name;
+                                if( name != "." && name != ".." )
+                                        ::unlink((dir + "/" + name).c_str());
+                        }
+                        ::closedir(handle);
+                }
+                ::rmdir(dir.c_str());
+        }
+} // end namespace anonymous
+
+TEST(KernelCache,HitMissAndIntegrity){
+        char dir_template[] = "/tmp/cady_cache_test_XXXXXX";
+        ASSERT_TRUE( ::mkdtemp(dir_template) );
+        std::string dir = dir_template;
+
+        double args[] = {0.5, 3.0};
+        double expected = 2.0 * ( 0.5 * 3.0 + std::exp(0.5) );
+        {
+                KernelCache cache(dir);
+                auto kernel = cache.Get("cached", MakeCacheExpr(2.0), {"x", "y"});
+                EXPECT_FLOAT_EQ(expected, (*kernel)(args));
+                EXPECT_EQ(1, cache.Misses());
+                EXPECT_EQ(0, cache.Hits());
+        }
+
+        // a fresh cache, as on the next process start, with the graph rebuilt
+        KernelCache cache(dir);
+        EXPECT_EQ(cache.Key(JitKernel::MakeFunction("cached", MakeCacheExpr(2.0), {"x", "y"})),
+                  cache.Key(JitKernel::MakeFunction("cached", MakeCacheExpr(2.0), {"x", "y"})));
+        EXPECT_NE(cache.Key(JitKernel::MakeFunction("cached", MakeCacheExpr(2.0), {"x", "y"})),
+                  cache.Key(JitKernel::MakeFunction("cached", MakeCacheExpr(2.0000001), {"x", "y"})));
+        auto kernel = cache.Get("cached", MakeCacheExpr(2.0), {"x", "y"});
+        EXPECT_FLOAT_EQ(expected, (*kernel)(args));
+        EXPECT_EQ(0, cache.Misses());
+        EXPECT_EQ(1, cache.Hits());
+
+        // corrupt the shared object, which must be rebuilt rather than loaded
+        auto cached_path = CachePath(dir, cache, "cached", 2.0);
+        auto other_path  = CachePath(dir, cache, "other", 3.0);
+        auto other = cache.Get("other", MakeCacheExpr(3.0), {"x", "y"});
+        {
+                std::ofstream out(other_path, std::ios::app);
+                out << "garbage";
+        }
+        KernelCache reopened(dir);
+        other = reopened.Get("other", MakeCacheExpr(3.0), {"x", "y"});
+        EXPECT_EQ(1, reopened.Misses());
+        EXPECT_FLOAT_EQ(1.5 * expected, (*other)(args));
+
+        // with no room only the most recent entry survives
+        EXPECT_TRUE(Exists(cached_path));
+        EXPECT_TRUE(Exists(other_path));
+        KernelCache small(dir, 1);
+        small.Evict();
+        EXPECT_FALSE(Exists(cached_path));
+        EXPECT_FALSE(Exists(other_path));
+        small.Get("cached", MakeCacheExpr(2.0), {"x", "y"});
+        EXPECT_TRUE(Exists(cached_path));
+        small.Get("other", MakeCacheExpr(3.0), {"x", "y"});
+        EXPECT_FALSE(Exists(cached_path));
+        EXPECT_TRUE(Exists(other_path));
+        EXPECT_EQ(2, small.Misses());
+        EXPECT_EQ(0, small.Hits());
+
+        RemoveDirectory(dir);
+}
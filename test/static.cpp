@@ -0,0 +1,59 @@
+#include <gtest/gtest.h>
+#include "Cady/StaticExpr.h"
+#include "BlackScholes.h"
+
+using namespace Cady;
+
+TEST(Static,Black){
+        using Static::Exp;
+        using Static::Log;
+        using Static::Phi;
+        using Static::Pow;
+
+        Static::Arg<0> t;
+        Static::Arg<1> T;
+        Static::Arg<2> r;
+        Static::Arg<3> S;
+        Static::Arg<4> K;
+        Static::Arg<5> vol;
+
+        auto tau   = T - t;
+        auto d1    = ( 1.0 / ( vol * Pow(tau, 0.5) ) ) * ( Log(S / K) + ( r + Pow(vol, 2.0) / 2 ) * tau );
+        auto d2    = d1 - vol * tau;
+        auto pv    = K * Exp( -r * tau );
+        auto black = Phi(d1) * S - Phi(d2) * pv;
+        static_assert( decltype(black)::Arity == 6, "six arguments" );
+
+        double args[] = {0.0, 10.0, 0.04, 50, 60, 0.2};
+        auto expected = BlackScholesCallOption::Build<Dual<6> >{}.Evaluate(
+                Dual<6>::Variable(args[0], 0),
+                Dual<6>::Variable(args[1], 1),
+                Dual<6>::Variable(args[2], 2),
+                Dual<6>::Variable(args[3], 3),
+                Dual<6>::Variable(args[4], 4),
+                Dual<6>::Variable(args[5], 5)
+        );
+
+        EXPECT_FLOAT_EQ(expected.Value(), black.Value(args));
+        double d_args[6];
+        EXPECT_FLOAT_EQ(expected.Value(), black.Gradient(args, d_args));
+        for(size_t idx=0;idx!=6;++idx){
+                EXPECT_NEAR(expected.D(idx), d_args[idx], 1e-12);
+        }
+}
+
+TEST(Static,Mixed){
+        using Static::Sin;
+        using Static::Cos;
+        using Static::Pow;
+
+        Static::Arg<0> x;
+        Static::Arg<1> y;
+        auto f = 2 * Sin(x) * Cos(y) - Pow(3.0, y) + x / 4;
+        double args[] = {0.3, 1.1};
+        double d_args[2];
+        double value = f.Gradient(args, d_args);
+        EXPECT_FLOAT_EQ(2 * std::sin(0.3) * std::cos(1.1) - std::pow(3.0, 1.1) + 0.3 / 4, value);
+        EXPECT_FLOAT_EQ(2 * std::cos(0.3) * std::cos(1.1) + 0.25, d_args[0]);
+        EXPECT_FLOAT_EQ(-2 * std::sin(0.3) * std::sin(1.1) - std::pow(3.0, 1.1) * std::log(3.0), d_args[1]);
+}